@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "diff.hpp"
+#include "difftree.hpp"
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
+namespace {
+
+bool compose_node(DiffNode &node, DiffNode &next, std::string &err_msg);
+bool emit_node(DiffNode &node, Json::Value &diff_json, std::string &err_msg);
+
+// Two consecutive X / I / C / L diffs of one value
+bool compose_values(Json::Value &diff, Json::Value &next, std::string &err_msg) {
+    const DiffType diff_type = get_diff_type(diff), next_type = get_diff_type(next);
+    if (diff_type == DiffType::Replace) {
+        return apply_diff(diff, next, err_msg);
+    }
+    if (diff_type != next_type) {
+        RET_ERROR("Cannot compose diffs of types " + std::string{static_cast<char>(diff_type)} + " and " +
+                  std::string{static_cast<char>(next_type)});
+    }
+    Json::Value &value = diff["v"], &next_value = next["v"];
+    switch (diff_type) {
+        case DiffType::Increment: {
+            Json::Int64 sum;
+            if (value.isInt64() && next_value.isInt64() &&
+                !__builtin_add_overflow(value.asInt64(), next_value.asInt64(), &sum)) {
+                value = sum;
+            } else if (value.isIntegral() && next_value.isIntegral()) {
+                RET_ERROR("Cannot compose increments : integer overflow");
+            } else {
+                value = value.asDouble() + next_value.asDouble();
+            }
+            return true;
+        }
+        case DiffType::AppendString:
+            if (!value.isString() || !next_value.isString()) {
+                RET_ERROR("Cannot apply 'C': Appended value is not a string");
+            }
+            value = value.asString() + next_value.asString();
+            return true;
+        case DiffType::AppendArray:
+            if (!value.isArray() || !next_value.isArray()) {
+                RET_ERROR("Cannot apply 'L': Appended value is not an array");
+            }
+            for (auto &item : next_value) {
+                value.append(Json::Value()).swap(item);
+            }
+            return true;
+        default:
+            RET_ERROR("Cannot patch a deleted value");
+    }
+}
+
+// Pieces of next refer to positions in the value made by pieces, the result refers to the value before both
+// Position of every piece in the value they make, returns its length
+int64_t piece_offsets(const std::vector<DiffPiece> &pieces, bool is_array, std::vector<int64_t> &offsets) {
+    int64_t offset = 0;
+    for (auto &piece : pieces) {
+        offsets.push_back(offset);
+        int64_t length = piece.length(is_array);
+        offset = length == INT64_MAX ? INT64_MAX : offset + length;
+    }
+    return offset;
+}
+
+bool compose_pieces(std::vector<DiffPiece> &pieces, std::vector<DiffPiece> &next, bool is_array, std::vector<DiffPiece> &result,
+                    std::string &err_msg) {
+    std::vector<int64_t> offsets;
+    const int64_t length = piece_offsets(pieces, is_array, offsets);
+
+    for (auto &next_piece : next) {
+        if (!next_piece.is_old) {
+            result.push_back(std::move(next_piece));
+            continue;
+        }
+        int64_t start = next_piece.start;
+        int64_t end = next_piece.end == OPEN_END ? INT64_MAX : next_piece.end;
+        if (end != INT64_MAX && end > length) {
+            RET_ERROR("Cannot compose diffs : range past the end of the patched value");
+        }
+        // First piece that overlaps [start, end)
+        size_t i = std::upper_bound(offsets.begin(), offsets.end(), start) - offsets.begin();
+        for (i = i == 0 ? 0 : i - 1; i < pieces.size() && offsets[i] < end; i++) {
+            DiffPiece &piece = pieces[i];
+            int64_t piece_length = piece.length(is_array);
+            int64_t piece_end = piece_length == INT64_MAX ? INT64_MAX : offsets[i] + piece_length;
+            int64_t from = std::max(start, offsets[i]) - offsets[i];
+            int64_t to = std::min(end, piece_end);
+            to = to == INT64_MAX ? INT64_MAX : to - offsets[i];
+            if (from >= to) continue;
+            if (piece.is_old) {
+                int old_end = to == INT64_MAX ? OPEN_END : piece.start + (int)to;
+                push_old(result, piece.start + (int)from, old_end);
+            } else if (is_array) {
+                // Array items are only kept once
+                push_new(result, std::move(piece.value));
+            } else {
+                push_new(result, piece.value.asString().substr(from, to - from));
+            }
+        }
+    }
+    return true;
+}
+
+// Ends the open last piece of an array once the length it makes is known, which gives the old length
+bool close_pieces(std::vector<DiffPiece> &pieces, int64_t new_length, int &old_length, std::string &err_msg) {
+    if (pieces.empty() || !pieces.back().is_old || pieces.back().end != OPEN_END) {
+        RET_ERROR("Cannot compose diffs : array length is not known");
+    }
+    int64_t known = 0;
+    for (size_t i = 0; i + 1 < pieces.size(); i++) {
+        known += pieces[i].length(true);
+    }
+    DiffPiece &last = pieces.back();
+    if (new_length < known || last.start + (new_length - known) >= OPEN_END) {
+        RET_ERROR("Cannot compose diffs : array lengths do not match");
+    }
+    last.end = last.start + (int)(new_length - known);
+    old_length = last.end;
+    if (last.start == last.end) pieces.pop_back();
+    return true;
+}
+
+bool compose_arrays(DiffNode &node, DiffNode &next, std::string &err_msg) {
+    // A reordering diff gives the length of the array it patches
+    std::vector<int64_t> offsets;
+    if (node.length == -1 && next.length != -1) {
+        if (!close_pieces(node.pieces, next.length, node.length, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+    } else if (node.length != -1 && next.length == -1) {
+        int unused;
+        if (!close_pieces(next.pieces, piece_offsets(node.pieces, true, offsets), unused, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+        offsets.clear();
+    }
+
+    // Items patched by next, by their position after the first diff
+    const int64_t offset = piece_offsets(node.pieces, true, offsets);
+    for (auto &pair : next.items) {
+        size_t i = std::upper_bound(offsets.begin(), offsets.end(), (int64_t)pair.first) - offsets.begin() - 1;
+        if (i >= node.pieces.size() || (offset != INT64_MAX && pair.first >= offset)) {
+            RET_ERROR("Array index does not exist : " + std::to_string(pair.first));
+        }
+        DiffPiece &piece = node.pieces[i];
+        if (piece.is_old) {
+            if (!compose_node(node.items[piece.start + (int)(pair.first - offsets[i])], pair.second, err_msg)) {
+                RET_ERROR(err_msg);
+            }
+        } else {
+            Json::Value item_diff;
+            if (!emit_node(pair.second, item_diff, err_msg) || !apply_diff(piece.value, item_diff, err_msg)) {
+                RET_ERROR(err_msg);
+            }
+        }
+    }
+
+    std::vector<DiffPiece> pieces;
+    if (!compose_pieces(node.pieces, next.pieces, true, pieces, err_msg)) {
+        RET_ERROR(err_msg);
+    }
+    node.pieces.swap(pieces);
+
+    // Patches of items deleted by next are dropped
+    std::vector<std::pair<int, int>> kept;
+    for (auto &piece : node.pieces) {
+        if (piece.is_old) kept.emplace_back(piece.start, piece.end);
+    }
+    std::sort(kept.begin(), kept.end());
+    for (auto it = node.items.begin(); it != node.items.end();) {
+        auto range = std::upper_bound(kept.begin(), kept.end(), std::make_pair(it->first, INT_MAX));
+        if (range == kept.begin() || (range - 1)->second <= it->first) {
+            it = node.items.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
+bool compose_node(DiffNode &node, DiffNode &next, std::string &err_msg) {
+    if (next.is_unchanged()) {
+        return true;
+    }
+    if (node.is_unchanged()) {
+        node = std::move(next);
+        return true;
+    }
+
+    if (next.kind == DiffNode::Value) {
+        const DiffType next_type = get_diff_type(next.value);
+        if (next_type == DiffType::Replace || next_type == DiffType::Delete) {
+            node = std::move(next);
+            return true;
+        }
+        if (node.kind != DiffNode::Value) {
+            RET_ERROR("Cannot compose an append or increment after a patch");
+        }
+        return compose_values(node.value, next.value, err_msg);
+    }
+    if (node.kind == DiffNode::Value) {
+        const DiffType diff_type = get_diff_type(node.value);
+        if (diff_type == DiffType::Delete) {
+            RET_ERROR("Cannot patch a deleted value");
+        }
+        if (diff_type != DiffType::Replace) {
+            RET_ERROR("Cannot compose a patch after an append or increment, the length of the value is not known");
+        }
+        Json::Value next_diff;
+        if (!emit_node(next, next_diff, err_msg) || !apply_diff(node.value, next_diff, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+        return true;
+    }
+
+    if (next.kind != DiffNode::Unknown && !set_node_kind(node, next.kind, err_msg)) {
+        RET_ERROR(err_msg);
+    }
+    if (node.kind != DiffNode::Unknown && !set_node_kind(next, node.kind, err_msg)) {
+        RET_ERROR(err_msg);
+    }
+    switch (node.kind) {
+        case DiffNode::Unknown:
+        case DiffNode::Object:
+            for (auto &pair : next.children) {
+                if (!compose_node(node.children[pair.first], pair.second, err_msg)) {
+                    RET_ERROR(err_msg);
+                }
+            }
+            return true;
+        case DiffNode::Array:
+            return compose_arrays(node, next, err_msg);
+        case DiffNode::String: {
+            std::vector<DiffPiece> pieces;
+            if (!compose_pieces(node.pieces, next.pieces, false, pieces, err_msg)) {
+                RET_ERROR(err_msg);
+            }
+            node.pieces.swap(pieces);
+            return true;
+        }
+        default:
+            RET_ERROR("Unreachable code");
+    }
+}
+
+std::string range_key(int start, int end) { return std::to_string(start) + ":" + std::to_string(end); }
+
+bool emit_array(DiffNode &node, Json::Value &diff_json, std::string &err_msg) {
+    diff_json["_t"] = "A";
+    for (auto &pair : node.items) {
+        Json::Value item_diff;
+        if (!emit_node(pair.second, item_diff, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+        if (get_diff_type(item_diff) != DiffType::Unchanged) {
+            diff_json[std::to_string(pair.first)].swap(item_diff);
+        }
+    }
+
+    bool in_order = true;
+    int pos = 0;
+    for (auto &piece : node.pieces) {
+        if (!piece.is_old) continue;
+        in_order = in_order && piece.start >= pos;
+        pos = piece.end;
+    }
+
+    Json::Value inserted = Json::arrayValue;
+    if (in_order) {
+        pos = 0;
+        for (auto &piece : node.pieces) {
+            if (!piece.is_old) {
+                inserted.append(Json::Value()).swap(piece.value);
+                continue;
+            }
+            if (piece.start > pos || inserted.size() > 0) {
+                diff_json[range_key(pos, piece.start)].swap(inserted);
+                inserted = Json::arrayValue;
+            }
+            pos = piece.end;
+        }
+        if (pos != OPEN_END) {
+            if (node.length == -1) {
+                RET_ERROR("Cannot compose diffs : array length is not known");
+            }
+            if (pos < node.length || inserted.size() > 0) {
+                diff_json[range_key(pos, node.length)].swap(inserted);
+            }
+        }
+    } else {
+        // Kept items are listed in their new order, inserted items are placed before the next kept one
+        if (node.length == -1) {
+            RET_ERROR("Cannot compose diffs : array length is not known");
+        }
+        Json::Value &order = diff_json[">"] = Json::arrayValue;
+        std::vector<std::pair<int, int>> kept;
+        for (auto &piece : node.pieces) {
+            if (!piece.is_old) {
+                inserted.append(Json::Value()).swap(piece.value);
+                continue;
+            }
+            if (inserted.size() > 0) {
+                diff_json[range_key(piece.start, piece.start)].swap(inserted);
+                inserted = Json::arrayValue;
+            }
+            if (piece.end - piece.start == 1) {
+                order.append(piece.start);
+            } else {
+                Json::Value &range = order.append(Json::arrayValue);
+                range.append(piece.start);
+                range.append(piece.end);
+            }
+            kept.emplace_back(piece.start, piece.end);
+        }
+        if (inserted.size() > 0) {
+            diff_json[range_key(node.length, node.length)].swap(inserted);
+        }
+        std::sort(kept.begin(), kept.end());
+        pos = 0;
+        kept.emplace_back(node.length, node.length);
+        for (auto &range : kept) {
+            if (range.first > pos) {
+                diff_json[range_key(pos, range.first)] = Json::arrayValue;
+            }
+            pos = range.second;
+        }
+    }
+
+    if (diff_json.size() == 1) {
+        diff_json = DIFF_UNCHANGED;
+    }
+    return true;
+}
+
+bool emit_string(DiffNode &node, Json::Value &diff_json, std::string &err_msg) {
+    // Old ranges kept in place, chosen from the back since the open end always stays in place
+    std::vector<bool> in_place(node.pieces.size(), false);
+    int64_t bound = INT64_MAX;
+    for (size_t i = node.pieces.size(); i-- > 0;) {
+        DiffPiece &piece = node.pieces[i];
+        int64_t end = piece.end == OPEN_END ? INT64_MAX : piece.end;
+        if (piece.is_old && end <= bound) {
+            in_place[i] = true;
+            bound = piece.start;
+        }
+    }
+
+    diff_json["_t"] = "S";
+    Json::Value replacement = Json::arrayValue;
+    bool only_strings = true;
+    int pos = 0;
+    for (size_t i = 0; i < node.pieces.size(); i++) {
+        DiffPiece &piece = node.pieces[i];
+        if (!in_place[i]) {
+            if (piece.is_old) {
+                Json::Value &range = replacement.append(Json::arrayValue);
+                range.append(piece.start);
+                range.append(piece.end);
+                only_strings = false;
+            } else {
+                replacement.append(Json::Value()).swap(piece.value);
+            }
+            continue;
+        }
+        if (piece.start > pos || replacement.size() > 0) {
+            Json::Value &splice = diff_json[range_key(pos, piece.start)];
+            if (only_strings) {
+                std::string str;
+                for (auto &part : replacement) str += part.asString();
+                splice = str;
+            } else {
+                splice.swap(replacement);
+            }
+            replacement = Json::arrayValue;
+            only_strings = true;
+        }
+        pos = piece.end;
+    }
+
+    if (replacement.size() > 0) {
+        RET_ERROR("Cannot compose diffs : string patch past the end");
+    }
+    if (diff_json.size() == 1) {
+        diff_json = DIFF_UNCHANGED;
+    }
+    return true;
+}
+
+bool emit_node(DiffNode &node, Json::Value &diff_json, std::string &err_msg) {
+    switch (node.kind) {
+        case DiffNode::Value:
+            diff_json.swap(node.value);
+            return true;
+        case DiffNode::Array:
+            return emit_array(node, diff_json, err_msg);
+        case DiffNode::String:
+            return emit_string(node, diff_json, err_msg);
+        case DiffNode::Object:
+        case DiffNode::Unknown:
+            break;
+    }
+
+    // Children of a value of unknown type are reached through paths, which only needs their patches to be of one type
+    std::vector<std::pair<const std::string *, Json::Value>> children;
+    bool same_type = true, all_indices = true;
+    for (auto &pair : node.children) {
+        Json::Value child_diff;
+        if (!emit_node(pair.second, child_diff, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+        DiffType child_type = get_diff_type(child_diff);
+        if (child_type == DiffType::Unchanged) continue;
+        int index;
+        all_indices = all_indices && parse_diff_index(pair.first, index);
+        same_type = same_type && (child_type == DiffType::PatchObject || child_type == DiffType::PatchArray ||
+                                  child_type == DiffType::PatchString) &&
+                    (children.empty() || child_type == get_diff_type(children[0].second));
+        children.emplace_back(&pair.first, Json::Value());
+        children.back().second.swap(child_diff);
+    }
+    if (children.empty()) {
+        diff_json = DIFF_UNCHANGED;
+        return true;
+    }
+
+    if (node.kind == DiffNode::Unknown && same_type) {
+        diff_json["_t"] = children[0].second["_t"];
+        for (auto &child : children) {
+            for (Json::Value::iterator it = child.second.begin(); it != child.second.end(); ++it) {
+                std::string key = it.key().asString();
+                if (key == "_t") continue;
+                diff_json[*child.first + "/" + key].swap(*it);
+            }
+        }
+        return true;
+    }
+    if (node.kind == DiffNode::Unknown && all_indices) {
+        RET_ERROR("Cannot compose diffs : type of the value at a path is not known");
+    }
+    // Non numeric segments are only valid for objects
+    diff_json["_t"] = "P";
+    for (auto &child : children) {
+        diff_json[*child.first].swap(child.second);
+    }
+    return true;
+}
+
+}  // namespace
+
+bool compose_diff(const Json::Value &first, const Json::Value &second, Json::Value &diff_json,
+                  std::string &err_msg) {
+    return compose_diff(std::vector<const Json::Value *>{&first, &second}, diff_json, err_msg);
+}
+
+bool compose_diff(const std::vector<const Json::Value *> &diffs, Json::Value &diff_json, std::string &err_msg) {
+    // Diffs are merged as nodes and only the result is turned back into a diff
+    DiffNode node;
+    for (const Json::Value *diff : diffs) {
+        DiffNode next;
+        if (!parse_diff_node(*diff, next, err_msg) || !compose_node(node, next, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+    }
+    Json::Value composed;
+    if (!emit_node(node, composed, err_msg)) {
+        RET_ERROR(err_msg);
+    }
+    diff_json.swap(composed);
+    return true;
+}
@@ -1,14 +1,33 @@
 
 #include "diff.hpp"
+#include "diff_impl.hpp"
+#include "workpool.hpp"
 #include <math.h>
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iterator>
+#include <limits>
+#include <map>
+#include <string_view>
 #include <sstream>
 #include <string>
 #include <vector>
 
-#define MERGE_THRES 6
+// Strings are diffed byte by byte up to this many changed bytes, and chunk by chunk above it
+#define STRING_DIFF_CHAR_LIMIT 16384
+#define STRING_DIFF_MAX_COST 256
+// Changed ranges closer than this are merged into one hunk
+#define STRING_HUNK_MIN_GAP 12
+// Content defined chunks of 64 bytes to 4 KB, 512 bytes on average
+#define STRING_CHUNK_MIN 64
+#define STRING_CHUNK_MAX 4096
+#define STRING_CHUNK_MASK 0xff80000000000000ULL
+// Hunks of large strings from this size on may reference moved chunks of the old string
+#define STRING_REF_MIN_HUNK 256
 
 #define DEBUG(var) std::cout << #var << " = " << var << std::endl;
 
@@ -18,17 +37,39 @@
 #define RET_JSON(_ret_json) \
     diff_json = _ret_json;  \
     return true;
+// Hands a diff built locally over without copying it
+#define RET_DIFF(_diff)     \
+    diff_json.swap(_diff);  \
+    return true;
 
-#define FOR_EACH_DIFF_KEY(_diff, _key_name, _body)                                  \
-    for (Json::Value::const_iterator it = _diff.begin(); it != _diff.end(); ++it) { \
-        std::string _key_name = it.key().asString();                                \
-        if (_key_name == "_t") continue;                                            \
-        _body                                                                       \
+// Name of a diff type as a static string, so that diff markers are stored and copied without allocating
+const char *diff_type_name(DiffType diffType) {
+    switch (diffType) {
+        case DiffType::Delete:
+            return "X";
+        case DiffType::Unchanged:
+            return "U";
+        case DiffType::Replace:
+            return "R";
+        case DiffType::PatchString:
+            return "S";
+        case DiffType::PatchArray:
+            return "A";
+        case DiffType::PatchObject:
+            return "P";
+        case DiffType::AppendArray:
+            return "L";
+        case DiffType::AppendString:
+            return "C";
+        case DiffType::Increment:
+            return "I";
     }
+    return "U";
+}
 
 Json::Value make_diff_json(DiffType diffType) {
     Json::Value val;
-    val["_t"] = std::string{static_cast<char>(diffType)};
+    val[Json::StaticString("_t")] = Json::StaticString(diff_type_name(diffType));
     return val;
 }
 
@@ -36,68 +77,464 @@ Json::Value DIFF_DELETE = make_diff_json(DiffType::Delete);
 
 Json::Value DIFF_UNCHANGED = make_diff_json(DiffType::Unchanged);
 
-DiffType get_diff_type(Json::Value &val) {
+JsonHash HashCache::get(const Json::Value &val) {
     const auto type = val.type();
-    if (type == Json::ValueType::objectValue && val.isMember("_t")) {
-        return static_cast<DiffType>(val["_t"].asString()[0]);
+    if (type != Json::ValueType::arrayValue && type != Json::ValueType::objectValue) {
+        // Leaves are cheap enough to hash on every call
+        JsonHash h = mix_hash(type);
+        switch (type) {
+            case Json::ValueType::intValue:
+                return combine_hash(h, val.asLargestInt());
+            case Json::ValueType::uintValue:
+                return combine_hash(h, val.asLargestUInt());
+            case Json::ValueType::realValue: {
+                double d = val.asDouble();
+                if (d == 0) d = 0;  // -0.0 == 0.0
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                return combine_hash(h, bits);
+            }
+            case Json::ValueType::booleanValue:
+                return combine_hash(h, val.asBool());
+            case Json::ValueType::stringValue: {
+                const char *begin, *end;
+                val.getString(&begin, &end);
+                return combine_hash(h, hash_bytes(begin, end));
+            }
+            default:
+                return h;
+        }
+    }
+
+    const JsonHash *cached = find(val);
+    if (cached != nullptr) {
+        return *cached;
+    }
+
+    JsonHash h = combine_hash(mix_hash(type), val.size());
+    for (Json::Value::const_iterator it = val.begin(); it != val.end(); ++it) {
+        if (type == Json::ValueType::objectValue) {
+            const char *begin, *end;
+            begin = it.memberName(&end);
+            h = combine_hash(h, hash_bytes(begin, end));
+        }
+        h = combine_hash(h, get(*it));
+    }
+
+    hashes[&val] = h;
+    return h;
+}
+
+HashCache::HashCache(const HashCache *base, std::pmr::memory_resource *resource)
+    : hashes(resource), base(base), transient(base->transient) {
+    // Empty caches stay empty while caches are stacked on them, lookups skip them
+    while (this->base != nullptr && this->base->hashes.empty()) {
+        this->base = this->base->base;
+    }
+}
+
+const JsonHash *HashCache::find(const Json::Value &val) const {
+    for (const HashCache *cache = this; cache != nullptr; cache = cache->base) {
+        auto cached = cache->hashes.find(&val);
+        if (cached != cache->hashes.end()) return &cached->second;
+    }
+    return nullptr;
+}
+
+void HashCache::merge(const HashCache &layer) {
+    hashes.insert(layer.hashes.begin(), layer.hashes.end());
+}
+
+void HashCache::forget(const Json::Value &val) {
+    if (!val.isArray() && !val.isObject()) return;
+    hashes.erase(&val);
+    for (Json::Value::const_iterator it = val.begin(); it != val.end(); ++it) {
+        forget(*it);
     }
-    return DiffType::Replace;
 }
 
-bool goto_path(Json::Value **target_obj, std::string &last_key, std::string &path, std::string &err_msg) {
-    int prev_sep_ind = -1;
-    int next_sep_ind;
-    while ((next_sep_ind = path.find('/', prev_sep_ind + 1)) != std::string::npos) {
-        std::string target_key = path.substr(prev_sep_ind + 1, next_sep_ind - (prev_sep_ind + 1));
-        prev_sep_ind = next_sep_ind;
+void HashCache::copy_to(const Json::Value &src, const Json::Value &dst, HashCache &dst_hashes) const {
+    if (!src.isArray() && !src.isObject()) return;
+    auto cached = hashes.find(&src);
+    if (cached != hashes.end()) {
+        dst_hashes.hashes[&dst] = cached->second;
+    }
+    Json::Value::const_iterator dst_it = dst.begin();
+    for (Json::Value::const_iterator it = src.begin(); it != src.end(); ++it, ++dst_it) {
+        copy_to(*it, *dst_it, dst_hashes);
+    }
+}
+
+// Members and items of the two levels below val, counted up to limit, as an estimate of the work below it
+inline size_t subtree_weight(const Json::Value &val, size_t limit) {
+    size_t weight = 1;
+    if (!val.isObject() && !val.isArray()) return weight;
+    for (Json::Value::const_iterator it = val.begin(); it != val.end() && weight < limit; ++it) {
+        weight += 1 + it->size();
+    }
+    return weight;
+}
+
+// True when parallel diffs hash the children of both subtrees on the pool instead of both subtrees at once
+inline bool is_parallel(const Json::Value &old_json, const Json::Value &new_json, const DiffOptions &options) {
+    if (options.pool == nullptr) return false;
+    size_t limit = options.parallel_min_size;
+    return subtree_weight(old_json, limit) + subtree_weight(new_json, limit) >= limit;
+}
+
+// True when the cached hashes prove both subtrees are identical
+inline bool same_hash(const Json::Value &old_json, const Json::Value &new_json, const DiffOptions &options) {
+    if (options.old_hashes == nullptr || options.new_hashes == nullptr) return false;
+    if (is_parallel(old_json, new_json, options)) {
+        // Large subtrees that are not hashed yet are diffed, which hashes their children in parallel
+        const JsonHash *old_hash = options.old_hashes->find(old_json);
+        const JsonHash *new_hash = options.new_hashes->find(new_json);
+        return old_hash != nullptr && new_hash != nullptr && *old_hash == *new_hash;
+    }
+    return options.old_hashes->get(old_json) == options.new_hashes->get(new_json);
+}
+
+DiffType get_diff_type(const Json::Value &val) {
+    if (val.type() != Json::ValueType::objectValue) {
+        return DiffType::Replace;
+    }
+    const Json::Value *type = val.find("_t", "_t" + 2);
+    if (type == nullptr) {
+        return DiffType::Replace;
+    }
+    const char *begin, *end;
+    if (!type->getString(&begin, &end) || begin == end) {
+        // Not a diff type, rejected by apply_diff
+        return static_cast<DiffType>(0);
+    }
+    return static_cast<DiffType>(*begin);
+}
+
+// Non negative decimal number that fits in an int, leading zeros are allowed
+inline bool parse_index(std::string_view str, int &value) {
+    if (str.empty() || str.size() > 10) return false;
+    int64_t result = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9') return false;
+        result = result * 10 + (c - '0');
+    }
+    if (result > std::numeric_limits<int>::max()) return false;
+    value = static_cast<int>(result);
+    return true;
+}
+
+void split_diff_path(std::string_view path, std::vector<PathSegment> &segments) {
+    segments.clear();
+    size_t begin = 0;
+    while (true) {
+        size_t end = path.find('/', begin);
+        PathSegment &segment = segments.emplace_back();
+        segment.name = path.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+        size_t sep = segment.name.find(':');
+        if (sep == std::string_view::npos) {
+            segment.is_index = parse_index(segment.name, segment.start);
+            segment.end = segment.start + 1;
+        } else {
+            segment.is_range = parse_index(segment.name.substr(0, sep), segment.start) &&
+                               parse_index(segment.name.substr(sep + 1), segment.end);
+        }
+        if (end == std::string_view::npos) break;
+        begin = end + 1;
+    }
+}
+
+// Member of an object or null, nullptr if missing
+inline Json::Value *find_member(Json::Value &obj, std::string_view name) {
+    // jsoncpp 1.7 only has a const find
+    return const_cast<Json::Value *>(obj.find(name.data(), name.data() + name.size()));
+}
+
+// State of one apply_diff call
+struct ApplyContext {
+    HashCache *hashes;
+    // Segments of the key being applied, reused for all keys. Only valid until the next goto_path.
+    std::vector<PathSegment> path;
+};
+
+// Walks all but the last segment of key, which is returned in last. Nodes passed on the way
+// are invalidated in the hash cache since they are about to be modified.
+bool goto_path(Json::Value **target_obj, PathSegment &last, std::string_view key, std::string &err_msg,
+               ApplyContext &ctx) {
+    split_diff_path(key, ctx.path);
+    for (size_t i = 0; i + 1 < ctx.path.size(); i++) {
+        const PathSegment &segment = ctx.path[i];
         auto target_type = (*target_obj)->type();
         if (target_type == Json::ValueType::objectValue) {
-            if ((*target_obj)->isMember(target_key)) {
-                *target_obj = &(**target_obj)[target_key];
-            } else {
-                RET_ERROR("Path to non-existent object : " + target_key);
+            Json::Value *member = find_member(**target_obj, segment.name);
+            if (member == nullptr) {
+                RET_ERROR("Path to non-existent object : " + std::string(segment.name));
             }
+            *target_obj = member;
         } else if (target_type == Json::ValueType::arrayValue) {
-            int idx = std::stoi(target_key);
-            if ((*target_obj)->isValidIndex(idx)) {
-                *target_obj = &(**target_obj)[idx];
-            } else {
-                RET_ERROR("Array index does not exist : " + target_key);
+            if (!segment.is_index || !(*target_obj)->isValidIndex(segment.start)) {
+                RET_ERROR("Array index does not exist : " + std::string(segment.name));
             }
+            *target_obj = &(**target_obj)[segment.start];
         } else {
-            RET_ERROR("Cannot go inside non object :" + target_key);
+            RET_ERROR("Cannot go inside non object :" + std::string(segment.name));
+        }
+        if (ctx.hashes != nullptr) ctx.hashes->invalidate(**target_obj);
+    }
+    last = ctx.path.back();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Encoded sizes, the diff picks the smallest shape in the encoding it is sent in
+
+size_t number_size(const Json::Value &val, DiffEncoding encoding) {
+    if (encoding == DiffEncoding::Binary) {
+        switch (val.type()) {
+            case Json::ValueType::intValue: {
+                int64_t v = val.asLargestInt();
+                return 1 + varint_size((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+            }
+            case Json::ValueType::uintValue:
+                return 1 + varint_size(val.asLargestUInt());
+            default:
+                return 9;
+        }
+    }
+
+    char buf[32];
+    if (val.isDouble() && !std::isfinite(val.asDouble())) {
+        // Written as null, 1e+9999 or -1e+9999
+        double d = val.asDouble();
+        return d != d ? 4 : (d < 0 ? 8 : 7);
+    }
+    switch (val.type()) {
+        case Json::ValueType::intValue:
+            return snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(val.asLargestInt()));
+        case Json::ValueType::uintValue:
+            return snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(val.asLargestUInt()));
+        default:
+            return snprintf(buf, sizeof(buf), "%.17g", val.asDouble());
+    }
+}
+
+size_t json_string_size(const char *begin, const char *end) {
+    size_t size = 2 + (end - begin);
+    for (const char *c = begin; c != end; c++) {
+        switch (*c) {
+            case '"':
+            case '\\':
+            case '\b':
+            case '\f':
+            case '\n':
+            case '\r':
+            case '\t':
+                size += 1;
+                break;
+            default:
+                // \u00XX
+                if (*c >= 0 && *c <= 0x1f) size += 5;
         }
     }
-    last_key = path.substr(prev_sep_ind + 1);
+    return size;
+}
+
+inline size_t string_size(std::string_view str, DiffEncoding encoding) {
+    if (encoding == DiffEncoding::Binary) {
+        return 1 + varint_size(str.size()) + str.size();
+    }
+    return json_string_size(str.data(), str.data() + str.size());
+}
+
+// Parses a canonical decimal as the binary encoding does ("0", "17", not "017")
+inline bool parse_segment_index(std::string_view s, uint64_t &v) {
+    if (s.empty() || s.size() > 18 || (s[0] == '0' && s.size() > 1)) return false;
+    v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (c - '0');
+    }
     return true;
 }
 
-bool merge_with_children(Json::Value &diff_json, std::string &err_msg) {
+// Bytes of a path of a diff key in the binary encoding, without its segment count
+size_t binary_segments_size(std::string_view path) {
+    size_t size = 0;
+    for (size_t start = 0;;) {
+        size_t end = path.find('/', start);
+        std::string_view seg = path.substr(start, end == std::string_view::npos ? end : end - start);
+        uint64_t first, last;
+        size_t colon = seg.find(':');
+        if (parse_segment_index(seg, first)) {
+            size += varint_size(first << 2 | 2);
+        } else if (colon != std::string_view::npos && parse_segment_index(seg.substr(0, colon), first) &&
+                   parse_segment_index(seg.substr(colon + 1), last) && first <= last) {
+            size += varint_size(first << 2 | 3) + varint_size(last - first);
+        } else {
+            size += binary_name_size(seg.size());
+        }
+        if (end == std::string_view::npos) return size;
+        start = end + 1;
+    }
+}
+
+void add_encoded_size(const Json::Value &val, DiffEncoding encoding, size_t limit, size_t &size) {
+    const bool binary = encoding == DiffEncoding::Binary;
+    switch (val.type()) {
+        case Json::ValueType::nullValue:
+            size += binary ? 1 : 4;
+            return;
+        case Json::ValueType::booleanValue:
+            size += binary ? 1 : (val.asBool() ? 4 : 5);
+            return;
+        case Json::ValueType::intValue:
+        case Json::ValueType::uintValue:
+        case Json::ValueType::realValue:
+            size += number_size(val, encoding);
+            return;
+        case Json::ValueType::stringValue: {
+            const char *begin, *end;
+            val.getString(&begin, &end);
+            size += string_size(std::string_view(begin, end - begin), encoding);
+            return;
+        }
+        case Json::ValueType::arrayValue:
+            size += binary ? 1 + varint_size(val.size()) : 2 + (val.empty() ? 0 : val.size() - 1);
+            for (Json::ArrayIndex i = 0; i < val.size() && size <= limit; i++) {
+                add_encoded_size(val[i], encoding, limit, size);
+            }
+            return;
+        case Json::ValueType::objectValue:
+            break;
+    }
+
+    if (!binary) {
+        size += 2 + (val.empty() ? 0 : val.size() - 1);
+        for (Json::Value::const_iterator it = val.begin(); it != val.end() && size <= limit; ++it) {
+            const char *end;
+            const char *begin = it.memberName(&end);
+            size += json_string_size(begin, end) + 1;
+            add_encoded_size(*it, encoding, limit, size);
+        }
+        return;
+    }
+
+    // Same tags as encode_value of wireformat.cpp
+    DiffType diff_type = get_diff_type(val);
+    switch (diff_type) {
+        case DiffType::Delete:
+        case DiffType::Unchanged:
+            if (val.size() == 1) {
+                size += 1;
+                return;
+            }
+            break;
+        case DiffType::AppendArray:
+        case DiffType::AppendString:
+        case DiffType::Increment:
+            if (val.size() == 2 && val.isMember("v")) {
+                size += 1;
+                add_encoded_size(val["v"], encoding, limit, size);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    const bool is_patch = diff_type == DiffType::PatchObject || diff_type == DiffType::PatchArray ||
+                          diff_type == DiffType::PatchString;
+    size += 1 + varint_size(is_patch ? val.size() - 1 : val.size());
+    for (Json::Value::const_iterator it = val.begin(); it != val.end() && size <= limit; ++it) {
+        const char *end;
+        const char *begin = it.memberName(&end);
+        std::string_view key(begin, end - begin);
+        if (!is_patch) {
+            size += binary_name_size(key.size());
+        } else if (key != "_t") {
+            size += varint_size(std::count(key.begin(), key.end(), '/') + 1) + binary_segments_size(key);
+        } else {
+            continue;
+        }
+        add_encoded_size(*it, encoding, limit, size);
+    }
+}
+
+size_t encoded_size(const Json::Value &val, DiffEncoding encoding, size_t limit) {
+    size_t size = 0;
+    add_encoded_size(val, encoding, limit, size);
+    return size;
+}
+
+/**
+ * Bytes saved by flattening a patch with num_entries entries, nested under key in a patch of the same type, into
+ * paths of the parent. Negative if nesting is smaller.
+ */
+long flatten_saving(std::string_view key, size_t num_entries, DiffEncoding encoding) {
+    const long n = num_entries;
+    if (encoding == DiffEncoding::Binary) {
+        // Nested: the path of key, the tag and the count of the patch. Flattened: the segments of key in every path.
+        long segments = binary_segments_size(key);
+        long path = varint_size(std::count(key.begin(), key.end(), '/') + 1) + segments;
+        return path + 1 + (long)varint_size(n) - n * segments;
+    }
+    // Nested: "key":{"_t":"P",...} and the commas of the entries. Flattened: "key/" in front of every entry.
+    long quoted = json_string_size(key.data(), key.data() + key.size()) - 2;
+    return quoted + 14 - n * (quoted + 1);
+}
+
+// Replaces diff_json, a patch of new_json, by new_json when sending that is no larger than options allow
+void replace_if_smaller(Json::Value &diff_json, const Json::Value &new_json, const DiffOptions &options) {
+    if (get_diff_type(diff_json) == DiffType::Unchanged) return;
+    size_t max_size = max_replace_size(encoded_size(diff_json, options.encoding), options);
+    if (encoded_size(new_json, options.encoding, max_size) <= max_size) {
+        diff_json = new_json;
+    }
+}
+
+// Key of the member the iterator of a diff points at
+inline std::string_view diff_key(const Json::Value::iterator &it) {
+    const char *end;
+    const char *begin = it.memberName(&end);
+    return std::string_view(begin, end - begin);
+}
+
+bool merge_with_children(Json::Value &diff_json, std::string &err_msg, const DiffOptions &options) {
     int num_patch_array = 0;
     int num_patch_string = 0;
     int num_patch_object = 0;
     DiffType diff_type = get_diff_type(diff_json);
 
+    // Children are moved into their flattened paths, paths added here are visited and flattened again
     std::vector<std::string> to_remove;
-    FOR_EACH_DIFF_KEY(diff_json, diff_key, {
-        Json::Value child_diff = diff_json[diff_key];
-        DiffType child_diff_type = get_diff_type(child_diff);
-        if (child_diff_type == diff_type && child_diff.size() < MERGE_THRES) {
-            FOR_EACH_DIFF_KEY(child_diff, child_diff_key, {
-                diff_json[diff_key + "/" + child_diff_key] = child_diff[child_diff_key];
-            })
-            to_remove.push_back(diff_key);
+    std::string key;
+    for (Json::Value::iterator it = diff_json.begin(); it != diff_json.end(); ++it) {
+        std::string_view name = diff_key(it);
+        if (name == "_t") continue;
+        Json::Value &child_diff = *it;
+        if (get_diff_type(child_diff) != diff_type || (int)child_diff.size() >= options.merge_threshold ||
+            flatten_saving(name, child_diff.size() - 1, options.encoding) < 0) {
+            continue;
+        }
+        for (Json::Value::iterator child_it = child_diff.begin(); child_it != child_diff.end(); ++child_it) {
+            std::string_view child_name = diff_key(child_it);
+            if (child_name == "_t") continue;
+            key.assign(name).append(1, '/').append(child_name);
+            diff_json[key].swap(*child_it);
         }
-    })
+        to_remove.emplace_back(name);
+    }
 
     while (to_remove.size() > 0) {
         diff_json.removeMember(to_remove.back());
         to_remove.pop_back();
     }
 
-    FOR_EACH_DIFF_KEY(diff_json, path, {
-        DiffType diff_type = get_diff_type(diff_json[path]);
-        switch (diff_type) {
+    long saving = 0;
+    for (Json::Value::iterator it = diff_json.begin(); it != diff_json.end(); ++it) {
+        std::string_view name = diff_key(it);
+        if (name == "_t") continue;
+        if ((int)it->size() >= options.merge_threshold) return true;
+        saving += flatten_saving(name, it->size() - 1, options.encoding);
+        switch (get_diff_type(*it)) {
             case DiffType::PatchArray:
                 num_patch_array++;
                 break;
@@ -108,7 +545,7 @@ bool merge_with_children(Json::Value &diff_json, std::string &err_msg) {
                 num_patch_object++;
                 break;
         }
-    });
+    }
 
     DiffType merge_type;
     if (num_patch_array == diff_json.size() - 1) {
@@ -120,224 +557,840 @@ bool merge_with_children(Json::Value &diff_json, std::string &err_msg) {
     } else {
         return true;
     }
+    if (saving < 0) {
+        return true;
+    }
 
     Json::Value new_diff = make_diff_json(merge_type);
-    FOR_EACH_DIFF_KEY(diff_json, path, {
-        auto child_diff = diff_json[path];
-        FOR_EACH_DIFF_KEY(child_diff, inner_path, {
-            new_diff[path + "/" + inner_path] = child_diff[inner_path];
-        });
-    });
-    RET_JSON(new_diff);
+    for (Json::Value::iterator it = diff_json.begin(); it != diff_json.end(); ++it) {
+        std::string_view name = diff_key(it);
+        if (name == "_t") continue;
+        for (Json::Value::iterator child_it = it->begin(); child_it != it->end(); ++child_it) {
+            std::string_view child_name = diff_key(child_it);
+            if (child_name == "_t") continue;
+            key.assign(name).append(1, '/').append(child_name);
+            new_diff[key].swap(*child_it);
+        }
+    }
+    diff_json.swap(new_diff);
+    return true;
 }
 
-bool get_diff_object(const Json::Value &old_json, const Json::Value &new_json,
-                     Json::Value &diff_json, std::string &err_msg) {
-    Json::Value diff = make_diff_json(DiffType::PatchObject);
+// Same order as the member map of Json::Value, so that two objects can be walked side by side
+inline int compare_member_names(const char *a, const char *a_end, const char *b, const char *b_end) {
+    size_t a_len = a_end - a, b_len = b_end - b;
+    int comp = memcmp(a, b, std::min(a_len, b_len));
+    if (comp != 0) return comp;
+    return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
 
-    int num_deleted = 0;
-    int num_replaced = 0;
-    for (Json::Value::const_iterator it = old_json.begin(); it != old_json.end(); ++it) {
-        std::string key = it.key().asString();
-        if (new_json.isMember(key)) {
-            Json::Value child_diff;
-            if (!get_diff(old_json[key], new_json[key], child_diff, err_msg)) {
-                RET_ERROR(err_msg);
-            }
-            DiffType diff_type = get_diff_type(child_diff);
+void add_member_diff(Json::Value &diff, const std::string &key, Json::Value &child_diff, const DiffOptions &options) {
+    DiffType diff_type = get_diff_type(child_diff);
+    if (diff_type == DiffType::Unchanged) return;
+    if (diff_type == DiffType::PatchObject && (int)child_diff.size() < options.merge_threshold &&
+        flatten_saving(key, child_diff.size() - 1, options.encoding) >= 0) {
+        std::string path;
+        for (Json::Value::iterator it = child_diff.begin(); it != child_diff.end(); ++it) {
+            std::string_view child_key = diff_key(it);
+            if (child_key == "_t") continue;
+            path.assign(key).append(1, '/').append(child_key);
+            diff[path].swap(*it);
+        }
+    } else {
+        diff[key].swap(child_diff);
+    }
+}
 
-            if ((diff_type == DiffType::PatchObject) && child_diff.size() < MERGE_THRES) {
-                FOR_EACH_DIFF_KEY(child_diff, child_key, {
-                    diff[key + "/" + child_key] = child_diff[child_key];
-                });
-            } else if (diff_type != DiffType::Unchanged) {
-                diff[key] = child_diff;
-                if (diff_type == DiffType::Replace) {
-                    num_replaced++;
-                }
+/**
+ * Calls fn(name, name_end, old_member, new_member) for the members of both objects in the order of their names,
+ * old_member is nullptr for added members and new_member for deleted ones. Members are sorted in both objects,
+ * so they are matched in a single merge pass without lookups.
+ */
+template <typename Fn>
+bool for_each_member_pair(const Json::Value &old_json, const Json::Value &new_json, Fn fn) {
+    Json::Value::const_iterator old_it = old_json.begin(), new_it = new_json.begin();
+    const Json::Value::const_iterator old_end = old_json.end(), new_end = new_json.end();
+    while (old_it != old_end || new_it != new_end) {
+        const char *old_name = nullptr, *old_name_end = nullptr, *new_name = nullptr, *new_name_end = nullptr;
+        if (old_it != old_end) old_name = old_it.memberName(&old_name_end);
+        if (new_it != new_end) new_name = new_it.memberName(&new_name_end);
+
+        int comp;
+        if (old_it == old_end) {
+            comp = 1;
+        } else if (new_it == new_end) {
+            comp = -1;
+        } else {
+            comp = compare_member_names(old_name, old_name_end, new_name, new_name_end);
+        }
+
+        bool ok;
+        if (comp < 0) {
+            ok = fn(old_name, old_name_end, &*old_it, nullptr);
+            ++old_it;
+        } else if (comp > 0) {
+            ok = fn(new_name, new_name_end, nullptr, &*new_it);
+            ++new_it;
+        } else {
+            ok = fn(old_name, old_name_end, &*old_it, &*new_it);
+            ++old_it;
+            ++new_it;
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Members or items of one document and their counterparts in the other, diffed together
+struct SubtreePair {
+    // nullptr for members that were added or deleted, which are not diffed
+    const Json::Value *old_json;
+    const Json::Value *new_json;
+    // Member name added to the path, null for items of arrays
+    std::string_view name;
+};
+
+// Calls fn with the hash caches of options unless they are transient, to keep hashes computed by tasks for later
+template <typename Fn>
+inline void keep_hashes(const DiffOptions &options, Fn fn) {
+    if (options.old_hashes->is_transient() || options.new_hashes->is_transient()) return;
+    fn(*options.old_hashes, *options.new_hashes);
+}
+
+// Consecutive pairs diffed by one task, with hash caches stacked on those of the caller
+struct DiffChunk {
+    size_t begin, end;
+    std::pmr::monotonic_buffer_resource arena;
+    HashCache old_hashes, new_hashes;
+    std::string err_msg;
+    bool ok = true;
+
+    DiffChunk(size_t begin, size_t end, const DiffOptions &options)
+        : begin(begin), end(end), old_hashes(options.old_hashes, &arena), new_hashes(options.new_hashes, &arena) {}
+};
+
+/**
+ * Diffs the pairs that are in both documents into diffs, in chunks of at least options.parallel_min_size as tasks
+ * of options.pool. Hashes computed by the chunks are added to the caches of options afterwards, in order.
+ */
+bool diff_subtrees(const std::vector<SubtreePair> &pairs, std::vector<Json::Value> &diffs, std::string &err_msg,
+                   const DiffOptions &options, std::string &path) {
+    diffs.resize(pairs.size());
+    std::deque<DiffChunk> chunks;
+    size_t weight = 0, begin = 0;
+    for (size_t k = 0; k < pairs.size(); k++) {
+        const SubtreePair &pair = pairs[k];
+        if (pair.old_json == nullptr || pair.new_json == nullptr) {
+            weight++;
+        } else {
+            weight += subtree_weight(*pair.old_json, options.parallel_min_size) +
+                      subtree_weight(*pair.new_json, options.parallel_min_size);
+        }
+        if (weight >= options.parallel_min_size || k + 1 == pairs.size()) {
+            chunks.emplace_back(begin, k + 1, options);
+            begin = k + 1;
+            weight = 0;
+        }
+    }
+
+    auto diff_range = [&](size_t begin, size_t end, std::string &chunk_err_msg, const DiffOptions &chunk_options,
+                          std::string &chunk_path) {
+        for (size_t k = begin; k < end; k++) {
+            const SubtreePair &pair = pairs[k];
+            if (pair.old_json == nullptr || pair.new_json == nullptr) continue;
+            size_t path_length =
+                pair.name.data() == nullptr ? chunk_path.size() : push_path(chunk_options, chunk_path, pair.name);
+            if (!get_diff_at(*pair.old_json, *pair.new_json, diffs[k], chunk_err_msg, chunk_options, chunk_path)) {
+                return false;
             }
+            chunk_path.resize(path_length);
+        }
+        return true;
+    };
+
+    if (chunks.size() <= 1) {
+        return diff_range(0, pairs.size(), err_msg, options, path);
+    }
+
+    auto diff_chunk = [&](DiffChunk &chunk) {
+        DiffOptions chunk_options = options;
+        chunk_options.old_hashes = &chunk.old_hashes;
+        chunk_options.new_hashes = &chunk.new_hashes;
+        std::string chunk_path = path;
+        chunk.ok = diff_range(chunk.begin, chunk.end, chunk.err_msg, chunk_options, chunk_path);
+    };
+    WorkPool::Group group;
+    for (size_t c = 1; c < chunks.size(); c++) {
+        options.pool->spawn(group, [&, c] { diff_chunk(chunks[c]); });
+    }
+    diff_chunk(chunks[0]);
+    options.pool->wait(group);
+
+    for (auto &chunk : chunks) {
+        if (!chunk.ok) {
+            RET_ERROR(chunk.err_msg);
+        }
+    }
+    keep_hashes(options, [&](HashCache &old_hashes, HashCache &new_hashes) {
+        for (auto &chunk : chunks) {
+            old_hashes.merge(chunk.old_hashes);
+            new_hashes.merge(chunk.new_hashes);
+        }
+    });
+    return true;
+}
+
+// get_diff_object with a pool: members are collected first and then diffed in chunks
+bool get_diff_members_parallel(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff,
+                               std::string &err_msg, const DiffOptions &options, std::string &path) {
+    std::vector<SubtreePair> pairs;
+    for_each_member_pair(old_json, new_json,
+                         [&](const char *name, const char *name_end, const Json::Value *old_member,
+                             const Json::Value *new_member) {
+                             pairs.push_back(
+                                 SubtreePair{old_member, new_member, std::string_view(name, name_end - name)});
+                             return true;
+                         });
+
+    std::vector<Json::Value> member_diffs;
+    if (!diff_subtrees(pairs, member_diffs, err_msg, options, path)) {
+        RET_ERROR(err_msg);
+    }
+
+    // Added to the diff in the order of their names, the same as get_diff_object does without a pool
+    for (size_t k = 0; k < pairs.size(); k++) {
+        const SubtreePair &pair = pairs[k];
+        if (pair.new_json == nullptr) {
+            diff[std::string(pair.name)] = DIFF_DELETE;
+        } else if (pair.old_json == nullptr) {
+            diff[std::string(pair.name)] = *pair.new_json;
         } else {
-            num_deleted++;
-            diff[key] = DIFF_DELETE;
+            add_member_diff(diff, std::string(pair.name), member_diffs[k], options);
         }
     }
 
-    // DEBUG(num_deleted)
-    // DEBUG(old_json.size())
-    if (num_deleted == old_json.size() || num_replaced == old_json.size()) {
-        RET_JSON(new_json);
+    keep_hashes(options, [&](HashCache &old_hashes, HashCache &new_hashes) {
+        // The members are hashed by now, so that the next diff can skip both objects when they are unchanged
+        old_hashes.get(old_json);
+        new_hashes.get(new_json);
+    });
+    return true;
+}
+
+bool get_diff_object(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                     std::string &err_msg, const DiffOptions &options, std::string &path) {
+    if (old_json.size() == 0 && new_json.size() == 0) {
+        RET_JSON(DIFF_UNCHANGED);
     }
 
-    // New items added
-    for (Json::Value::const_iterator it = new_json.begin(); it != new_json.end(); ++it) {
-        std::string key = it.key().asString();
-        if (old_json.isMember(key)) continue;
-        diff[key] = new_json[key];
+    // Stays null until a member differs, unchanged objects do not allocate a diff
+    Json::Value diff;
+
+    auto diff_member = [&](const char *name, const char *name_end, const Json::Value *old_member,
+                           const Json::Value *new_member) {
+        if (new_member == nullptr) {
+            diff[std::string(name, name_end)] = DIFF_DELETE;
+            return true;
+        }
+        if (old_member == nullptr) {
+            diff[std::string(name, name_end)] = *new_member;
+            return true;
+        }
+
+        // Unchanged children are skipped before any diff value is built for them
+        if ((old_member->isObject() || old_member->isArray()) && old_member->type() == new_member->type() &&
+            same_hash(*old_member, *new_member, options)) {
+            return true;
+        }
+
+        Json::Value child_diff;
+        size_t path_length = push_path(options, path, std::string_view(name, name_end - name));
+        if (!get_diff_at(*old_member, *new_member, child_diff, err_msg, options, path)) {
+            return false;
+        }
+        path.resize(path_length);
+        add_member_diff(diff, std::string(name, name_end), child_diff, options);
+        return true;
+    };
+    if (options.pool != nullptr) {
+        if (!get_diff_members_parallel(old_json, new_json, diff, err_msg, options, path)) {
+            RET_ERROR(err_msg);
+        }
+    } else if (!for_each_member_pair(old_json, new_json, diff_member)) {
+        RET_ERROR(err_msg);
     }
 
-    if (diff.size() == 1) {
+    if (diff.isNull()) {
         RET_JSON(DIFF_UNCHANGED);
     }
 
-    if (!merge_with_children(diff, err_msg)) {
+    diff[Json::StaticString("_t")] = Json::StaticString(diff_type_name(DiffType::PatchObject));
+    if (!merge_with_children(diff, err_msg, options)) {
         RET_ERROR(err_msg);
     }
 
-    RET_JSON(diff);
+    // E.g. when most members are deleted or replaced
+    replace_if_smaller(diff, new_json, options);
+    RET_DIFF(diff);
 }
 
-bool get_diff_array(const Json::Value &old_json, const Json::Value &new_json,
-                    Json::Value &diff_json, std::string &err_msg) {
-    Json::Value diff = make_diff_json(DiffType::PatchArray);
+// Maps the identity key of every item to its index, false if any item has no key or keys are not unique
+bool index_array_by_key(const Json::Value &arr, const std::string &key, std::unordered_map<JsonHash, int> &index) {
+    HashCache key_hashes;
+    int length = arr.size();
+    for (int i = 0; i < length; i++) {
+        const Json::Value &item = arr[i];
+        if (item.type() != Json::ValueType::objectValue) return false;
+        const Json::Value *item_key = item.find(key.data(), key.data() + key.size());
+        if (item_key == nullptr) return false;
+        if (!index.emplace(key_hashes.get(*item_key), i).second) return false;
+    }
+    return true;
+}
+
+/**
+ * Diffs arrays of records by identity key, with all indices referring to old_json:
+ * - "i": patch of the record at old index i
+ * - "s:e": old records s..e-1 deleted, followed by records inserted before old record e
+ * - ">": order of the kept old records when they were moved, as single indices and [start, end] runs
+ *
+ * keyed is set to false (and nothing emitted) if the items cannot be matched by key.
+ */
+bool get_diff_array_keyed(const Json::Value &old_json, const Json::Value &new_json, const std::string &key,
+                          Json::Value &diff, bool &keyed, std::string &err_msg, const DiffOptions &options,
+                          std::string &path) {
+    std::unordered_map<JsonHash, int> old_index, new_index;
+    keyed = index_array_by_key(old_json, key, old_index) && index_array_by_key(new_json, key, new_index);
+    if (!keyed) return true;
 
-    int start = 0;
     int old_length = old_json.size();
     int new_length = new_json.size();
-    int min_length = std::min(old_length, new_length);
-    int end = old_length;
-    int new_end = new_length;
-
-    Json::Value first_diff;
-    for (; start < min_length; start++) {
-        if (!get_diff(old_json[start], new_json[start], first_diff, err_msg)) {
-            RET_ERROR(err_msg);
-        }
-        if (get_diff_type(first_diff) != DiffType::Unchanged) {
-            break;
+    std::vector<int> new_to_old(new_length, -1);
+    std::vector<bool> old_kept(old_length, false);
+    for (auto &pair : new_index) {
+        auto match = old_index.find(pair.first);
+        if (match == old_index.end()) continue;
+        if (old_json[match->second][key] != new_json[pair.second][key]) {
+            // Hash collision between different keys
+            keyed = false;
+            return true;
         }
+        new_to_old[pair.second] = match->second;
+        old_kept[match->second] = true;
     }
 
-    for (; end > start && new_end > start; end--, new_end--) {
+    // New records are inserted before the kept record following them, or at the end
+    std::vector<int> insert_before(new_length);
+    for (int j = new_length - 1, next_old = old_length; j >= 0; j--) {
+        if (new_to_old[j] != -1) next_old = new_to_old[j];
+        insert_before[j] = next_old;
+    }
+    std::map<int, Json::Value> inserts;
+    for (int j = 0; j < new_length; j++) {
+        if (new_to_old[j] != -1) continue;
+        Json::Value &items = inserts[insert_before[j]];
+        if (items.isNull()) items = Json::arrayValue;
+        items.append(new_json[j]);
+    }
+
+    bool moved = false;
+    int last_old = -1;
+    // With a pool, the kept records are diffed afterwards in chunks
+    std::vector<SubtreePair> pairs;
+    std::vector<int> pair_indices;
+    for (int j = 0; j < new_length; j++) {
+        int i = new_to_old[j];
+        if (i == -1) continue;
+        if (i < last_old) moved = true;
+        last_old = i;
+
+        if (options.pool != nullptr) {
+            pairs.push_back(SubtreePair{&old_json[i], &new_json[j], std::string_view()});
+            pair_indices.push_back(i);
+            continue;
+        }
+        if (same_hash(old_json[i], new_json[j], options)) continue;
         Json::Value item_diff;
-        if (!get_diff(old_json[end - 1], new_json[new_end - 1], item_diff, err_msg)) {
+        if (!get_diff_at(old_json[i], new_json[j], item_diff, err_msg, options, path)) {
             RET_ERROR(err_msg);
         }
         if (get_diff_type(item_diff) != DiffType::Unchanged) {
-            break;
+            diff[std::to_string(i)] = item_diff;
+        }
+    }
+    if (!pairs.empty()) {
+        std::vector<Json::Value> item_diffs;
+        if (!diff_subtrees(pairs, item_diffs, err_msg, options, path)) {
+            RET_ERROR(err_msg);
         }
+        for (size_t k = 0; k < pairs.size(); k++) {
+            if (get_diff_type(item_diffs[k]) != DiffType::Unchanged) {
+                diff[std::to_string(pair_indices[k])].swap(item_diffs[k]);
+            }
+        }
+        keep_hashes(options, [&](HashCache &old_hashes, HashCache &new_hashes) {
+            old_hashes.get(old_json);
+            new_hashes.get(new_json);
+        });
     }
 
-    if (end <= start && old_length == new_length) {
-        RET_JSON(DIFF_UNCHANGED);
+    for (int start = 0; start < old_length;) {
+        if (old_kept[start]) {
+            start++;
+            continue;
+        }
+        int end = start;
+        while (end < old_length && !old_kept[end]) end++;
+
+        // A same-size splice patches in place, so it only stands for delete + insert if nothing moved
+        auto items = moved ? inserts.end() : inserts.find(end);
+        if (items != inserts.end()) {
+            diff[std::to_string(start) + ":" + std::to_string(end)] = items->second;
+            inserts.erase(items);
+        } else {
+            diff[std::to_string(start) + ":" + std::to_string(end)] = Json::arrayValue;
+        }
+        start = end;
+    }
+    for (auto &pair : inserts) {
+        diff[std::to_string(pair.first) + ":" + std::to_string(pair.first)] = pair.second;
     }
 
-    if (new_length == old_length) {
-        Json::Value diff_array = Json::arrayValue;
-        int curr_start = start;
-        int i = start;
-        for (; i < end; i++) {
-            Json::Value item_diff;
-            if (!get_diff(old_json[i], new_json[i], item_diff, err_msg)) {
-                RET_ERROR(err_msg);
+    if (moved) {
+        Json::Value order = Json::arrayValue;
+        for (int j = 0; j < new_length;) {
+            if (new_to_old[j] == -1) {
+                j++;
+                continue;
             }
-            if (get_diff_type(item_diff) == DiffType::Unchanged) {
-                if (diff_array.size() == 1) {
-                    diff[std::to_string(curr_start)] = diff_array[0];
-                    diff_array.clear();
-                } else if (diff_array.size() > 1) {
-                    diff[std::to_string(curr_start) + ":" + std::to_string(i)] = diff_array;
-                    diff_array.clear();
-                }
-                curr_start = i + 1;
+            int start = new_to_old[j];
+            int end = start + 1;
+            for (j++; j < new_length; j++) {
+                if (new_to_old[j] == -1) continue;
+                if (new_to_old[j] != end) break;
+                end++;
+            }
+            if (end - start == 1) {
+                order.append(start);
             } else {
-                diff_array.append(item_diff);
+                Json::Value run = Json::arrayValue;
+                run.append(start);
+                run.append(end);
+                order.append(run);
             }
         }
-        if (diff_array.size() == 1) {
-            diff[std::to_string(curr_start)] = diff_array[0];
-        } else if (diff_array.size() > 1) {
-            diff[std::to_string(curr_start) + ":" + std::to_string(i)] = diff_array;
+        diff[">"] = order;
+    }
+
+    return true;
+}
+
+// Hashes of the items of arr, long arrays are hashed in chunks on options.pool
+void hash_items(const Json::Value &arr, HashCache &hashes, std::vector<JsonHash> &items, const DiffOptions &options) {
+    int length = arr.size();
+    items.resize(length);
+    struct HashChunk {
+        int begin, end;
+        std::pmr::monotonic_buffer_resource arena;
+        HashCache hashes;
+        HashChunk(int begin, int end, const HashCache &base) : begin(begin), end(end), hashes(&base, &arena) {}
+    };
+    auto hash_serial = [&] {
+        for (int i = 0; i < length; i++) {
+            items[i] = hashes.get(arr[i]);
+        }
+    };
+    if (options.pool == nullptr) {
+        hash_serial();
+        return;
+    }
+
+    std::deque<HashChunk> chunks;
+    size_t weight = 0;
+    for (int i = 0, begin = 0; i < length; i++) {
+        weight += subtree_weight(arr[i], options.parallel_min_size);
+        if (weight >= options.parallel_min_size || i + 1 == length) {
+            chunks.emplace_back(begin, i + 1, hashes);
+            begin = i + 1;
+            weight = 0;
         }
-    } else {
-        Json::Value diff_array = Json::arrayValue;
+    }
+    if (chunks.size() <= 1) {
+        hash_serial();
+        return;
+    }
+
+    auto hash_chunk = [&](HashChunk &chunk) {
+        for (int i = chunk.begin; i < chunk.end; i++) {
+            items[i] = chunk.hashes.get(arr[i]);
+        }
+    };
+    WorkPool::Group group;
+    for (size_t c = 1; c < chunks.size(); c++) {
+        options.pool->spawn(group, [&, c] { hash_chunk(chunks[c]); });
+    }
+    hash_chunk(chunks[0]);
+    options.pool->wait(group);
+    if (!hashes.is_transient()) {
+        for (auto &chunk : chunks) {
+            hashes.merge(chunk.hashes);
+        }
+        hashes.get(arr);
+    }
+}
+
+bool get_diff_array(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                    std::string &err_msg, const DiffOptions &options, std::string &path) {
+    Json::Value diff = make_diff_json(DiffType::PatchArray);
 
-        int i = start;
-        for (; i < std::min(end, new_end); i++) {
-            Json::Value item_diff;
-            if (!get_diff(old_json[i], new_json[i], item_diff, err_msg)) {
+    const std::string &array_key = get_array_key(options, path);
+    if (!array_key.empty()) {
+        bool keyed;
+        size_t path_length = push_path(options, path, "*");
+        if (!get_diff_array_keyed(old_json, new_json, array_key, diff, keyed, err_msg, options, path)) {
+            RET_ERROR(err_msg);
+        }
+        path.resize(path_length);
+
+        if (keyed) {
+            if (diff.size() == 1) {
+                RET_JSON(DIFF_UNCHANGED);
+            }
+            if (!merge_with_children(diff, err_msg, options)) {
                 RET_ERROR(err_msg);
             }
-            diff_array.append(item_diff);
+            replace_if_smaller(diff, new_json, options);
+            RET_DIFF(diff);
+        }
+    }
+
+    std::vector<JsonHash> old_items, new_items;
+    hash_items(old_json, *options.old_hashes, old_items, options);
+    hash_items(new_json, *options.new_hashes, new_items, options);
+
+    size_t path_length = push_path(options, path, "*");
+    auto diff_item = [&](int i, int j, Json::Value &item_diff) {
+        return get_diff_at(old_json[i], new_json[j], item_diff, err_msg, options, path);
+    };
+    auto new_item = [&](int j) -> const Json::Value & { return new_json[j]; };
+    if (!diff_array_items(old_items, new_items, diff_json, err_msg, options, diff_item, new_item)) {
+        RET_ERROR(err_msg);
+    }
+    path.resize(path_length);
+    replace_if_smaller(diff_json, new_json, options);
+    return true;
+}
+
+// Length of the common prefix of a and b, compared a block at a time
+size_t common_prefix(const char *a, const char *b, size_t n) {
+    size_t i = 0;
+    while (i + 64 <= n && memcmp(a + i, b + i, 64) == 0) i += 64;
+    while (i < n && a[i] == b[i]) i++;
+    return i;
+}
+
+// Length of the common suffix of the n bytes before a_end and b_end
+size_t common_suffix(const char *a_end, const char *b_end, size_t n) {
+    size_t i = 0;
+    while (i + 64 <= n && memcmp(a_end - i - 64, b_end - i - 64, 64) == 0) i += 64;
+    while (i < n && a_end[-(long)i - 1] == b_end[-(long)i - 1]) i++;
+    return i;
+}
+
+struct StringChunk {
+    int start, end;
+    JsonHash hash;
+};
+
+// Content defined chunking with a gear rolling hash, so chunk boundaries resync right after an edit
+void chunk_string(std::string_view str, int offset, std::vector<StringChunk> &chunks) {
+    static const auto gear = [] {
+        std::vector<uint64_t> table(256);
+        for (int i = 0; i < 256; i++) table[i] = mix_hash(i + 1);
+        return table;
+    }();
+
+    int length = str.size();
+    int chunk_start = 0;
+    uint64_t h = 0;
+    for (int i = 0; i < length; i++) {
+        h = (h << 1) + gear[static_cast<unsigned char>(str[i])];
+        int chunk_length = i + 1 - chunk_start;
+        if ((chunk_length >= STRING_CHUNK_MIN && (h & STRING_CHUNK_MASK) == 0) || chunk_length >= STRING_CHUNK_MAX ||
+            i + 1 == length) {
+            std::string_view chunk = str.substr(chunk_start, chunk_length);
+            chunks.push_back(StringChunk{offset + chunk_start, offset + i + 1, std::hash<std::string_view>{}(chunk)});
+            chunk_start = i + 1;
+            h = 0;
         }
+    }
+}
+
+void add_string_hunk(EditHunk hunk, std::vector<EditHunk> &hunks) {
+    // Hunks separated by fewer bytes than the overhead of a key are sent as one
+    if (!hunks.empty() && hunk.old_start - hunks.back().old_end < STRING_HUNK_MIN_GAP) {
+        hunks.back().old_end = hunk.old_end;
+        hunks.back().new_end = hunk.new_end;
+        return;
+    }
+    hunks.push_back(hunk);
+}
 
-        for (; i < new_end; i++) {
-            diff_array.append(new_json[i]);
+// Hunks turning old_str[old_start:old_end] into new_str[new_start:new_end]
+void diff_string_range(std::string_view old_str, std::string_view new_str, int old_start, int old_end,
+                       int new_start, int new_end, std::vector<EditHunk> &hunks) {
+    std::vector<EditHunk> range_hunks;
+
+    if ((old_end - old_start) + (new_end - new_start) <= STRING_DIFF_CHAR_LIMIT) {
+        myers_diff(old_str.substr(old_start, old_end - old_start), new_str.substr(new_start, new_end - new_start),
+                   STRING_DIFF_MAX_COST, range_hunks);
+        for (auto &hunk : range_hunks) {
+            add_string_hunk(EditHunk{old_start + hunk.old_start, old_start + hunk.old_end, new_start + hunk.new_start,
+                                     new_start + hunk.new_end},
+                            hunks);
         }
+        return;
+    }
 
-        diff[std::to_string(start) + ":" + std::to_string(end)] = diff_array;
+    // Large ranges are diffed chunk by chunk, small changed chunk ranges then byte by byte
+    std::vector<StringChunk> old_chunks, new_chunks;
+    chunk_string(old_str.substr(old_start, old_end - old_start), old_start, old_chunks);
+    chunk_string(new_str.substr(new_start, new_end - new_start), new_start, new_chunks);
+    std::vector<JsonHash> old_hashes(old_chunks.size()), new_hashes(new_chunks.size());
+    for (size_t i = 0; i < old_chunks.size(); i++) old_hashes[i] = old_chunks[i].hash;
+    for (size_t i = 0; i < new_chunks.size(); i++) new_hashes[i] = new_chunks[i].hash;
+
+    myers_diff(old_hashes, new_hashes, ARRAY_DIFF_MAX_COST, range_hunks);
+    for (auto &hunk : range_hunks) {
+        int hunk_old_start = hunk.old_start < (int)old_chunks.size() ? old_chunks[hunk.old_start].start : old_end;
+        int hunk_old_end = hunk.old_end > 0 ? old_chunks[hunk.old_end - 1].end : old_start;
+        int hunk_new_start = hunk.new_start < (int)new_chunks.size() ? new_chunks[hunk.new_start].start : new_end;
+        int hunk_new_end = hunk.new_end > 0 ? new_chunks[hunk.new_end - 1].end : new_start;
+        if (hunk.old_start == hunk.old_end) hunk_old_end = hunk_old_start;
+        if (hunk.new_start == hunk.new_end) hunk_new_end = hunk_new_start;
+
+        if ((hunk_old_end - hunk_old_start) + (hunk_new_end - hunk_new_start) <= STRING_DIFF_CHAR_LIMIT) {
+            diff_string_range(old_str, new_str, hunk_old_start, hunk_old_end, hunk_new_start, hunk_new_end, hunks);
+        } else {
+            add_string_hunk(EditHunk{hunk_old_start, hunk_old_end, hunk_new_start, hunk_new_end}, hunks);
+        }
     }
+}
 
-    // Size Optimizations
-    if (!merge_with_children(diff, err_msg)) {
-        RET_ERROR(err_msg);
+/**
+ * Replacement for a large hunk: literal strings, and [start, end] references to chunks of old_str
+ * that moved, so that relocated text is not sent again
+ */
+Json::Value make_string_pieces(std::string_view old_str, std::string_view new_str, const EditHunk &hunk,
+                               const std::unordered_map<JsonHash, StringChunk> &old_chunks) {
+    std::vector<StringChunk> new_chunks;
+    chunk_string(new_str.substr(hunk.new_start, hunk.new_end - hunk.new_start), hunk.new_start, new_chunks);
+
+    Json::Value pieces = Json::arrayValue;
+    std::string literal;
+    for (auto &chunk : new_chunks) {
+        auto match = old_chunks.find(chunk.hash);
+        std::string_view chunk_str = new_str.substr(chunk.start, chunk.end - chunk.start);
+        if (match == old_chunks.end() ||
+            old_str.substr(match->second.start, match->second.end - match->second.start) != chunk_str) {
+            literal.append(chunk_str);
+            continue;
+        }
+
+        if (!literal.empty()) {
+            pieces.append(literal);
+            literal.clear();
+        }
+        int last = pieces.size() - 1;
+        if (last >= 0 && pieces[last].isArray() && pieces[last][1].asInt() == match->second.start) {
+            pieces[last][1] = match->second.end;
+        } else {
+            Json::Value ref = Json::arrayValue;
+            ref.append(match->second.start);
+            ref.append(match->second.end);
+            pieces.append(ref);
+        }
+    }
+    if (!literal.empty() || pieces.size() == 0) {
+        pieces.append(literal);
     }
 
-    RET_JSON(diff);
+    if (pieces.size() == 1 && pieces[0].isString()) {
+        return pieces[0];
+    }
+    return pieces;
 }
 
-bool get_diff_string(const std::string &old_str, const std::string &new_str,
-                     Json::Value &diff_json, std::string &err_msg) {
-    int start = 0;
+bool get_diff_string(std::string_view old_str, std::string_view new_str, Json::Value &diff_json,
+                     std::string &err_msg, const DiffOptions &options) {
     int old_length = old_str.length();
     int new_length = new_str.length();
-    for (; start < old_length; start++) {
-        if (old_str[start] != new_str[start]) break;
+    int min_length = std::min(old_length, new_length);
+
+    int start = common_prefix(old_str.data(), new_str.data(), min_length);
+    if (start == old_length && old_length == new_length) {
+        RET_JSON(DIFF_UNCHANGED);
     }
+    if (start == old_length && old_length > 0) {
+        // Only text appended, as for logs
+        Json::Value append_diff = make_diff_json(DiffType::AppendString);
+        append_diff["v"] = std::string(new_str.substr(old_length));
+        if (string_size(new_str, options.encoding) >
+            max_replace_size(encoded_size(append_diff, options.encoding), options)) {
+            RET_DIFF(append_diff);
+        }
+    }
+    int suffix = common_suffix(old_str.data() + old_length, new_str.data() + new_length, min_length - start);
+    int end = old_length - suffix, new_end = new_length - suffix;
 
-    int end = old_length, new_end = new_length;
-    for (; end > start && new_end > start; end--, new_end--) {
-        if (old_str[end - 1] != new_str[new_end - 1]) break;
+    std::vector<EditHunk> hunks;
+    int changed = 0;
+    if (old_length == new_length) {
+        // Bytes replaced in place, unless that turns out to be most of the middle (shifted text)
+        for (int i = start; i < end;) {
+            i += common_prefix(old_str.data() + i, new_str.data() + i, end - i);
+            if (i >= end) break;
+            int run_start = i;
+            while (i < end && old_str[i] != new_str[i]) i++;
+            add_string_hunk(EditHunk{run_start, i, run_start, i}, hunks);
+            changed += i - run_start;
+        }
+        if (changed > (end - start) / 2 && end - start > STRING_HUNK_MIN_GAP) {
+            hunks.clear();
+        }
+    }
+    if (hunks.empty()) {
+        diff_string_range(old_str, new_str, start, end, start, new_end, hunks);
     }
 
-    int preserved = start + old_length - end;
-    if (preserved < 20) {
-        if (old_str == new_str) {
-            RET_JSON(DIFF_UNCHANGED);
+    // Chunks of the old string that large inserted text can refer to
+    bool use_refs = false;
+    std::unordered_map<JsonHash, StringChunk> old_chunks;
+    for (auto &hunk : hunks) {
+        if (old_length > STRING_DIFF_CHAR_LIMIT && hunk.new_end - hunk.new_start >= STRING_REF_MIN_HUNK && !use_refs) {
+            use_refs = true;
+            std::vector<StringChunk> chunks;
+            chunk_string(old_str, 0, chunks);
+            for (auto &chunk : chunks) old_chunks.emplace(chunk.hash, chunk);
         }
-        RET_JSON(new_str);
     }
 
     Json::Value diff = make_diff_json(DiffType::PatchString);
-    if (old_length == new_length) {
-        int curr_start = start;
-        int i = start;
-        for (; i < end; i++) {
-            if (old_str[i] == new_str[i]) {
-                int num_diff = i - curr_start;
-                if (num_diff == 1) {
-                    diff[std::to_string(curr_start)] = new_str.substr(curr_start, num_diff);
-                } else if (num_diff > 1) {
-                    diff[std::to_string(curr_start) + ":" + std::to_string(i)] = new_str.substr(curr_start, num_diff);
-                }
-                curr_start = i + 1;
+    for (auto &hunk : hunks) {
+        std::string key = std::to_string(hunk.old_start);
+        if (hunk.old_end != hunk.old_start + 1 || hunk.new_end != hunk.new_start + 1) {
+            key += ":" + std::to_string(hunk.old_end);
+        }
+
+        Json::Value &replacement = diff[key];
+        if (use_refs && hunk.new_end - hunk.new_start >= STRING_REF_MIN_HUNK) {
+            replacement = make_string_pieces(old_str, new_str, hunk, old_chunks);
+        } else {
+            replacement = std::string(new_str.substr(hunk.new_start, hunk.new_end - hunk.new_start));
+        }
+    }
+
+    // Whole string is cheaper to send
+    if (string_size(new_str, options.encoding) <= max_replace_size(encoded_size(diff, options.encoding), options)) {
+        RET_JSON(std::string(new_str));
+    }
+
+    RET_DIFF(diff);
+}
+
+bool get_diff_number(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                     std::string &err_msg, const DiffOptions &options) {
+    if (old_json == new_json) {
+        RET_JSON(DIFF_UNCHANGED);
+    }
+
+    // Counters are sent as a delta when that is shorter than the new value
+    Json::Value delta;
+    switch (old_json.type()) {
+        case Json::ValueType::intValue: {
+            Json::LargestInt old_val = old_json.asLargestInt(), new_val = new_json.asLargestInt();
+            Json::LargestInt diff_val;
+            if (__builtin_sub_overflow(new_val, old_val, &diff_val)) {
+                RET_JSON(new_json);
             }
+            delta = diff_val;
+            break;
         }
-        int num_diff = i - curr_start;
-        if (num_diff == 1) {
-            diff[std::to_string(curr_start)] = new_str.substr(curr_start, num_diff);
-        } else if (num_diff > 1) {
-            diff[std::to_string(curr_start) + ":" + std::to_string(i)] = new_str.substr(curr_start, num_diff);
+        case Json::ValueType::uintValue: {
+            Json::LargestUInt old_val = old_json.asLargestUInt(), new_val = new_json.asLargestUInt();
+            if (new_val >= old_val) {
+                delta = new_val - old_val;
+            } else if (old_val - new_val <= static_cast<Json::LargestUInt>(Json::Value::maxLargestInt)) {
+                delta = -static_cast<Json::LargestInt>(old_val - new_val);
+            } else {
+                RET_JSON(new_json);
+            }
+            break;
+        }
+        default: {
+            double diff_val = new_json.asDouble() - old_json.asDouble();
+            if (old_json.asDouble() + diff_val != new_json.asDouble()) {
+                RET_JSON(new_json);
+            }
+            // Whole deltas are sent as integers, which are shorter in both encodings
+            if (fabs(diff_val) < 9e15 && diff_val == static_cast<double>(static_cast<Json::Int64>(diff_val))) {
+                delta = static_cast<Json::Int64>(diff_val);
+            } else {
+                delta = diff_val;
+            }
         }
-    } else {
-        diff[std::to_string(start) + ":" + std::to_string(end)] = new_str.substr(start, new_end - start);
     }
 
-    RET_JSON(diff);
+    Json::Value increment_diff = make_diff_json(DiffType::Increment);
+    increment_diff["v"] = delta;
+    if (number_size(new_json, options.encoding) <=
+        max_replace_size(encoded_size(increment_diff, options.encoding), options)) {
+        RET_JSON(new_json);
+    }
+    RET_DIFF(increment_diff);
 }
 
 bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
               Json::Value &diff_json, std::string &err_msg) {
+    return get_diff(old_json, new_json, diff_json, err_msg, DiffOptions{});
+}
+
+bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
+              Json::Value &diff_json, std::string &err_msg, const DiffOptions &options) {
+    std::string path;
+    if (options.old_hashes == nullptr || options.new_hashes == nullptr) {
+        // Array items are matched by hash, so the caches are created for this call if the caller has none.
+        // Their entries come from one arena, starting on the stack, that is released in one go.
+        char buffer[DIFF_ARENA_STACK_SIZE];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        HashCache old_hashes(&arena, true), new_hashes(&arena, true);
+        DiffOptions hashed_options = options;
+        hashed_options.old_hashes = &old_hashes;
+        hashed_options.new_hashes = &new_hashes;
+        return get_diff_at(old_json, new_json, diff_json, err_msg, hashed_options, path);
+    }
+    return get_diff_at(old_json, new_json, diff_json, err_msg, options, path);
+}
+
+bool get_diff_at(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                 std::string &err_msg, const DiffOptions &options, std::string &path) {
     auto old_type = old_json.type(), new_type = new_json.type();
 
     if (old_type != new_type) {
         RET_JSON(new_json);
     }
 
+    if ((old_type == Json::ValueType::arrayValue || old_type == Json::ValueType::objectValue) &&
+        same_hash(old_json, new_json, options)) {
+        RET_JSON(DIFF_UNCHANGED);
+    }
+
     switch (old_type) {
         case Json::ValueType::intValue:
-        case Json::ValueType::nullValue:
         case Json::ValueType::realValue:
         case Json::ValueType::uintValue:
+            return get_diff_number(old_json, new_json, diff_json, err_msg, options);
+        case Json::ValueType::nullValue:
         case Json::ValueType::booleanValue:
             if (old_json == new_json) {
                 RET_JSON(DIFF_UNCHANGED);
@@ -345,11 +1398,17 @@ bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
                 RET_JSON(new_json);
             }
         case Json::ValueType::stringValue:
-            return get_diff_string(old_json.asString(), new_json.asString(), diff_json, err_msg);
+        {
+            const char *old_begin, *old_end, *new_begin, *new_end;
+            old_json.getString(&old_begin, &old_end);
+            new_json.getString(&new_begin, &new_end);
+            return get_diff_string(std::string_view(old_begin, old_end - old_begin),
+                                   std::string_view(new_begin, new_end - new_begin), diff_json, err_msg, options);
+        }
         case Json::ValueType::arrayValue:
-            return get_diff_array(old_json, new_json, diff_json, err_msg);
+            return get_diff_array(old_json, new_json, diff_json, err_msg, options, path);
         case Json::ValueType::objectValue:
-            return get_diff_object(old_json, new_json, diff_json, err_msg);
+            return get_diff_object(old_json, new_json, diff_json, err_msg, options, path);
         default:
             RET_ERROR("Invalid JSON type");
     }
@@ -357,44 +1416,225 @@ bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
     RET_ERROR("Unreachable code");
 }
 
-bool apply_diff_PatchObject(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
-    for (Json::Value::const_iterator it = diff.begin(); it != diff.end(); ++it) {
-        std::string key = it.key().asString();
-        Json::Value &child_diff = diff[key];
+bool apply_diff_at(Json::Value &obj, Json::Value &diff, std::string &err_msg, ApplyContext &ctx);
+
+bool apply_diff_PatchObject(Json::Value &obj, Json::Value &diff, std::string &err_msg, ApplyContext &ctx) {
+    for (Json::Value::iterator it = diff.begin(); it != diff.end(); ++it) {
+        std::string_view key = diff_key(it);
         if (key == "_t") continue;
+        Json::Value &child_diff = *it;
 
         Json::Value *target_obj = &obj;
-        std::string last_key;
-        if (!goto_path(&target_obj, last_key, key, err_msg)) {
+        PathSegment last;
+        if (!goto_path(&target_obj, last, key, err_msg, ctx)) {
             RET_ERROR(err_msg);
         }
+        if (!target_obj->isObject() && !target_obj->isNull()) {
+            RET_ERROR("Cannot apply 'P': Old obj is not of object type");
+        }
+
+        Json::Value *member = find_member(*target_obj, last.name);
+        if (member == nullptr && get_diff_type(child_diff) == DiffType::Delete) {
+            continue;
+        } else if (member == nullptr) {
+            // New members are moved out of the diff
+            (*target_obj)[std::string(last.name)].swap(child_diff);
+        } else if (get_diff_type(child_diff) == DiffType::Delete) {
+            if (ctx.hashes != nullptr) ctx.hashes->forget(*member);
+            // Emptied first since removeMember copies the removed value
+            Json::Value removed;
+            member->swap(removed);
+            target_obj->removeMember(last.name.data(), last.name.data() + last.name.size(), &removed);
+        } else {
+            if (!apply_diff_at(*member, child_diff, err_msg, ctx)) {
+                RET_ERROR(err_msg);
+            }
+        }
+    }
+
+    return true;
+}
+
+struct ArraySplice {
+    int start, end;
+    // Items of the splice after the ones that patched old items in place, moved out when applied
+    Json::Value *items;
+    int first_inserted;
+};
+
+struct ArrayPatch {
+    std::vector<ArraySplice> splices;
+    // Order of the kept items, null if they keep their relative order
+    const Json::Value *order = nullptr;
+};
+
+bool sort_splices(std::vector<ArraySplice> &splices, std::string &err_msg) {
+    std::sort(splices.begin(), splices.end(), [](const ArraySplice &s1, const ArraySplice &s2) {
+        return s1.start < s2.start || (s1.start == s2.start && s1.end < s2.end);
+    });
+    int pos = 0;
+    for (auto &splice : splices) {
+        if (splice.start < pos) {
+            RET_ERROR("Overlapping array ranges");
+        }
+        pos = splice.end;
+    }
+    return true;
+}
+
+// Applies the splices of an array whose kept items keep their order. Items are moved within the array
+// instead of into a new one: items before the first splice are not touched, and items after the last
+// one only move when the length changes, since jsoncpp keys array items by index.
+void splice_array(Json::Value &arr, std::vector<ArraySplice> &splices, HashCache *hashes) {
+    int old_length = arr.size();
+    int first = splices.front().start, last = splices.back().end;
+
+    // New index of the items in [first, last), -1 for deleted ones, and where inserted items go.
+    // Items inserted by a splice are placed right before old item splice.end.
+    std::vector<int> dest(last - first);
+    std::vector<std::pair<int, Json::Value *>> inserted;
+    int k = first, pos = first;
+    for (auto &splice : splices) {
+        for (; k < splice.start + splice.first_inserted; k++) {
+            dest[k - first] = pos++;
+        }
+        for (; k < splice.end; k++) {
+            dest[k - first] = -1;
+        }
+        for (int j = splice.first_inserted; j < (int)splice.items->size(); j++) {
+            inserted.emplace_back(pos++, &(*splice.items)[j]);
+        }
+    }
+    int shift = pos - last;
+    int new_length = old_length + shift;
+    auto dest_of = [&](int k) { return k < last ? dest[k - first] : k + shift; };
+    int tail_end = shift == 0 ? last : old_length;
+
+    // Moved items get new nodes, deleted ones are destroyed with their subtree
+    if (hashes != nullptr) {
+        for (int k = first; k < tail_end; k++) {
+            int to = dest_of(k);
+            if (to == -1) {
+                hashes->forget(arr[k]);
+            } else if (to != k) {
+                hashes->invalidate(arr[k]);
+            }
+        }
+    }
+
+    // Moving left in increasing and right in decreasing order never overwrites an item that is still to be moved,
+    // deleted items are swapped towards the slots of inserted items or the end
+    for (int k = first; k < tail_end; k++) {
+        int to = dest_of(k);
+        if (to != -1 && to < k) arr[to].swap(arr[k]);
+    }
+    for (int k = tail_end - 1; k >= first; k--) {
+        int to = dest_of(k);
+        if (to > k) arr[to].swap(arr[k]);
+    }
+    for (auto &item : inserted) {
+        arr[item.first].swap(*item.second);
+    }
+    if (new_length < old_length) {
+        arr.resize(new_length);
+    }
+}
+
+// Rebuilds a reordered array, kept items are moved into place by the order of the patch
+bool reorder_array(Json::Value &old_arr, ArrayPatch &patch, std::string &err_msg, HashCache *hashes) {
+    auto &splices = patch.splices;
+
+    // Items inserted by a splice are placed right before old item splice.end
+    int old_length = old_arr.size();
+    enum ItemState : char { Kept, Deleted, Placed };
+    std::vector<ItemState> item_states(old_length, ItemState::Kept);
+    std::vector<int> first_attached(old_length + 1, -1);
+    for (int i = 0; i < (int)splices.size(); i++) {
+        auto &splice = splices[i];
+        for (int k = splice.start + splice.first_inserted; k < splice.end; k++) {
+            item_states[k] = ItemState::Deleted;
+        }
+        if (first_attached[splice.end] == -1) {
+            first_attached[splice.end] = i;
+        }
+    }
 
-        if (target_obj->isMember(last_key)) {
-            if (get_diff_type(child_diff) == DiffType::Delete) {
-                target_obj->removeMember(last_key);
+    // Kept items move to new nodes, deleted ones are destroyed with their subtree
+    if (hashes != nullptr) {
+        for (int k = 0; k < old_length; k++) {
+            if (item_states[k] == ItemState::Deleted) {
+                hashes->forget(old_arr[k]);
             } else {
-                if (!apply_diff((*target_obj)[last_key], child_diff, err_msg)) {
-                    RET_ERROR(err_msg);
-                }
+                hashes->invalidate(old_arr[k]);
+            }
+        }
+    }
+
+    Json::Value new_arr = Json::arrayValue;
+    auto place_attached = [&](int k) {
+        for (int i = first_attached[k]; i != -1 && i < (int)splices.size() && splices[i].end == k; i++) {
+            for (int j = splices[i].first_inserted; j < (int)splices[i].items->size(); j++) {
+                new_arr.append(Json::Value()).swap((*splices[i].items)[j]);
             }
+        }
+    };
+    auto place_item = [&](int k) {
+        if (k < 0 || k >= old_length || item_states[k] != ItemState::Kept) {
+            return false;
+        }
+        place_attached(k);
+        item_states[k] = ItemState::Placed;
+        new_arr.append(Json::Value()).swap(old_arr[k]);
+        return true;
+    };
+
+    for (auto &entry : *patch.order) {
+        int start, end;
+        if (entry.isArray() && entry.size() == 2) {
+            start = entry[0].asInt();
+            end = entry[1].asInt();
+        } else if (entry.isIntegral()) {
+            start = entry.asInt();
+            end = start + 1;
         } else {
-            (*target_obj)[last_key] = child_diff;
+            RET_ERROR("Invalid array order entry");
+        }
+        for (int k = start; k < end; k++) {
+            if (!place_item(k)) {
+                RET_ERROR("Array order refers to a missing item : " + std::to_string(k));
+            }
         }
     }
+    for (int k = 0; k < old_length; k++) {
+        if (item_states[k] == ItemState::Kept) {
+            RET_ERROR("Array order does not contain item : " + std::to_string(k));
+        }
+        if (item_states[k] == ItemState::Deleted && first_attached[k] != -1 && splices[first_attached[k]].end == k) {
+            RET_ERROR("Cannot insert before deleted item of reordered array : " + std::to_string(k));
+        }
+    }
+    place_attached(old_length);
 
+    old_arr.swap(new_arr);
     return true;
 }
 
-bool apply_diff_PatchArray(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
-    for (Json::Value::const_iterator it = diff.begin(); it != diff.end(); ++it) {
-        std::string path = it.key().asString();
+bool apply_diff_PatchArray(Json::Value &obj, Json::Value &diff, std::string &err_msg, ApplyContext &ctx) {
+    // Indices of every key refer to the array before this patch. Items are patched in place
+    // first and the splices and moves are then applied per array in a single pass,
+    // deepest arrays first so that no pending target is moved before it is rebuilt.
+    std::map<std::pair<int, Json::Value *>, ArrayPatch> patches;
+
+    for (Json::Value::iterator it = diff.begin(); it != diff.end(); ++it) {
+        std::string_view path = diff_key(it);
         if (path == "_t") continue;
-        Json::Value &child_diff = diff[path];
+        Json::Value &child_diff = *it;
         Json::Value *target_obj = &obj;
-        std::string last_key;
-        if (!goto_path(&target_obj, last_key, path, err_msg)) {
+        PathSegment last;
+        if (!goto_path(&target_obj, last, path, err_msg, ctx)) {
             RET_ERROR(err_msg);
         }
+        int depth = ctx.path.size() - 1;
 
         Json::Value &new_arr = *target_obj;
 
@@ -402,52 +1642,128 @@ bool apply_diff_PatchArray(Json::Value &obj, Json::Value &diff, std::string &err
             RET_ERROR("Cannot apply 'A': Old obj is not of array type");
         }
 
-        if (last_key.find(':') == std::string::npos) {
-            int ind = std::stoi(last_key);
-            if (!apply_diff(new_arr[ind], child_diff, err_msg)) {
+        if (last.name == ">") {
+            if (!child_diff.isArray()) {
+                RET_ERROR("Array order is not an array");
+            }
+            patches[{-depth, target_obj}].order = &child_diff;
+            continue;
+        }
+
+        if (!last.is_range) {
+            if (!last.is_index || !new_arr.isValidIndex(last.start)) {
+                RET_ERROR("Array index does not exist : " + std::string(last.name));
+            }
+            if (!apply_diff_at(new_arr[last.start], child_diff, err_msg, ctx)) {
                 RET_ERROR(err_msg);
             }
             continue;
         }
 
-        int start = std::stoi(last_key.substr(0, last_key.find(":")));
-        int end = std::stoi(last_key.substr(last_key.find(":") + 1));
+        int start = last.start, end = last.end;
         int old_length = new_arr.size();
-        int new_length = old_length - (end - start) + it->size();
-        int new_end = new_length - (old_length - end);
+        if (start > end || end > old_length || !child_diff.isArray()) {
+            RET_ERROR("Invalid array range : " + std::string(last.name));
+        }
 
-        if (old_length != new_length) {
-            Json::Value old_arr = *target_obj;
-            new_arr.resize(new_length);
-            for (int i = 0; i < old_length - end; i++) {
-                new_arr[new_length - i - 1] = old_arr[old_length - i - 1];
+        int num_patched = std::min<int>(end - start, child_diff.size());
+        for (int i = 0; i < num_patched; i++) {
+            if (!apply_diff_at(new_arr[start + i], child_diff[i], err_msg, ctx)) {
+                RET_ERROR(err_msg);
             }
         }
 
-        int i = start;
-        for (; i < std::min(end, new_end); i++) {
-            if (!apply_diff(new_arr[i], child_diff[i - start], err_msg)) {
+        if (end - start != (int)child_diff.size()) {
+            patches[{-depth, target_obj}].splices.push_back(ArraySplice{start, end, &child_diff, num_patched});
+        }
+    }
+
+    for (auto &pair : patches) {
+        Json::Value &arr = *pair.first.second;
+        ArrayPatch &patch = pair.second;
+        if (!sort_splices(patch.splices, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+        if (patch.order != nullptr) {
+            if (!reorder_array(arr, patch, err_msg, ctx.hashes)) {
                 RET_ERROR(err_msg);
             }
+        } else if (!patch.splices.empty()) {
+            splice_array(arr, patch.splices, ctx.hashes);
         }
+    }
 
-        for (; i < new_end; i++) {
-            new_arr[i] = child_diff[i - start];
+    return true;
+}
+
+struct StringSplice {
+    int start, end;
+    // String, or pieces made of strings and [start, end] ranges of the old string
+    const Json::Value *replacement;
+};
+
+bool rebuild_string(Json::Value &target, std::vector<StringSplice> &splices, std::string &err_msg) {
+    std::sort(splices.begin(), splices.end(),
+              [](const StringSplice &s1, const StringSplice &s2) { return s1.start < s2.start; });
+
+    const char *begin, *end;
+    target.getString(&begin, &end);
+    std::string_view old_str(begin, end - begin);
+    int old_length = old_str.size();
+
+    std::string new_str;
+    new_str.reserve(old_length);
+    int pos = 0;
+    for (auto &splice : splices) {
+        if (splice.start < pos || splice.start > splice.end || splice.end > old_length) {
+            RET_ERROR("Invalid string range : " + std::to_string(splice.start) + ":" + std::to_string(splice.end));
+        }
+        new_str.append(old_str.substr(pos, splice.start - pos));
+
+        const Json::Value &replacement = *splice.replacement;
+        if (replacement.isString()) {
+            const char *repl_begin, *repl_end;
+            replacement.getString(&repl_begin, &repl_end);
+            new_str.append(repl_begin, repl_end - repl_begin);
+        } else if (replacement.isArray()) {
+            for (auto &piece : replacement) {
+                if (piece.isString()) {
+                    const char *piece_begin, *piece_end;
+                    piece.getString(&piece_begin, &piece_end);
+                    new_str.append(piece_begin, piece_end - piece_begin);
+                    continue;
+                }
+                if (!piece.isArray() || piece.size() != 2) {
+                    RET_ERROR("Invalid string piece");
+                }
+                int ref_start = piece[0].asInt(), ref_end = piece[1].asInt();
+                if (ref_start < 0 || ref_start > ref_end || ref_end > old_length) {
+                    RET_ERROR("Invalid string reference");
+                }
+                new_str.append(old_str.substr(ref_start, ref_end - ref_start));
+            }
+        } else {
+            RET_ERROR("Cannot apply 'S': Replacement is not a string");
         }
+        pos = splice.end;
     }
+    new_str.append(old_str.substr(pos));
 
+    target = new_str;
     return true;
 }
 
-bool apply_diff_PatchString(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
-    for (Json::Value::const_iterator it = diff.begin(); it != diff.end(); ++it) {
-        std::string path = it.key().asString();
+bool apply_diff_PatchString(Json::Value &obj, Json::Value &diff, std::string &err_msg, ApplyContext &ctx) {
+    // Ranges of every key refer to the string before this patch, each target string is rebuilt once
+    std::map<Json::Value *, std::vector<StringSplice>> splices;
+
+    for (Json::Value::iterator it = diff.begin(); it != diff.end(); ++it) {
+        std::string_view path = diff_key(it);
         if (path == "_t") continue;
 
-        std::string repl_str = diff[path].asString();
         Json::Value *target_obj = &obj;
-        std::string last_key;
-        if (!goto_path(&target_obj, last_key, path, err_msg)) {
+        PathSegment last;
+        if (!goto_path(&target_obj, last, path, err_msg, ctx)) {
             RET_ERROR(err_msg);
         }
 
@@ -456,40 +1772,116 @@ bool apply_diff_PatchString(Json::Value &obj, Json::Value &diff, std::string &er
         if (new_str.type() != Json::ValueType::stringValue) {
             RET_ERROR("Cannot apply 'S': Old obj is not of string type");
         }
+        if (!last.is_index && !last.is_range) {
+            RET_ERROR("Invalid string range : " + std::string(last.name));
+        }
 
-        int start, end, sep_pos;
-        if ((sep_pos = last_key.find(':')) == std::string::npos) {
-            start = std::stoi(last_key);
-            end = start + 1;
-        } else {
-            start = std::stoi(last_key.substr(0, sep_pos));
-            end = std::stoi(last_key.substr(sep_pos + 1));
+        splices[target_obj].push_back(StringSplice{last.start, last.end, &*it});
+    }
+
+    for (auto &pair : splices) {
+        if (!rebuild_string(*pair.first, pair.second, err_msg)) {
+            RET_ERROR(err_msg);
         }
+    }
+
+    return true;
+}
+
+bool apply_diff_AppendArray(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
+    if (obj.type() != Json::ValueType::arrayValue) {
+        RET_ERROR("Cannot apply 'L': Old obj is not of array type");
+    }
+    Json::Value &items = diff["v"];
+    if (!items.isArray()) {
+        RET_ERROR("Cannot apply 'L': Appended value is not an array");
+    }
+    // Items are moved out of the diff, jsoncpp 1.7 has no append(Value &&)
+    for (auto &item : items) {
+        obj.append(Json::Value()).swap(item);
+    }
+    return true;
+}
 
-        new_str = new_str.asString().replace(start, end - start, repl_str, 0, repl_str.length());
+bool apply_diff_AppendString(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
+    if (obj.type() != Json::ValueType::stringValue) {
+        RET_ERROR("Cannot apply 'C': Old obj is not of string type");
+    }
+    const char *old_begin, *old_end, *append_begin, *append_end;
+    obj.getString(&old_begin, &old_end);
+    if (!diff["v"].getString(&append_begin, &append_end)) {
+        RET_ERROR("Cannot apply 'C': Appended value is not a string");
     }
 
+    std::string new_str;
+    new_str.reserve((old_end - old_begin) + (append_end - append_begin));
+    new_str.append(old_begin, old_end - old_begin);
+    new_str.append(append_begin, append_end - append_begin);
+    obj = new_str;
     return true;
 }
 
+bool apply_diff_Increment(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
+    const Json::Value &delta = diff["v"];
+    switch (obj.type()) {
+        case Json::ValueType::intValue:
+            obj = obj.asLargestInt() + delta.asLargestInt();
+            return true;
+        case Json::ValueType::uintValue:
+            if (delta.isUInt64()) {
+                obj = obj.asLargestUInt() + delta.asLargestUInt();
+            } else {
+                obj = obj.asLargestUInt() - static_cast<Json::LargestUInt>(-delta.asLargestInt());
+            }
+            return true;
+        case Json::ValueType::realValue:
+            obj = obj.asDouble() + delta.asDouble();
+            return true;
+        default:
+            RET_ERROR("Cannot apply 'I': Old obj is not a number");
+    }
+}
+
 bool apply_diff(Json::Value &obj, Json::Value &diff, std::string &err_msg) {
-    const Json::ValueType obj_type = obj.type();
+    ApplyContext ctx{nullptr};
+    return apply_diff_at(obj, diff, err_msg, ctx);
+}
+
+bool apply_diff(Json::Value &obj, Json::Value &diff, std::string &err_msg, HashCache &hashes) {
+    ApplyContext ctx{&hashes};
+    return apply_diff_at(obj, diff, err_msg, ctx);
+}
 
+bool apply_diff_at(Json::Value &obj, Json::Value &diff, std::string &err_msg, ApplyContext &ctx) {
     const DiffType diff_type = get_diff_type(diff);
+    if (ctx.hashes != nullptr && diff_type != DiffType::Unchanged) {
+        if (diff_type == DiffType::Replace) {
+            ctx.hashes->forget(obj);
+        } else {
+            ctx.hashes->invalidate(obj);
+        }
+    }
+
     switch (diff_type) {
         case DiffType::Delete:
             RET_ERROR("Cannot apply delete diff");
         case DiffType::Unchanged:
             return true;
         case DiffType::Replace:
-            obj = diff;
+            obj.swap(diff);
             return true;
         case DiffType::PatchObject:
-            return apply_diff_PatchObject(obj, diff, err_msg);
+            return apply_diff_PatchObject(obj, diff, err_msg, ctx);
         case DiffType::PatchArray:
-            return apply_diff_PatchArray(obj, diff, err_msg);
+            return apply_diff_PatchArray(obj, diff, err_msg, ctx);
         case DiffType::PatchString:
-            return apply_diff_PatchString(obj, diff, err_msg);
+            return apply_diff_PatchString(obj, diff, err_msg, ctx);
+        case DiffType::AppendArray:
+            return apply_diff_AppendArray(obj, diff, err_msg);
+        case DiffType::AppendString:
+            return apply_diff_AppendString(obj, diff, err_msg);
+        case DiffType::Increment:
+            return apply_diff_Increment(obj, diff, err_msg);
         default:
             RET_ERROR("Unsupported diff type : " + std::string{static_cast<char>(diff_type)});
     }
@@ -7,8 +7,15 @@
 #include <json/config.h>
 #include <json/writer.h>
 
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 #define DEBUG(var) std::cout << #var << " = " << var << std::endl;
 
 enum DiffType {
@@ -18,6 +25,9 @@ enum DiffType {
     PatchString = 'S',
     PatchArray = 'A',
     PatchObject = 'P',
+    AppendArray = 'L',
+    AppendString = 'C',
+    Increment = 'I',
 };
 
 extern Json::Value DIFF_DELETE;;
@@ -31,14 +41,160 @@ extern Json::Value DIFF_UNCHANGED;
  * A: Patch Array
  * S: Patch String
  * U: Unchanged/Undefined
+ * L: Append items "v" to array
+ * C: Append string "v" to string
+ * I: Add "v" to number
  *
  * Default behaviour is add
  */
 
+typedef uint64_t JsonHash;
+
+class WorkPool;
+
+/**
+ * Memoized structural (merkle) hashes of the subtrees of one document.
+ *
+ * Hashes are keyed by node address. Diffs applied with apply_diff(..., hashes)
+ * only drop the hashes of the changed nodes and their ancestors; after any
+ * other in-place mutation call clear(). Copies start out empty since a copied
+ * document lives at different addresses, use copy_to() to carry the hashes over.
+ */
+class HashCache {
+   public:
+    HashCache() = default;
+    // Entries are allocated from resource, e.g. a monotonic buffer for caches that only live for one diff.
+    // Parallel diffs do not add the hashes computed by their tasks to transient caches.
+    explicit HashCache(std::pmr::memory_resource *resource, bool transient = false)
+        : hashes(resource), transient(transient) {}
+    // Stacked on base: hashes in base are read from it and new ones only added here. base must not change while
+    // this cache is used, so that tasks of a parallel diff can share the hashes of their caller.
+    HashCache(const HashCache *base, std::pmr::memory_resource *resource);
+    HashCache(const HashCache &) {}
+    HashCache &operator=(const HashCache &) {
+        clear();
+        return *this;
+    }
+
+    JsonHash get(const Json::Value &val);
+    void clear() { hashes.clear(); }
+    // Drops the hash of a node whose subtree is modified in place
+    void invalidate(const Json::Value &val) { hashes.erase(&val); }
+    // Drops the hashes of a subtree that is about to be destroyed or replaced
+    void forget(const Json::Value &val);
+    // Hashes of src for dst, a copy of src, added to dst_hashes
+    void copy_to(const Json::Value &src, const Json::Value &dst, HashCache &dst_hashes) const;
+    // Adds the hashes of a cache that was stacked on this one
+    void merge(const HashCache &layer);
+    // Hash of an object or array if it is cached, nullptr otherwise
+    const JsonHash *find(const Json::Value &val) const;
+    bool is_transient() const { return transient; }
+
+   private:
+    std::pmr::unordered_map<const Json::Value *, JsonHash> hashes;
+    const HashCache *base = nullptr;
+    bool transient = false;
+};
+
+// Encoding the diffs are sent in, the diff types picked are the ones that are smallest in it
+enum class DiffEncoding {
+    Json,
+    // wireformat.hpp
+    Binary,
+};
+
+struct DiffOptions {
+    // When both are set, subtrees with equal hashes are treated as unchanged without being walked
+    HashCache *old_hashes = nullptr;
+    HashCache *new_hashes = nullptr;
+
+    // Arrays of objects with a unique value for this member (e.g. "id") are diffed by identity:
+    // records are matched by key, and moves are sent as indices instead of re-sending the records
+    std::string array_key;
+    // Per array overrides of array_key, keyed by path with array indices written as '*' ("jobs/*/tasks").
+    // An empty key disables identity diffing for that array.
+    std::map<std::string, std::string> array_keys;
+
+    DiffEncoding encoding = DiffEncoding::Json;
+
+    // The shape of a diff is picked by its size in encoding. Patches with fewer members than this are flattened
+    // into the paths of their parent when that is smaller, 1 never flattens.
+    int merge_threshold = 6;
+    // Object and array patches are sent as the new value when that is at most replace_ratio times their size
+    double replace_ratio = 1.0;
+
+    // When set, members and items of objects and arrays with at least parallel_min_size members or items below
+    // them are diffed in chunks on the threads of pool (workpool.hpp). The diff is the same as without a pool.
+    WorkPool *pool = nullptr;
+    size_t parallel_min_size = 4096;
+};
+
+/**
+ * Segment of a diff key. Keys of P, A and S diffs are paths such as "jobs/3/tasks/0:2" made of
+ * member names, array indices and [start, end) ranges of arrays and strings.
+ */
+struct PathSegment {
+    // Points into the key
+    std::string_view name;
+    // Set when name is an index ("3", end is start + 1) or a range ("0:2")
+    bool is_index = false;
+    bool is_range = false;
+    int start = 0, end = 0;
+};
+
+// Splits a diff key at '/', segments is cleared and reused so that splitting does not allocate once it has grown
+void split_diff_path(std::string_view path, std::vector<PathSegment> &segments);
+
 bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
              Json::Value &diff_json, std::string &err_msg);
 
+bool get_diff(const Json::Value &old_json, const Json::Value &new_json,
+             Json::Value &diff_json, std::string &err_msg, const DiffOptions &options);
+
+// Type of a diff, Replace for plain values
+DiffType get_diff_type(const Json::Value &val);
+
+// Values are moved out of diff where possible, so a diff can only be applied once
 bool apply_diff(Json::Value &obj, Json::Value &diff, std::string &err_msg);
 
+// Keeps hashes, the cache of obj, valid. If applying fails obj is partially patched and hashes must be cleared.
+bool apply_diff(Json::Value &obj, Json::Value &diff, std::string &err_msg, HashCache &hashes);
+
+/**
+ * Squashes two consecutive diffs into one, so that applying diff_json has the same
+ * effect as applying first and then second. Works on the diffs alone.
+ *
+ * Fails when the result depends on the document. This happens when an array or string
+ * of unknown length is both appended to and patched (L / C and A / S), or when a path
+ * of both diffs runs through numeric keys whose container type is not known. Callers
+ * then fall back to sending the diffs one by one. Summed increments of real numbers
+ * may round differently than applying both.
+ */
+bool compose_diff(const Json::Value &first, const Json::Value &second, Json::Value &diff_json,
+                  std::string &err_msg);
+// Squashes a sequence of diffs, cheaper than composing them pairwise
+bool compose_diff(const std::vector<const Json::Value *> &diffs, Json::Value &diff_json, std::string &err_msg);
+
+// Receives the changes found by stream_diff, path is the '/' separated path of a member below the root
+typedef std::function<void(const std::string &path, Json::Value &diff)> DiffEntryCallback;
+
+/**
+ * Diffs two serialized documents without parsing them into Json::Value trees. Both are read in lockstep:
+ * objects member by member, arrays item by item until their first changed item, from which on the rest of
+ * both arrays is parsed and diffed with get_diff. Memory is bounded by the largest changed subtree instead
+ * of the documents.
+ *
+ * Changes are passed to on_entry as they are found, as the entries of a 'P' diff of the root. When the
+ * documents are not both objects there is one entry for the whole document, with an empty path. Diffs apply
+ * like those of get_diff but are shaped differently: objects are always patched and entries never merged.
+ *
+ * Objects whose members differ must list their members in sorted order, as Json::Value writers do. Otherwise
+ * diffing fails, possibly after some entries were passed on already.
+ */
+bool stream_diff(std::istream &old_in, std::istream &new_in, const DiffEntryCallback &on_entry,
+                 std::string &err_msg, const DiffOptions &options = DiffOptions{});
+// stream_diff with its entries put together into one diff, unchanged if there are none
+bool stream_diff(std::istream &old_in, std::istream &new_in, Json::Value &diff_json, std::string &err_msg,
+                 const DiffOptions &options = DiffOptions{});
 
 #endif // __PROJECTS_SYNCLIBCPP_SRC_DIFF_H_
\ No newline at end of file
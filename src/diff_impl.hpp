@@ -0,0 +1,193 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_DIFF_IMPL_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_DIFF_IMPL_HPP_
+
+// Building blocks of get_diff (diff.cpp), shared with the diff of persistent documents (persistent.cpp)
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "diff.hpp"
+#include "myers.hpp"
+
+// Edit distance above which the remaining part of an array is sent as one splice
+#define ARRAY_DIFF_MAX_COST 1024
+// Bytes on the stack the per-call hash caches start out with before they allocate
+#define DIFF_ARENA_STACK_SIZE 4096
+
+inline JsonHash mix_hash(JsonHash h) {
+    // splitmix64 finalizer
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+inline JsonHash combine_hash(JsonHash seed, JsonHash h) {
+    return mix_hash(seed ^ (h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+inline JsonHash hash_bytes(const char *begin, const char *end) {
+    return std::hash<std::string_view>{}(std::string_view(begin, end - begin));
+}
+
+// Static name of a diff type, stored in "_t" without allocating
+const char *diff_type_name(DiffType diffType);
+
+Json::Value make_diff_json(DiffType diffType);
+
+// get_diff of the values at path, path selects the array_keys that apply. Both hash caches have to be set.
+bool get_diff_at(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                 std::string &err_msg, const DiffOptions &options, std::string &path);
+
+// Appends a segment to the path of the value being diffed, only tracked when per path options are set
+inline size_t push_path(const DiffOptions &options, std::string &path, std::string_view segment) {
+    size_t length = path.size();
+    if (!options.array_keys.empty()) {
+        if (length > 0) path += '/';
+        path += segment;
+    }
+    return length;
+}
+
+// Identity key configured for the array at path, empty if its items are matched by position
+inline const std::string &get_array_key(const DiffOptions &options, const std::string &path) {
+    if (!options.array_keys.empty()) {
+        auto it = options.array_keys.find(path);
+        if (it != options.array_keys.end()) return it->second;
+    }
+    return options.array_key;
+}
+
+// Bytes of a string written by Json::FastWriter, with quotes and escapes
+size_t json_string_size(const char *begin, const char *end);
+
+// Bytes of a number in encoding, including the type tag of the binary encoding
+size_t number_size(const Json::Value &val, DiffEncoding encoding);
+
+// Bytes of a varint of the binary encoding, as used for counts and lengths
+inline size_t varint_size(uint64_t v) {
+    size_t size = 1;
+    for (; v >= 0x80; v >>= 7) size++;
+    return size;
+}
+
+// Bytes of a member name sent inline in the binary encoding
+inline size_t binary_name_size(size_t length) { return varint_size(length << 2 | 1) + length; }
+
+/**
+ * Bytes of val in encoding, diffs included. Counting stops once the size exceeds limit, a result above limit
+ * only says that it is larger. Names are counted as sent inline, interning can only make the binary encoding
+ * smaller.
+ */
+size_t encoded_size(const Json::Value &val, DiffEncoding encoding, size_t limit = SIZE_MAX);
+
+// Largest size at which the new value is sent instead of a patch of patch_size bytes
+inline size_t max_replace_size(size_t patch_size, const DiffOptions &options) {
+    return static_cast<size_t>(patch_size * options.replace_ratio);
+}
+
+// Adds the diff of member key to the 'P' diff of its object, object patches are flattened into paths when smaller
+void add_member_diff(Json::Value &diff, const std::string &key, Json::Value &child_diff, const DiffOptions &options);
+
+// Flattens children that are patches of the same type as diff_json, and turns a diff whose children
+// are all patches of one type into a patch of that type with paths, both where that is smaller
+bool merge_with_children(Json::Value &diff_json, std::string &err_msg, const DiffOptions &options);
+
+/**
+ * Diff of two arrays matched by position, given the hashes of their items.
+ * diff_item(i, j, item_diff) diffs old item i with new item j, new_item(j) returns a copy of new item j.
+ * The caller decides whether the whole new array is smaller.
+ */
+template <typename DiffItem, typename NewItem>
+bool diff_array_items(const std::vector<JsonHash> &old_items, const std::vector<JsonHash> &new_items,
+                      Json::Value &diff_json, std::string &err_msg, const DiffOptions &options, DiffItem diff_item,
+                      NewItem new_item) {
+    int old_length = old_items.size();
+    int new_length = new_items.size();
+    std::vector<EditHunk> hunks;
+    myers_diff(old_items, new_items, ARRAY_DIFF_MAX_COST, hunks);
+
+    if (hunks.empty()) {
+        diff_json = DIFF_UNCHANGED;
+        return true;
+    }
+
+    if (hunks.size() == 1 && hunks[0].old_start == old_length && old_length > 0) {
+        // Only items appended, as for logs
+        Json::Value append_diff = make_diff_json(DiffType::AppendArray);
+        Json::Value &items = append_diff["v"] = Json::arrayValue;
+        for (int i = old_length; i < new_length; i++) {
+            items.append(new_item(i));
+        }
+        diff_json.swap(append_diff);
+        return true;
+    }
+
+    // All indices refer to positions in the old array
+    Json::Value diff = make_diff_json(DiffType::PatchArray);
+    for (auto &hunk : hunks) {
+        int old_size = hunk.old_end - hunk.old_start;
+        int new_size = hunk.new_end - hunk.new_start;
+
+        if (old_size == new_size) {
+            // Items replaced in place are patched one by one
+            Json::Value diff_array = Json::arrayValue;
+            int curr_start = hunk.old_start;
+            int i = hunk.old_start;
+            for (; i < hunk.old_end; i++) {
+                Json::Value item_diff;
+                if (!diff_item(i, hunk.new_start + i - hunk.old_start, item_diff)) {
+                    return false;
+                }
+                if (get_diff_type(item_diff) == DiffType::Unchanged) {
+                    if (diff_array.size() == 1) {
+                        diff[std::to_string(curr_start)] = diff_array[0];
+                        diff_array.clear();
+                    } else if (diff_array.size() > 1) {
+                        diff[std::to_string(curr_start) + ":" + std::to_string(i)] = diff_array;
+                        diff_array.clear();
+                    }
+                    curr_start = i + 1;
+                } else {
+                    diff_array.append(item_diff);
+                }
+            }
+            if (diff_array.size() == 1) {
+                diff[std::to_string(curr_start)] = diff_array[0];
+            } else if (diff_array.size() > 1) {
+                diff[std::to_string(curr_start) + ":" + std::to_string(i)] = diff_array;
+            }
+            continue;
+        }
+
+        // Splice: the overlapping items are patched, the rest inserted or deleted
+        Json::Value diff_array = Json::arrayValue;
+        int i = 0;
+        for (; i < std::min(old_size, new_size); i++) {
+            Json::Value item_diff;
+            if (!diff_item(hunk.old_start + i, hunk.new_start + i, item_diff)) {
+                return false;
+            }
+            diff_array.append(item_diff);
+        }
+        for (; i < new_size; i++) {
+            diff_array.append(new_item(hunk.new_start + i));
+        }
+
+        diff[std::to_string(hunk.old_start) + ":" + std::to_string(hunk.old_end)] = diff_array;
+    }
+
+    // Size Optimizations
+    if (!merge_with_children(diff, err_msg, options)) {
+        return false;
+    }
+    diff_json.swap(diff);
+    return true;
+}
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_DIFF_IMPL_HPP_
@@ -0,0 +1,306 @@
+#include "difftree.hpp"
+
+#include <algorithm>
+#include <string_view>
+#include <utility>
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
+void push_old(std::vector<DiffPiece> &pieces, int start, int end) {
+    if (start == end) return;
+    if (!pieces.empty() && pieces.back().is_old && pieces.back().end == start) {
+        pieces.back().end = end;
+        return;
+    }
+    pieces.push_back(DiffPiece{true, start, end, Json::Value()});
+}
+
+void push_new(std::vector<DiffPiece> &pieces, Json::Value value) {
+    pieces.push_back(DiffPiece{false, 0, 0, Json::Value()});
+    pieces.back().value.swap(value);
+}
+
+bool parse_diff_index(const std::string &segment, int &index) {
+    std::vector<PathSegment> segments;
+    split_diff_path(segment, segments);
+    index = segments[0].start;
+    return segments.size() == 1 && segments[0].is_index;
+}
+
+bool set_node_kind(DiffNode &node, DiffNode::Kind kind, std::string &err_msg) {
+    if (node.kind == kind) return true;
+    if (node.kind != DiffNode::Unknown) {
+        RET_ERROR("Cannot compose diffs patching a value as two different types");
+    }
+    if (kind == DiffNode::Array) {
+        for (auto &child : node.children) {
+            int index;
+            if (!parse_diff_index(child.first, index)) {
+                RET_ERROR("Cannot compose diffs : not an array index : " + child.first);
+            }
+            node.items[index] = std::move(child.second);
+        }
+        node.children.clear();
+    } else if (kind == DiffNode::String && !node.children.empty()) {
+        RET_ERROR("Cannot compose diffs : path into a string");
+    }
+    if (kind == DiffNode::Array || kind == DiffNode::String) {
+        push_old(node.pieces, 0, OPEN_END);
+    }
+    node.kind = kind;
+    return true;
+}
+
+namespace {
+
+// Child of node at one segment of a path
+DiffNode *child_node(DiffNode &node, std::string_view segment, std::string &err_msg) {
+    switch (node.kind) {
+        case DiffNode::Unknown:
+        case DiffNode::Object:
+            return &node.children[std::string(segment)];
+        case DiffNode::Array: {
+            int index;
+            if (!parse_diff_index(std::string(segment), index)) break;
+            return &node.items[index];
+        }
+        default:
+            break;
+    }
+    err_msg = "Cannot compose diffs : invalid path segment : " + std::string(segment);
+    return nullptr;
+}
+
+struct ParsedSplice {
+    int start, end;
+    const Json::Value *replacement;
+    // Array splices: items before this one patch old items in place
+    int first_inserted;
+};
+
+// Pieces of an array from the splices and order of an 'A' diff
+bool build_array_pieces(DiffNode &node, std::vector<ParsedSplice> &splices, const Json::Value *order,
+                        std::string &err_msg) {
+    std::sort(splices.begin(), splices.end(), [](const ParsedSplice &s1, const ParsedSplice &s2) {
+        return s1.start < s2.start || (s1.start == s2.start && s1.end < s2.end);
+    });
+    int pos = 0;
+    for (auto &splice : splices) {
+        if (splice.start < pos) {
+            RET_ERROR("Overlapping array ranges");
+        }
+        pos = splice.end;
+    }
+
+    node.pieces.clear();
+    if (order == nullptr) {
+        pos = 0;
+        for (auto &splice : splices) {
+            push_old(node.pieces, pos, splice.start + splice.first_inserted);
+            for (int j = splice.first_inserted; j < (int)splice.replacement->size(); j++) {
+                push_new(node.pieces, (*splice.replacement)[j]);
+            }
+            pos = splice.end;
+        }
+        push_old(node.pieces, pos, OPEN_END);
+        return true;
+    }
+
+    // Reordered: every old item is either listed in the order or deleted, which gives the length.
+    // Items inserted by a splice are placed right before old item splice.end.
+    std::vector<std::pair<int, int>> kept;
+    int length = 0;
+    for (auto &entry : *order) {
+        int start, end;
+        if (entry.isArray() && entry.size() == 2) {
+            start = entry[0].asInt();
+            end = entry[1].asInt();
+        } else if (entry.isIntegral()) {
+            start = entry.asInt();
+            end = start + 1;
+        } else {
+            RET_ERROR("Invalid array order entry");
+        }
+        if (start < 0 || start > end) {
+            RET_ERROR("Invalid array order entry");
+        }
+        kept.emplace_back(start, end);
+        length += end - start;
+    }
+    for (auto &splice : splices) {
+        length += splice.end - splice.start - splice.first_inserted;
+    }
+    auto place_attached = [&](int k) {
+        for (auto &splice : splices) {
+            if (splice.end != k) continue;
+            for (int j = splice.first_inserted; j < (int)splice.replacement->size(); j++) {
+                push_new(node.pieces, (*splice.replacement)[j]);
+            }
+        }
+    };
+    for (auto &range : kept) {
+        if (range.second > length) {
+            RET_ERROR("Array order refers to a missing item : " + std::to_string(range.second - 1));
+        }
+        for (int k = range.first; k < range.second; k++) {
+            place_attached(k);
+            push_old(node.pieces, k, k + 1);
+        }
+    }
+    place_attached(length);
+    node.length = length;
+    return true;
+}
+
+// Pieces of a string from the splices of an 'S' diff
+bool build_string_pieces(DiffNode &node, std::vector<ParsedSplice> &splices, std::string &err_msg) {
+    std::sort(splices.begin(), splices.end(),
+              [](const ParsedSplice &s1, const ParsedSplice &s2) { return s1.start < s2.start; });
+    node.pieces.clear();
+    int pos = 0;
+    for (auto &splice : splices) {
+        if (splice.start < pos || splice.start > splice.end) {
+            RET_ERROR("Invalid string range : " + std::to_string(splice.start) + ":" + std::to_string(splice.end));
+        }
+        push_old(node.pieces, pos, splice.start);
+        const Json::Value &replacement = *splice.replacement;
+        if (replacement.isString()) {
+            push_new(node.pieces, replacement);
+        } else if (replacement.isArray()) {
+            for (auto &piece : replacement) {
+                if (piece.isString()) {
+                    push_new(node.pieces, piece);
+                } else if (piece.isArray() && piece.size() == 2 && piece[0].asInt() >= 0 &&
+                           piece[0].asInt() <= piece[1].asInt()) {
+                    push_old(node.pieces, piece[0].asInt(), piece[1].asInt());
+                } else {
+                    RET_ERROR("Invalid string piece");
+                }
+            }
+        } else {
+            RET_ERROR("Cannot apply 'S': Replacement is not a string");
+        }
+        pos = splice.end;
+    }
+    push_old(node.pieces, pos, OPEN_END);
+    return true;
+}
+
+bool parse_patch(const Json::Value &diff, DiffType diff_type, DiffNode &node, std::string &err_msg) {
+    const DiffNode::Kind kind = diff_type == DiffType::PatchObject  ? DiffNode::Object
+                            : diff_type == DiffType::PatchArray ? DiffNode::Array
+                                                                : DiffNode::String;
+    // Splices are collected per patched array or string, their pieces are built once all keys are read
+    std::map<DiffNode *, std::vector<ParsedSplice>> splices;
+    std::map<DiffNode *, const Json::Value *> orders;
+    std::vector<PathSegment> segments;
+    auto find_container = [&](std::string_view key, DiffNode *&container) {
+        split_diff_path(key, segments);
+        container = &node;
+        for (size_t i = 0; i + 1 < segments.size(); i++) {
+            container = child_node(*container, segments[i].name, err_msg);
+            if (container == nullptr) return false;
+        }
+        return set_node_kind(*container, kind, err_msg);
+    };
+
+    // Setting the kind of a container moves its children, so all kinds are set before nodes are referenced
+    for (Json::Value::const_iterator it = diff.begin(); it != diff.end(); ++it) {
+        const char *key_end;
+        const char *key_begin = it.memberName(&key_end);
+        DiffNode *container;
+        if (std::string_view(key_begin, key_end - key_begin) != "_t" &&
+            !find_container(std::string_view(key_begin, key_end - key_begin), container)) {
+            RET_ERROR(err_msg);
+        }
+    }
+
+    for (Json::Value::const_iterator it = diff.begin(); it != diff.end(); ++it) {
+        const char *key_end;
+        const char *key_begin = it.memberName(&key_end);
+        std::string_view key(key_begin, key_end - key_begin);
+        if (key == "_t") continue;
+        const Json::Value &child_diff = *it;
+
+        DiffNode *container;
+        if (!find_container(key, container)) {
+            RET_ERROR(err_msg);
+        }
+        PathSegment last = segments.back();
+
+        DiffNode *target = nullptr;
+        if (kind == DiffNode::Object) {
+            target = &container->children[std::string(last.name)];
+        } else if (kind == DiffNode::String) {
+            if (!last.is_index && !last.is_range) {
+                RET_ERROR("Invalid string range : " + std::string(last.name));
+            }
+            splices[container].push_back(ParsedSplice{last.start, last.end, &child_diff, 0});
+            continue;
+        } else if (last.name == ">") {
+            if (!child_diff.isArray()) {
+                RET_ERROR("Array order is not an array");
+            }
+            orders[container] = &child_diff;
+            splices[container];
+            continue;
+        } else if (last.is_index) {
+            target = &container->items[last.start];
+        } else if (last.is_range && child_diff.isArray() && last.start <= last.end) {
+            int num_patched = std::min<int>(last.end - last.start, child_diff.size());
+            for (int i = 0; i < num_patched; i++) {
+                DiffNode &item = container->items[last.start + i];
+                if (!item.is_unchanged() || !parse_diff_node(child_diff[i], item, err_msg)) {
+                    RET_ERROR(item.is_unchanged() ? err_msg : "Cannot compose diffs patching an item twice");
+                }
+            }
+            splices[container].push_back(ParsedSplice{last.start, last.end, &child_diff, num_patched});
+            continue;
+        } else {
+            RET_ERROR("Invalid array range : " + std::string(last.name));
+        }
+
+        if (!target->is_unchanged()) {
+            RET_ERROR("Cannot compose diffs patching a value twice : " + std::string(key));
+        }
+        if (!parse_diff_node(child_diff, *target, err_msg)) {
+            RET_ERROR(err_msg);
+        }
+    }
+
+    for (auto &pair : splices) {
+        DiffNode &container = *pair.first;
+        bool built = kind == DiffNode::Array ? build_array_pieces(container, pair.second, orders[&container], err_msg)
+                                         : build_string_pieces(container, pair.second, err_msg);
+        if (!built) {
+            RET_ERROR(err_msg);
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+bool parse_diff_node(const Json::Value &diff, DiffNode &node, std::string &err_msg) {
+    const DiffType diff_type = get_diff_type(diff);
+    switch (diff_type) {
+        case DiffType::Unchanged:
+            return true;
+        case DiffType::Replace:
+        case DiffType::Delete:
+        case DiffType::Increment:
+        case DiffType::AppendString:
+        case DiffType::AppendArray:
+            node.kind = DiffNode::Value;
+            node.value = diff;
+            return true;
+        case DiffType::PatchObject:
+        case DiffType::PatchArray:
+        case DiffType::PatchString:
+            return parse_patch(diff, diff_type, node, err_msg);
+        default:
+            RET_ERROR("Unsupported diff type : " + std::string{static_cast<char>(diff_type)});
+    }
+}
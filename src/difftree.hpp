@@ -0,0 +1,70 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_DIFFTREE_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_DIFFTREE_HPP_
+
+#include <json/json.h>
+
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "diff.hpp"
+
+// End of the last old range of an array or string whose length is not known
+#define OPEN_END INT_MAX
+
+// Piece of a patched array or string, a range of the old value or new content
+struct DiffPiece {
+    bool is_old;
+    // Old items or bytes [start, end)
+    int start, end;
+    // Inserted item, or inserted string
+    Json::Value value;
+
+    // Number of items or bytes, INT64_MAX for an open end
+    int64_t length(bool is_array) const {
+        if (is_old) return end == OPEN_END ? INT64_MAX : end - start;
+        return is_array ? 1 : value.asString().size();
+    }
+};
+
+/**
+ * A diff unfolded into one node per value it touches. Paths are split into their
+ * segments, and patched arrays and strings are kept as the pieces the new value is
+ * made of, so that two diffs can be merged node by node (compose.cpp) or applied to
+ * a value other than Json::Value (persistent.cpp).
+ */
+struct DiffNode {
+    enum Kind { Unknown, Object, Array, String, Value };
+    // Unknown without children is an unchanged value
+    Kind kind = Unknown;
+    // Value: the new value or the X / I / C / L diff
+    Json::Value value;
+    // Object: patched members, Unknown: values below a path segment of a value of unknown type
+    std::map<std::string, DiffNode> children;
+    // Array: old items patched in place
+    std::map<int, DiffNode> items;
+    // Array and String: the new value
+    std::vector<DiffPiece> pieces;
+    // Array: old length, only known when the items are reordered
+    int length = -1;
+
+    bool is_unchanged() const { return kind == Unknown && children.empty(); }
+};
+
+
+// Unfolds diff into node. Fails for diffs patching one value twice, which get_diff never makes.
+bool parse_diff_node(const Json::Value &diff, DiffNode &node, std::string &err_msg);
+
+// Sets the kind of a node that is Unknown so far, its children are moved
+bool set_node_kind(DiffNode &node, DiffNode::Kind kind, std::string &err_msg);
+
+// Appends old range [start, end), merged with the previous piece if adjacent
+void push_old(std::vector<DiffPiece> &pieces, int start, int end);
+void push_new(std::vector<DiffPiece> &pieces, Json::Value value);
+
+// Array index of a path segment
+bool parse_diff_index(const std::string &segment, int &index);
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_DIFFTREE_HPP_
@@ -0,0 +1,160 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_MYERS_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_MYERS_HPP_
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * Replaces old[old_start:old_end] with new[new_start:new_end]
+ */
+struct EditHunk {
+    int old_start, old_end;
+    int new_start, new_end;
+};
+
+/**
+ * Myers O(ND) sequence diff using the linear space divide and conquer
+ * (middle snake) refinement, so memory stays O(N + M) for huge sequences.
+ *
+ * Appends the hunks turning a[a_start:a_end] into b[b_start:b_end] to hunks,
+ * in order. Hunks are separated by at least one matching element. When a
+ * sub-problem needs more than max_cost edits it is emitted as a single hunk,
+ * bounding time to O((N + M) * max_cost).
+ */
+template <typename Seq>
+class MyersDiff {
+   public:
+    MyersDiff(const Seq &a, const Seq &b, int max_cost) : a(a), b(b), max_cost(max_cost) {}
+
+    void diff(int a_start, int a_end, int b_start, int b_end, std::vector<EditHunk> &hunks) {
+        // Common prefix and suffix are never part of a hunk
+        while (a_start < a_end && b_start < b_end && a[a_start] == b[b_start]) {
+            a_start++;
+            b_start++;
+        }
+        while (a_start < a_end && b_start < b_end && a[a_end - 1] == b[b_end - 1]) {
+            a_end--;
+            b_end--;
+        }
+
+        if (a_start == a_end || b_start == b_end) {
+            if (a_start != a_end || b_start != b_end) {
+                add_hunk(EditHunk{a_start, a_end, b_start, b_end}, hunks);
+            }
+            return;
+        }
+
+        int x, y;
+        if (!middle_snake(a_start, a_end, b_start, b_end, x, y)) {
+            add_hunk(EditHunk{a_start, a_end, b_start, b_end}, hunks);
+            return;
+        }
+
+        diff(a_start, x, b_start, y, hunks);
+        diff(x, a_end, y, b_end, hunks);
+    }
+
+   private:
+    const Seq &a;
+    const Seq &b;
+    int max_cost;
+
+    static void add_hunk(EditHunk hunk, std::vector<EditHunk> &hunks) {
+        if (!hunks.empty() && hunks.back().old_end == hunk.old_start && hunks.back().new_end == hunk.new_start) {
+            hunks.back().old_end = hunk.old_end;
+            hunks.back().new_end = hunk.new_end;
+            return;
+        }
+        hunks.push_back(hunk);
+    }
+
+    // Finds a point (x, y) on an optimal edit path, false if no path within max_cost edits exists
+    bool middle_snake(int a_start, int a_end, int b_start, int b_end, int &x, int &y) {
+        const int n = a_end - a_start;
+        const int m = b_end - b_start;
+        const int max_d = std::min((n + m + 1) / 2, max_cost + 1);
+        const int v_offset = max_d + 1;
+        const int v_length = 2 * max_d + 3;
+        const int delta = n - m;
+        const bool front = (delta % 2 != 0);
+
+        std::vector<int> v1(v_length, -1), v2(v_length, -1);
+        v1[v_offset + 1] = 0;
+        v2[v_offset + 1] = 0;
+
+        // Diagonals that ran off the edit graph are skipped on later rounds
+        int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+        for (int d = 0; d < max_d; d++) {
+            for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+                int k1_offset = v_offset + k1;
+                int x1;
+                if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) {
+                    x1 = v1[k1_offset + 1];
+                } else {
+                    x1 = v1[k1_offset - 1] + 1;
+                }
+                int y1 = x1 - k1;
+                while (x1 < n && y1 < m && a[a_start + x1] == b[b_start + y1]) {
+                    x1++;
+                    y1++;
+                }
+                v1[k1_offset] = x1;
+                if (x1 > n) {
+                    k1end += 2;
+                } else if (y1 > m) {
+                    k1start += 2;
+                } else if (front) {
+                    int k2_offset = v_offset + delta - k1;
+                    if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1) {
+                        if (x1 >= n - v2[k2_offset]) {
+                            x = a_start + x1;
+                            y = b_start + y1;
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+                int k2_offset = v_offset + k2;
+                int x2;
+                if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) {
+                    x2 = v2[k2_offset + 1];
+                } else {
+                    x2 = v2[k2_offset - 1] + 1;
+                }
+                int y2 = x2 - k2;
+                while (x2 < n && y2 < m && a[a_end - x2 - 1] == b[b_end - y2 - 1]) {
+                    x2++;
+                    y2++;
+                }
+                v2[k2_offset] = x2;
+                if (x2 > n) {
+                    k2end += 2;
+                } else if (y2 > m) {
+                    k2start += 2;
+                } else if (!front) {
+                    int k1_offset = v_offset + delta - k2;
+                    if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+                        int x1 = v1[k1_offset];
+                        int y1 = x1 - (k1_offset - v_offset);
+                        if (x1 >= n - x2) {
+                            x = a_start + x1;
+                            y = b_start + y1;
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
+};
+
+template <typename Seq>
+void myers_diff(const Seq &a, const Seq &b, int max_cost, std::vector<EditHunk> &hunks) {
+    MyersDiff<Seq>(a, b, max_cost).diff(0, a.size(), 0, b.size(), hunks);
+}
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_MYERS_HPP_
@@ -0,0 +1,690 @@
+#include "persistent.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "diff_impl.hpp"
+#include "difftree.hpp"
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
+// Objects with more members are split into a trie by the hashes of the member names, 5 bits per level
+#define PERSISTENT_BUCKET_MAX 32
+#define PERSISTENT_TRIE_BITS 5
+// Below this depth the 64 bit hashes are used up, buckets are not split any further
+#define PERSISTENT_TRIE_DEPTH 12
+
+struct PersistentValue::Node {
+    Json::ValueType type;
+    JsonHash hash;
+    // Null, bool, number or string
+    Json::Value leaf;
+    std::vector<PersistentValue> items;
+    // Objects are a bucket of members sorted by name, or a trie node with a child per slot (nullptr if empty)
+    std::vector<Member> members;
+    std::vector<std::shared_ptr<const Node>> children;
+    size_t num_members = 0;
+    // Encoded size per DiffEncoding. Below the root of an object, the sizes of the members alone.
+    size_t sizes[2];
+};
+
+namespace {
+
+// Same order as the member map of Json::Value
+bool member_less(const PersistentValue::Member &member, std::string_view name) {
+    size_t length = std::min(member.first.size(), name.size());
+    int comp = memcmp(member.first.data(), name.data(), length);
+    return comp < 0 || (comp == 0 && member.first.size() < name.size());
+}
+
+inline JsonHash name_hash(std::string_view name) { return hash_bytes(name.data(), name.data() + name.size()); }
+
+inline int trie_slot(JsonHash h, int depth) {
+    return (h >> (depth * PERSISTENT_TRIE_BITS)) & ((1 << PERSISTENT_TRIE_BITS) - 1);
+}
+
+const DiffEncoding ENCODINGS[] = {DiffEncoding::Json, DiffEncoding::Binary};
+
+}  // namespace
+
+// Makes the nodes, which are only ever modified here before they are shared
+class PersistentBuilder {
+   public:
+    typedef PersistentValue::Node Node;
+    typedef PersistentValue::Member Member;
+    typedef std::shared_ptr<const Node> NodePtr;
+
+    static PersistentValue leaf(Json::Value value) {
+        auto node = std::make_shared<Node>();
+        node->type = value.type();
+        HashCache leaf_hashes;
+        node->hash = leaf_hashes.get(value);
+        for (DiffEncoding encoding : ENCODINGS) {
+            node->sizes[(int)encoding] = encoded_size(value, encoding);
+        }
+        node->leaf.swap(value);
+        return PersistentValue(std::move(node));
+    }
+
+    static PersistentValue array(std::vector<PersistentValue> items) {
+        auto node = std::make_shared<Node>();
+        node->type = Json::ValueType::arrayValue;
+        node->leaf = Json::Value(Json::arrayValue);
+        JsonHash h = combine_hash(mix_hash(node->type), items.size());
+        for (auto &item : items) {
+            h = combine_hash(h, item.hash());
+        }
+        node->hash = h;
+        node->sizes[(int)DiffEncoding::Json] = 2 + (items.empty() ? 0 : items.size() - 1);
+        node->sizes[(int)DiffEncoding::Binary] = 1 + varint_size(items.size());
+        for (auto &item : items) {
+            for (DiffEncoding encoding : ENCODINGS) {
+                node->sizes[(int)encoding] += item.encoded_size(encoding);
+            }
+        }
+        node->items.swap(items);
+        return PersistentValue(std::move(node));
+    }
+
+    // Object or part of one at depth of the trie, members have to be sorted
+    static NodePtr object(std::vector<Member> members, int depth) {
+        if (members.size() <= PERSISTENT_BUCKET_MAX || depth >= PERSISTENT_TRIE_DEPTH) {
+            // Same hash as HashCache for objects that fit a bucket
+            auto node = std::make_shared<Node>();
+            node->type = Json::ValueType::objectValue;
+            node->leaf = Json::Value(Json::objectValue);
+            node->num_members = members.size();
+            JsonHash h = combine_hash(mix_hash(node->type), members.size());
+            node->sizes[(int)DiffEncoding::Json] = node->sizes[(int)DiffEncoding::Binary] = 0;
+            for (auto &member : members) {
+                h = combine_hash(h, name_hash(member.first));
+                h = combine_hash(h, member.second.hash());
+                node->sizes[(int)DiffEncoding::Json] +=
+                    json_string_size(member.first.data(), member.first.data() + member.first.size()) + 1 +
+                    member.second.encoded_size(DiffEncoding::Json);
+                node->sizes[(int)DiffEncoding::Binary] +=
+                    binary_name_size(member.first.size()) + member.second.encoded_size(DiffEncoding::Binary);
+            }
+            node->hash = h;
+            node->members.swap(members);
+            if (depth == 0) add_object_sizes(node);
+            return node;
+        }
+        std::vector<std::vector<Member>> slots(1 << PERSISTENT_TRIE_BITS);
+        for (auto &member : members) {
+            slots[trie_slot(name_hash(member.first), depth)].push_back(std::move(member));
+        }
+        std::vector<NodePtr> children(slots.size());
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (!slots[i].empty()) children[i] = object(std::move(slots[i]), depth + 1);
+        }
+        return trie(std::move(children), depth);
+    }
+
+    static NodePtr trie(std::vector<NodePtr> children, int depth) {
+        auto node = std::make_shared<Node>();
+        node->type = Json::ValueType::objectValue;
+        node->leaf = Json::Value(Json::objectValue);
+        node->sizes[(int)DiffEncoding::Json] = node->sizes[(int)DiffEncoding::Binary] = 0;
+        for (auto &child : children) {
+            if (!child) continue;
+            node->num_members += child->num_members;
+            for (DiffEncoding encoding : ENCODINGS) {
+                node->sizes[(int)encoding] += child->sizes[(int)encoding];
+            }
+        }
+        JsonHash h = combine_hash(mix_hash(node->type) + 1, node->num_members);
+        for (auto &child : children) {
+            h = combine_hash(h, child ? child->hash : 0);
+        }
+        node->hash = h;
+        node->children.swap(children);
+        if (depth == 0) add_object_sizes(node);
+        return node;
+    }
+
+    // Turns the sizes of the members of the root of an object into the sizes of the object
+    static void add_object_sizes(const std::shared_ptr<Node> &node) {
+        const size_t n = node->num_members;
+        node->sizes[(int)DiffEncoding::Json] += 2 + (n == 0 ? 0 : n - 1);
+        node->sizes[(int)DiffEncoding::Binary] += 1 + varint_size(n);
+        if (find(node.get(), "_t") != nullptr) {
+            // Encoded like a diff in the binary encoding
+            node->sizes[(int)DiffEncoding::Binary] =
+                ::encoded_size(PersistentValue(node).to_json(), DiffEncoding::Binary);
+        }
+    }
+
+    // Members of a bucket or trie node, in trie order
+    static void collect(const NodePtr &node, std::vector<Member> &members) {
+        if (!node) return;
+        members.insert(members.end(), node->members.begin(), node->members.end());
+        for (auto &child : node->children) {
+            collect(child, members);
+        }
+    }
+
+    static void sort_members(std::vector<Member> &members) {
+        std::sort(members.begin(), members.end(),
+                  [](const Member &m1, const Member &m2) { return member_less(m1, m2.first); });
+    }
+
+    static void sorted_members(const NodePtr &node, std::vector<Member> &members) {
+        collect(node, members);
+        if (node && !node->children.empty()) sort_members(members);
+    }
+
+    // Copy of node with member name set to value, or removed if value is nullptr. Only the bucket and the trie
+    // nodes above it are copied, and buckets are split or merged so that the shape only depends on the members.
+    static NodePtr set_member(const NodePtr &node, int depth, const std::string &name, JsonHash h,
+                              const PersistentValue *value) {
+        if (!node || node->children.empty()) {
+            std::vector<Member> members;
+            if (node) members = node->members;
+            auto it = std::lower_bound(members.begin(), members.end(), name, member_less);
+            bool exists = it != members.end() && it->first == name;
+            if (value == nullptr && !exists) return node;
+            if (value == nullptr) {
+                members.erase(it);
+            } else if (exists) {
+                it->second = *value;
+            } else {
+                members.emplace(it, name, *value);
+            }
+            if (members.empty() && depth > 0) return nullptr;
+            return object(std::move(members), depth);
+        }
+
+        const int slot = trie_slot(h, depth);
+        NodePtr child = set_member(node->children[slot], depth + 1, name, h, value);
+        if (child == node->children[slot]) return node;
+        size_t num_members = node->num_members - (node->children[slot] ? node->children[slot]->num_members : 0) +
+                             (child ? child->num_members : 0);
+        std::vector<NodePtr> children = node->children;
+        children[slot] = child;
+        if (num_members <= PERSISTENT_BUCKET_MAX) {
+            std::vector<Member> members;
+            for (auto &remaining : children) {
+                collect(remaining, members);
+            }
+            sort_members(members);
+            return object(std::move(members), depth);
+        }
+        return trie(std::move(children), depth);
+    }
+
+    static const PersistentValue *find(const Node *node, std::string_view name) {
+        const JsonHash h = node->children.empty() ? 0 : name_hash(name);
+        const Node *current = node;
+        for (int depth = 0; current != nullptr && !current->children.empty(); depth++) {
+            current = current->children[trie_slot(h, depth)].get();
+        }
+        if (current == nullptr) return nullptr;
+        auto it = std::lower_bound(current->members.begin(), current->members.end(), name, member_less);
+        if (it == current->members.end() || it->first != name) return nullptr;
+        return &it->second;
+    }
+
+    static const NodePtr &node_of(const PersistentValue &value) { return value.node; }
+    static PersistentValue value_of(NodePtr node) { return PersistentValue(std::move(node)); }
+
+    static const NodePtr &null_node() {
+        static const NodePtr node = leaf(Json::Value()).node;
+        return node;
+    }
+};
+
+PersistentValue::PersistentValue() : node(PersistentBuilder::null_node()) {}
+
+PersistentValue::PersistentValue(const Json::Value &val) {
+    switch (val.type()) {
+        case Json::ValueType::objectValue: {
+            std::vector<Member> members;
+            members.reserve(val.size());
+            for (Json::Value::const_iterator it = val.begin(); it != val.end(); ++it) {
+                const char *end;
+                const char *begin = it.memberName(&end);
+                members.emplace_back(std::string(begin, end), PersistentValue(*it));
+            }
+            node = PersistentBuilder::object(std::move(members), 0);
+            break;
+        }
+        case Json::ValueType::arrayValue: {
+            std::vector<PersistentValue> items;
+            items.reserve(val.size());
+            for (auto &item : val) {
+                items.emplace_back(item);
+            }
+            node = PersistentBuilder::array(std::move(items)).node;
+            break;
+        }
+        default:
+            node = PersistentBuilder::leaf(val).node;
+    }
+}
+
+Json::Value PersistentValue::to_json() const {
+    switch (node->type) {
+        case Json::ValueType::objectValue: {
+            Json::Value obj = Json::objectValue;
+            for_each_member([&](const std::string &name, const PersistentValue &member) {
+                Json::Value value = member.to_json();
+                obj[name].swap(value);
+            });
+            return obj;
+        }
+        case Json::ValueType::arrayValue: {
+            Json::Value arr = Json::arrayValue;
+            for (auto &item : node->items) {
+                Json::Value value = item.to_json();
+                arr.append(Json::Value()).swap(value);
+            }
+            return arr;
+        }
+        default:
+            return node->leaf;
+    }
+}
+
+Json::ValueType PersistentValue::type() const { return node->type; }
+
+JsonHash PersistentValue::hash() const { return node->hash; }
+
+size_t PersistentValue::size() const { return node->num_members + node->items.size(); }
+
+size_t PersistentValue::encoded_size(DiffEncoding encoding) const { return node->sizes[(int)encoding]; }
+
+const PersistentValue *PersistentValue::find(std::string_view name) const {
+    if (node->type != Json::ValueType::objectValue) return nullptr;
+    return PersistentBuilder::find(node.get(), name);
+}
+
+void PersistentValue::for_each_member(
+    const std::function<void(const std::string &, const PersistentValue &)> &fn) const {
+    std::vector<const Node *> pending{node.get()};
+    while (!pending.empty()) {
+        const Node *current = pending.back();
+        pending.pop_back();
+        for (auto &member : current->members) {
+            fn(member.first, member.second);
+        }
+        for (auto &child : current->children) {
+            if (child) pending.push_back(child.get());
+        }
+    }
+}
+
+const std::vector<PersistentValue> &PersistentValue::items() const { return node->items; }
+
+const Json::Value &PersistentValue::leaf() const { return node->leaf; }
+
+namespace {
+
+typedef PersistentBuilder::NodePtr NodePtr;
+
+bool apply_node(const PersistentValue &old_value, DiffNode &node, PersistentValue &new_value, std::string &err_msg);
+
+bool apply_value(const PersistentValue &old_value, Json::Value &diff, PersistentValue &new_value,
+                 std::string &err_msg) {
+    const DiffType diff_type = get_diff_type(diff);
+    switch (diff_type) {
+        case DiffType::Replace:
+            new_value = PersistentValue(diff);
+            return true;
+        case DiffType::AppendArray: {
+            if (old_value.type() != Json::ValueType::arrayValue) {
+                RET_ERROR("Cannot apply 'L': Old obj is not of array type");
+            }
+            const Json::Value &appended = diff["v"];
+            if (!appended.isArray()) {
+                RET_ERROR("Cannot apply 'L': Appended value is not an array");
+            }
+            std::vector<PersistentValue> items = old_value.items();
+            for (auto &item : appended) {
+                items.emplace_back(item);
+            }
+            new_value = PersistentBuilder::array(std::move(items));
+            return true;
+        }
+        case DiffType::AppendString:
+        case DiffType::Increment: {
+            // Leaves are copied anyway
+            Json::Value leaf = old_value.leaf();
+            if (!apply_diff(leaf, diff, err_msg)) {
+                RET_ERROR(err_msg);
+            }
+            new_value = PersistentBuilder::leaf(std::move(leaf));
+            return true;
+        }
+        case DiffType::Delete:
+            RET_ERROR("Cannot apply delete diff");
+        default:
+            RET_ERROR("Unsupported diff type : " + std::string{static_cast<char>(diff_type)});
+    }
+}
+
+bool apply_object(const PersistentValue &old_value, DiffNode &node, PersistentValue &new_value,
+                  std::string &err_msg) {
+    if (old_value.type() != Json::ValueType::objectValue &&
+        (node.kind != DiffNode::Object || old_value.type() != Json::ValueType::nullValue)) {
+        RET_ERROR(node.kind == DiffNode::Object ? "Cannot apply 'P': Old obj is not of object type"
+                                                : "Cannot go inside non object");
+    }
+
+    // Only the buckets of the changed members are copied
+    NodePtr root = old_value.type() == Json::ValueType::objectValue ? PersistentBuilder::node_of(old_value)
+                                                                    : PersistentBuilder::object({}, 0);
+    for (auto &pair : node.children) {
+        const std::string &name = pair.first;
+        DiffNode &child = pair.second;
+        const PersistentValue *old_member = PersistentBuilder::find(root.get(), name);
+        const JsonHash h = name_hash(name);
+
+        if (child.kind == DiffNode::Value && get_diff_type(child.value) == DiffType::Delete) {
+            // Deleting a missing member is a no-op
+            root = PersistentBuilder::set_member(root, 0, name, h, nullptr);
+        } else if (old_member != nullptr) {
+            PersistentValue member;
+            if (!apply_node(*old_member, child, member, err_msg)) {
+                RET_ERROR(err_msg);
+            }
+            root = PersistentBuilder::set_member(root, 0, name, h, &member);
+        } else if (node.kind == DiffNode::Object && child.kind == DiffNode::Value) {
+            PersistentValue member(child.value);
+            root = PersistentBuilder::set_member(root, 0, name, h, &member);
+        } else if (!child.is_unchanged()) {
+            RET_ERROR("Path to non-existent object : " + name);
+        }
+    }
+    new_value = PersistentBuilder::value_of(std::move(root));
+    return true;
+}
+
+// Old items [start, end) of an array or string, an open end is the end of the old value
+bool resolve_range(const DiffPiece &piece, size_t length, size_t &start, size_t &end) {
+    start = piece.start;
+    end = piece.end == OPEN_END ? std::max<size_t>(length, start) : piece.end;
+    return end <= length;
+}
+
+bool apply_array(const PersistentValue &old_value, DiffNode &node, PersistentValue &new_value,
+                 std::string &err_msg) {
+    if (old_value.type() != Json::ValueType::arrayValue) {
+        RET_ERROR(node.kind == DiffNode::Array ? "Cannot apply 'A': Old obj is not of array type"
+                                               : "Cannot go inside non object");
+    }
+    const std::vector<PersistentValue> &old_items = old_value.items();
+    if (node.length != -1 && node.length != (int)old_items.size()) {
+        RET_ERROR("Array order does not match the array length : " + std::to_string(node.length));
+    }
+
+    // Items patched in place, by old index
+    std::map<int, PersistentValue> patched;
+    for (auto &pair : node.items) {
+        if (pair.first < 0 || pair.first >= (int)old_items.size()) {
+            RET_ERROR("Array index does not exist : " + std::to_string(pair.first));
+        }
+        if (!apply_node(old_items[pair.first], pair.second, patched[pair.first], err_msg)) {
+            RET_ERROR(err_msg);
+        }
+    }
+    if (node.kind == DiffNode::Unknown) {
+        for (auto &pair : node.children) {
+            int index;
+            if (!parse_diff_index(pair.first, index) || index >= (int)old_items.size()) {
+                RET_ERROR("Array index does not exist : " + pair.first);
+            }
+            if (!apply_node(old_items[index], pair.second, patched[index], err_msg)) {
+                RET_ERROR(err_msg);
+            }
+        }
+    }
+
+    // Paths into an array of a diff that does not patch the array itself keep all items
+    std::vector<DiffPiece> all_items;
+    if (node.kind == DiffNode::Unknown) {
+        push_old(all_items, 0, OPEN_END);
+    }
+    std::vector<PersistentValue> items;
+    items.reserve(old_items.size());
+    for (auto &piece : node.kind == DiffNode::Unknown ? all_items : node.pieces) {
+        if (!piece.is_old) {
+            items.emplace_back(piece.value);
+            continue;
+        }
+        size_t start, end;
+        if (!resolve_range(piece, old_items.size(), start, end)) {
+            RET_ERROR("Invalid array range : " + std::to_string(piece.start) + ":" + std::to_string(piece.end));
+        }
+        for (size_t i = start; i < end; i++) {
+            auto it = patched.find(i);
+            items.push_back(it == patched.end() ? old_items[i] : it->second);
+        }
+    }
+    new_value = PersistentBuilder::array(std::move(items));
+    return true;
+}
+
+bool apply_string(const PersistentValue &old_value, DiffNode &node, PersistentValue &new_value,
+                  std::string &err_msg) {
+    if (old_value.type() != Json::ValueType::stringValue) {
+        RET_ERROR("Cannot apply 'S': Old obj is not of string type");
+    }
+    const char *begin, *end;
+    old_value.leaf().getString(&begin, &end);
+    std::string_view old_str(begin, end - begin);
+
+    std::string new_str;
+    for (auto &piece : node.pieces) {
+        if (!piece.is_old) {
+            const char *piece_begin, *piece_end;
+            piece.value.getString(&piece_begin, &piece_end);
+            new_str.append(piece_begin, piece_end - piece_begin);
+            continue;
+        }
+        size_t start, end;
+        if (!resolve_range(piece, old_str.size(), start, end)) {
+            RET_ERROR("Invalid string range : " + std::to_string(piece.start) + ":" + std::to_string(piece.end));
+        }
+        new_str.append(old_str.substr(start, end - start));
+    }
+    new_value = PersistentBuilder::leaf(Json::Value(new_str));
+    return true;
+}
+
+bool apply_node(const PersistentValue &old_value, DiffNode &node, PersistentValue &new_value, std::string &err_msg) {
+    switch (node.kind) {
+        case DiffNode::Value:
+            return apply_value(old_value, node.value, new_value, err_msg);
+        case DiffNode::Object:
+            return apply_object(old_value, node, new_value, err_msg);
+        case DiffNode::Array:
+            return apply_array(old_value, node, new_value, err_msg);
+        case DiffNode::String:
+            return apply_string(old_value, node, new_value, err_msg);
+        case DiffNode::Unknown:
+            break;
+    }
+    // Path segments into a value whose type the diff does not say
+    if (node.is_unchanged()) {
+        new_value = old_value;
+        return true;
+    }
+    if (old_value.type() == Json::ValueType::arrayValue) {
+        return apply_array(old_value, node, new_value, err_msg);
+    }
+    return apply_object(old_value, node, new_value, err_msg);
+}
+
+bool get_diff_at(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+                 std::string &err_msg, const DiffOptions &options, std::string &path);
+
+/**
+ * Walks the members of two objects that differ, both tries are descended in parallel and subtrees with equal
+ * hashes are skipped. on_member(old_member, new_member) gets nullptr for a member missing on one side.
+ */
+template <typename OnMember>
+bool diff_members(const NodePtr &old_node, const NodePtr &new_node, OnMember &on_member) {
+    if (old_node && new_node && (old_node == new_node || old_node->hash == new_node->hash)) {
+        return true;
+    }
+    if (old_node && new_node && !old_node->children.empty() && !new_node->children.empty()) {
+        for (size_t i = 0; i < old_node->children.size(); i++) {
+            if (!diff_members(old_node->children[i], new_node->children[i], on_member)) return false;
+        }
+        return true;
+    }
+
+    // A bucket on either side, the other side is flattened into it
+    std::vector<PersistentValue::Member> old_members, new_members;
+    PersistentBuilder::sorted_members(old_node, old_members);
+    PersistentBuilder::sorted_members(new_node, new_members);
+    auto old_it = old_members.begin(), new_it = new_members.begin();
+    while (old_it != old_members.end() || new_it != new_members.end()) {
+        bool ok;
+        if (new_it == new_members.end() || (old_it != old_members.end() && member_less(*old_it, new_it->first))) {
+            ok = on_member(&*old_it++, nullptr);
+        } else if (old_it == old_members.end() || old_it->first != new_it->first) {
+            ok = on_member(nullptr, &*new_it++);
+        } else {
+            ok = on_member(&*old_it++, &*new_it++);
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Mirrors replace_if_smaller of diff.cpp, the size of the new value is known without walking it
+void replace_if_smaller(Json::Value &diff_json, const PersistentValue &new_value, const DiffOptions &options) {
+    if (get_diff_type(diff_json) == DiffType::Unchanged) return;
+    if (new_value.encoded_size(options.encoding) <=
+        max_replace_size(encoded_size(diff_json, options.encoding), options)) {
+        diff_json = new_value.to_json();
+    }
+}
+
+// Mirrors get_diff_object of diff.cpp
+bool get_diff_object(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+                     std::string &err_msg, const DiffOptions &options, std::string &path) {
+    if (old_value.size() == 0 && new_value.size() == 0) {
+        diff_json = DIFF_UNCHANGED;
+        return true;
+    }
+
+    Json::Value diff;
+    auto on_member = [&](const PersistentValue::Member *old_member, const PersistentValue::Member *new_member) {
+        if (new_member == nullptr) {
+            diff[old_member->first] = DIFF_DELETE;
+            return true;
+        }
+        if (old_member == nullptr) {
+            diff[new_member->first] = new_member->second.to_json();
+            return true;
+        }
+
+        Json::Value child_diff;
+        size_t path_length = push_path(options, path, old_member->first);
+        if (!get_diff_at(old_member->second, new_member->second, child_diff, err_msg, options, path)) {
+            return false;
+        }
+        path.resize(path_length);
+        add_member_diff(diff, old_member->first, child_diff, options);
+        return true;
+    };
+    if (!diff_members(PersistentBuilder::node_of(old_value), PersistentBuilder::node_of(new_value), on_member)) {
+        RET_ERROR(err_msg);
+    }
+
+    if (diff.isNull()) {
+        diff_json = DIFF_UNCHANGED;
+        return true;
+    }
+    diff[Json::StaticString("_t")] = Json::StaticString(diff_type_name(DiffType::PatchObject));
+    if (!merge_with_children(diff, err_msg, options)) {
+        RET_ERROR(err_msg);
+    }
+    replace_if_smaller(diff, new_value, options);
+    diff_json.swap(diff);
+    return true;
+}
+
+bool get_diff_array(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+                    std::string &err_msg, const DiffOptions &options, std::string &path) {
+    if (!get_array_key(options, path).empty()) {
+        // Records matched by key are diffed as Json::Value
+        char buffer[DIFF_ARENA_STACK_SIZE];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        HashCache old_hashes(&arena), new_hashes(&arena);
+        DiffOptions json_options = options;
+        json_options.old_hashes = &old_hashes;
+        json_options.new_hashes = &new_hashes;
+        return ::get_diff_at(old_value.to_json(), new_value.to_json(), diff_json, err_msg, json_options, path);
+    }
+
+    const std::vector<PersistentValue> &old_items = old_value.items(), &new_items = new_value.items();
+    std::vector<JsonHash> old_hashes(old_items.size()), new_hashes(new_items.size());
+    for (size_t i = 0; i < old_items.size(); i++) {
+        old_hashes[i] = old_items[i].hash();
+    }
+    for (size_t i = 0; i < new_items.size(); i++) {
+        new_hashes[i] = new_items[i].hash();
+    }
+
+    size_t path_length = push_path(options, path, "*");
+    auto diff_item = [&](int i, int j, Json::Value &item_diff) {
+        return get_diff_at(old_items[i], new_items[j], item_diff, err_msg, options, path);
+    };
+    auto new_item = [&](int j) { return new_items[j].to_json(); };
+    if (!diff_array_items(old_hashes, new_hashes, diff_json, err_msg, options, diff_item, new_item)) {
+        RET_ERROR(err_msg);
+    }
+    path.resize(path_length);
+    replace_if_smaller(diff_json, new_value, options);
+    return true;
+}
+
+bool get_diff_at(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+                 std::string &err_msg, const DiffOptions &options, std::string &path) {
+    if (old_value.shares(new_value)) {
+        diff_json = DIFF_UNCHANGED;
+        return true;
+    }
+    if (old_value.type() != new_value.type()) {
+        diff_json = new_value.to_json();
+        return true;
+    }
+    switch (old_value.type()) {
+        case Json::ValueType::objectValue:
+        case Json::ValueType::arrayValue:
+            if (old_value.hash() == new_value.hash()) {
+                diff_json = DIFF_UNCHANGED;
+                return true;
+            }
+            return old_value.type() == Json::ValueType::objectValue
+                       ? get_diff_object(old_value, new_value, diff_json, err_msg, options, path)
+                       : get_diff_array(old_value, new_value, diff_json, err_msg, options, path);
+        default:
+            return ::get_diff_at(old_value.leaf(), new_value.leaf(), diff_json, err_msg, options, path);
+    }
+}
+
+}  // namespace
+
+bool apply_diff(const PersistentValue &old_value, const Json::Value &diff, PersistentValue &new_value,
+                std::string &err_msg) {
+    DiffNode node;
+    PersistentValue result;
+    if (!parse_diff_node(diff, node, err_msg) || !apply_node(old_value, node, result, err_msg)) {
+        RET_ERROR(err_msg);
+    }
+    new_value = std::move(result);
+    return true;
+}
+
+bool get_diff(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+              std::string &err_msg, const DiffOptions &options) {
+    std::string path;
+    return get_diff_at(old_value, new_value, diff_json, err_msg, options, path);
+}
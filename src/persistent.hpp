@@ -0,0 +1,72 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_PERSISTENT_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_PERSISTENT_HPP_
+
+#include <json/json.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "diff.hpp"
+
+/**
+ * Immutable json document whose versions share their unchanged subtrees.
+ *
+ * Nodes are refcounted and never modified, so copies are O(1) snapshots that can
+ * be handed to other threads. apply_diff() makes a new version by copying only the
+ * nodes on the paths the diff changes, and get_diff() skips the subtrees both
+ * versions share. Large objects are tries by the hashes of their member names, so
+ * changing a member copies a bucket of a few dozen members instead of all of them.
+ * Arrays are vectors of shared items.
+ *
+ * Every node carries its structural hash. The shape of a document only depends on
+ * its contents, so equal documents have equal hashes however they were made.
+ */
+class PersistentValue {
+   public:
+    typedef std::pair<std::string, PersistentValue> Member;
+
+    // null
+    PersistentValue();
+    explicit PersistentValue(const Json::Value &val);
+
+    Json::Value to_json() const;
+
+    Json::ValueType type() const;
+    JsonHash hash() const;
+    // Number of members or items, 0 for other values
+    size_t size() const;
+    // Bytes of the value in encoding, the same as encoded_size() of diff_impl.hpp for the value as Json::Value
+    size_t encoded_size(DiffEncoding encoding) const;
+    // Member of an object, nullptr if there is none
+    const PersistentValue *find(std::string_view name) const;
+    // Calls fn for every member of an object, not in the order of their names
+    void for_each_member(const std::function<void(const std::string &, const PersistentValue &)> &fn) const;
+    // Items, empty if not an array
+    const std::vector<PersistentValue> &items() const;
+    // Null, bool, number or string value, null for objects and arrays
+    const Json::Value &leaf() const;
+
+    // True if both are the same version of the same subtree
+    bool shares(const PersistentValue &other) const { return node == other.node; }
+
+   private:
+    struct Node;
+    std::shared_ptr<const Node> node;
+
+    explicit PersistentValue(std::shared_ptr<const Node> node) : node(std::move(node)) {}
+    friend class PersistentBuilder;
+};
+
+// Values of diff are copied, so unlike apply_diff(Json::Value &, ...) a diff can be applied more than once
+bool apply_diff(const PersistentValue &old_value, const Json::Value &diff, PersistentValue &new_value,
+                std::string &err_msg);
+
+// Same diff as get_diff of the two documents as Json::Value, the hash caches and the pool of options are not used
+bool get_diff(const PersistentValue &old_value, const PersistentValue &new_value, Json::Value &diff_json,
+              std::string &err_msg, const DiffOptions &options = DiffOptions{});
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_PERSISTENT_HPP_
@@ -1,9 +1,16 @@
 
 #include "statevar.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <memory>
 
+#include "diff_impl.hpp"
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
 // const std::string SELF = "_";
 
 Json::FastWriter writer;
@@ -30,8 +37,24 @@ std::string StateDiff::to_string() {
     return std::move(writer.write(ret_json));
 }
 
+bool StateDiff::from_binary(const std::string& s, KeyDictionary& keys, StateDiff& diff, std::string& err_msg) {
+    if (!decode_binary_diff(s.data(), s.size(), keys, diff.diff, diff.time, err_msg)) {
+        std::cout << "Binary diff decoding error : " << err_msg << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string StateDiff::to_binary(KeyDictionary& keys) {
+    std::string data, err_msg;
+    encode_binary_diff(diff, time, keys, data, err_msg);
+    return data;
+}
+
 StateVar::StateVar() {
     this->state = std::make_shared<StateValue>(StateValue{Json::nullValue, 0});
+    this->synced_state = state;
+    this->empty_state = std::make_shared<StateValue>(StateValue{Json::nullValue, 0});
 }
 
 void StateVar::add_transport(std::shared_ptr<StateTransport> transport) {
@@ -41,21 +64,30 @@ void StateVar::add_transport(std::shared_ptr<StateTransport> transport) {
 }
 
 void StateVar::diff_received(const std::string& peer_id, StateDiff& diff) {
-    if (peer_states.find(peer_id) == peer_states.end()) {
-        peer_states[peer_id] = std::make_shared<StateValue>();
-    }
-    if (diff.time <= peer_states[peer_id]->time)
+    auto& peer_state = peer_states.emplace(peer_id, empty_state).first->second;
+    if (diff.time <= peer_state->time)
         return;
+
+    // Synced states are shared with state, other peers and listeners, so they are copied before patching
+    if (peer_state.use_count() > 1) {
+        auto copy = std::make_shared<StateValue>(StateValue{peer_state->value, peer_state->time});
+        peer_state->hashes.copy_to(peer_state->value, copy->value, copy->hashes);
+        peer_state = copy;
+    }
+
     std::cout << "Applying diff to " << peer_id << std::endl;
     std::string err_msg;
-    if (!apply_diff(peer_states[peer_id]->value, diff.diff, err_msg)) {
+    if (!apply_diff(peer_state->value, diff.diff, err_msg, peer_state->hashes)) {
         std::cout << "Error when applying diff: " << err_msg << std::endl;
-        std::cout << "old_state: " << peer_states[peer_id]->value << std::endl;
+        std::cout << "old_state: " << peer_state->value << std::endl;
         std::cout << "Diff: " << diff.diff << std::endl;
+        peer_state->hashes.clear();
     }
-    peer_states[peer_id]->time = diff.time;
+    peer_state->time = diff.time;
 
-    state = std::make_shared<StateValue>(StateValue{peer_states[peer_id]->value, peer_states[peer_id]->time});
+    state = peer_state;
+    synced_state = nullptr;
+    pending_diffs.clear();
 
     for (auto& listener : on_update_listeners) {
         listener.second(state);
@@ -69,43 +101,202 @@ CallbackId StateVar::on_update(OnUpdateCallback callback) {
 
 void StateVar::update(std::shared_ptr<StateValue> new_value) {
     state = new_value;
+    synced_state = nullptr;
+    pending_diffs.clear();
+}
+
+// Finds the value at path in root. parent is null for the root, target is null for a member that does not exist.
+bool find_path(const Json::Value& root, const std::string& path, const Json::Value*& parent,
+               const Json::Value*& target, std::string& err_msg) {
+    parent = nullptr;
+    target = &root;
+    if (path.empty()) return true;
+    std::vector<PathSegment> segments;
+    split_diff_path(path, segments);
+    for (size_t i = 0; i < segments.size(); i++) {
+        const PathSegment& segment = segments[i];
+        parent = target;
+        if (parent->isObject()) {
+            target = parent->find(segment.name.data(), segment.name.data() + segment.name.size());
+            if (target == nullptr && i + 1 < segments.size()) {
+                RET_ERROR("Path to non-existent object : " + std::string(segment.name));
+            }
+        } else if (parent->isArray()) {
+            if (!segment.is_index || !parent->isValidIndex(segment.start)) {
+                RET_ERROR("Array index does not exist : " + std::string(segment.name));
+            }
+            target = &(*parent)[segment.start];
+        } else {
+            RET_ERROR("Cannot go inside non object : " + std::string(segment.name));
+        }
+    }
+    return true;
+}
+
+// Diff that applies leaf to the value at path, members are patched with a 'P' diff and array items with an 'A' diff
+Json::Value diff_at_path(const std::string& path, const Json::Value* parent, Json::Value leaf) {
+    if (parent == nullptr) return leaf;
+    Json::Value diff = make_diff_json(parent->isArray() ? DiffType::PatchArray : DiffType::PatchObject);
+    diff[path].swap(leaf);
+    return diff;
+}
+
+void StateVar::own_state() {
+    if (state.use_count() == 1) return;
+    auto copy = std::make_shared<StateValue>(StateValue{state->value, state->time});
+    state->hashes.copy_to(state->value, copy->value, copy->hashes);
+    state = copy;
+}
+
+bool StateVar::mutate(Json::Value diff, std::string& err_msg) {
+    own_state();
+    Json::Value applied_diff = diff;
+    if (!apply_diff(state->value, applied_diff, err_msg, state->hashes)) {
+        // Paths are checked before, so this is not expected. state may be partially patched, peers get a full diff.
+        state->hashes.clear();
+        synced_state = nullptr;
+        pending_diffs.clear();
+        return false;
+    }
+    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+    state->time = std::max(state->time + 1, now);
+    if (synced_state != nullptr) {
+        pending_diffs.push_back(std::move(diff));
+    }
+    return true;
+}
+
+bool StateVar::set(const std::string& path, const Json::Value& value, std::string& err_msg) {
+    const Json::Value *parent, *target;
+    if (!find_path(state->value, path, parent, target, err_msg)) return false;
+    return mutate(diff_at_path(path, parent, value), err_msg);
+}
+
+bool StateVar::erase(const std::string& path, std::string& err_msg) {
+    const Json::Value *parent, *target;
+    if (!find_path(state->value, path, parent, target, err_msg)) return false;
+    if (parent == nullptr) {
+        RET_ERROR("Cannot erase the whole document");
+    }
+    if (target == nullptr) {
+        RET_ERROR("No member at path : " + path);
+    }
+    if (parent->isObject()) {
+        return mutate(diff_at_path(path, parent, DIFF_DELETE), err_msg);
+    }
+    // An array item is removed by splicing its range out of the array
+    size_t name_start = path.rfind('/') + 1;
+    int index = std::stoi(path.substr(name_start));
+    Json::Value diff = make_diff_json(DiffType::PatchArray);
+    diff[path.substr(0, name_start) + std::to_string(index) + ":" + std::to_string(index + 1)] = Json::arrayValue;
+    return mutate(std::move(diff), err_msg);
+}
+
+bool StateVar::append(const std::string& path, const Json::Value& item, std::string& err_msg) {
+    const Json::Value *parent, *target;
+    if (!find_path(state->value, path, parent, target, err_msg)) return false;
+    if (target == nullptr || !target->isArray()) {
+        RET_ERROR("Cannot append to non array : " + path);
+    }
+    Json::Value append_diff = make_diff_json(DiffType::AppendArray);
+    append_diff["v"].append(item);
+    return mutate(diff_at_path(path, parent, std::move(append_diff)), err_msg);
+}
+
+bool StateVar::merge(const std::string& path, const Json::Value& members, std::string& err_msg) {
+    const Json::Value *parent, *target;
+    if (!find_path(state->value, path, parent, target, err_msg)) return false;
+    if (target == nullptr || !target->isObject() || !members.isObject()) {
+        RET_ERROR("Cannot merge non object : " + path);
+    }
+    if (members.empty()) return true;
+    // Paths of 'P' diffs run through arrays too, so the members are set from the root whatever path is in
+    std::string prefix = path.empty() ? "" : path + "/";
+    Json::Value diff = make_diff_json(DiffType::PatchObject);
+    for (Json::Value::const_iterator it = members.begin(); it != members.end(); ++it) {
+        diff[prefix + it.name()] = *it;
+    }
+    return mutate(std::move(diff), err_msg);
+}
+
+void StateVar::set_diff_options(const DiffOptions& options) {
+    diff_options = options;
+    diff_options.old_hashes = nullptr;
+    diff_options.new_hashes = nullptr;
 }
 
 void StateVar::sync() {
     // Syncs state to peer_states, will not update state
     std::string err_msg;
-    int num_synced = 0;
+    DiffOptions options = diff_options;
 
+    // The mutations since the last sync, squashed once for all peers that have the state of the last sync
+    Json::Value mutations_diff;
+    bool have_mutations_diff = false;
+    if (synced_state != nullptr && !pending_diffs.empty()) {
+        std::vector<const Json::Value*> diffs;
+        for (auto& diff : pending_diffs) {
+            diffs.push_back(&diff);
+        }
+        have_mutations_diff = compose_diff(diffs, mutations_diff, err_msg);
+        err_msg.clear();
+    }
+
+    // Peers are grouped by the snapshot they have, every group is sent one diff computed once for all transports
+    std::map<std::shared_ptr<StateValue>, StateDiff> diffs;
+    std::set<std::string> listed_peers;
     for (auto& transport : transports) {
+        std::map<std::shared_ptr<StateValue>, std::vector<std::string>> groups;
         for (auto& peer_id : transport->get_peers()) {
-            if (peer_states.find(peer_id) == peer_states.end()) {
-                peer_states[peer_id] = std::make_shared<StateValue>();
-            }
-            auto& peer_state = peer_states[peer_id];
+            listed_peers.insert(peer_id);
+            auto& peer_state = peer_states.emplace(peer_id, empty_state).first->second;
             if (peer_state->time >= state->time)
                 continue;
+            groups[peer_state].push_back(peer_id);
+        }
 
-            StateDiff diff;
-            diff.time = state->time;
-
-            if (!get_diff(peer_state->value, state->value, diff.diff, err_msg)) {
-                std::cout << "Error when diffing : " << err_msg << std::endl;
-                std::cout << "Old state : " << peer_state->value << std::endl;
-                std::cout << "New state : " << state->value << std::endl;
-                err_msg.clear();
-                continue;
+        for (auto& group : groups) {
+            const std::shared_ptr<StateValue>& base = group.first;
+            auto found = diffs.find(base);
+            if (found == diffs.end()) {
+                StateDiff diff;
+                diff.time = state->time;
+                if (have_mutations_diff && base == synced_state) {
+                    diff.diff = mutations_diff;
+                } else {
+                    options.old_hashes = &base->hashes;
+                    options.new_hashes = &state->hashes;
+                    if (!get_diff(base->value, state->value, diff.diff, err_msg, options)) {
+                        std::cout << "Error when diffing : " << err_msg << std::endl;
+                        std::cout << "Old state : " << base->value << std::endl;
+                        std::cout << "New state : " << state->value << std::endl;
+                        err_msg.clear();
+                        continue;
+                    }
+                }
+                found = diffs.emplace(base, std::move(diff)).first;
             }
 
-            transport->send_diff(peer_id, diff);
+            transport->broadcast_diff(group.second, found->second);
 
-            peer_states[peer_id] = state;
-            num_synced++;
+            for (auto& peer_id : group.second) {
+                peer_states[peer_id] = state;
+            }
         }
     }
 
-    if (num_synced > 0) {
-        state = std::make_shared<StateValue>(StateValue{state->value, state->time});
+    // Peers that left no longer hold on to their snapshots
+    for (auto it = peer_states.begin(); it != peer_states.end();) {
+        if (listed_peers.count(it->first) == 0) {
+            it = peer_states.erase(it);
+        } else {
+            ++it;
+        }
     }
+    synced_state = state;
+    pending_diffs.clear();
 }
 
 CallbackId StateTransport::add_listener(OnDiffReceiveCallback callback) {
@@ -116,3 +307,11 @@ CallbackId StateTransport::add_listener(OnDiffReceiveCallback callback) {
 void StateTransport::remove_listener(CallbackId id) {
     listeners.erase(id);
 }
+
+bool StateTransport::broadcast_diff(const std::vector<std::string>& peer_ids, StateDiff& diff) {
+    bool ok = true;
+    for (auto& peer_id : peer_ids) {
+        ok = send_diff(peer_id, diff) && ok;
+    }
+    return ok;
+}
@@ -6,12 +6,17 @@
 #include <functional>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "diff.hpp"
+#include "wireformat.hpp"
 
 struct StateValue {
     Json::Value value;
     uint64_t time;
+    // Subtree hashes of value, must be cleared if value is modified in place
+    HashCache hashes;
 };
 
 struct StateDiff {
@@ -21,6 +26,9 @@ struct StateDiff {
    public:
     static bool from_string(std::string& s, StateDiff& diff, std::string& err_msg);
     std::string to_string();
+    // Binary encoding, keys is the dictionary of the direction the diff is sent / received on
+    static bool from_binary(const std::string& s, KeyDictionary& keys, StateDiff& diff, std::string& err_msg);
+    std::string to_binary(KeyDictionary& keys);
 };
 
 typedef std::function<void(std::shared_ptr<StateValue> state)> OnUpdateCallback;
@@ -34,13 +42,17 @@ class StateTransport {
 
     virtual std::vector<std::string> get_peers() = 0;
     virtual bool send_diff(const std::string& peer_id, StateDiff& diff) = 0;
+    // Sends the same diff to several peers, transports that can serialize it once for all of them override this
+    virtual bool broadcast_diff(const std::vector<std::string>& peer_ids, StateDiff& diff);
     CallbackId add_listener(OnDiffReceiveCallback callback);
     void remove_listener(CallbackId id);
 };
 
 class StateVar : public std::enable_shared_from_this<StateVar> {
    private:
+    // Snapshot each peer has, peers at the same version share it. New peers start at empty_state.
     std::map<std::string, std::shared_ptr<StateValue>> peer_states;
+    std::shared_ptr<StateValue> empty_state;
     std::shared_ptr<StateValue> state;
     std::set<std::shared_ptr<StateTransport>> transports;
     void diff_received(const std::string& peer_id, StateDiff& diff);
@@ -48,12 +60,41 @@ class StateVar : public std::enable_shared_from_this<StateVar> {
     std::map<CallbackId, OnUpdateCallback> on_update_listeners;
     CallbackId last_callback_id;
 
+    // Used when diffing state against the peer states, the hash caches are set per peer
+    DiffOptions diff_options;
+
+    // Diffs of the mutations since the last sync, in order. They lead from synced_state to state, so peers that
+    // have synced_state are sent them instead of a diff of the documents. synced_state is null from update()
+    // until the next sync.
+    std::vector<Json::Value> pending_diffs;
+    std::shared_ptr<StateValue> synced_state;
+
+    // Copies state first if it is shared with peer states or listeners
+    void own_state();
+    // Applies the diff of a mutation to state and records it for the next sync
+    bool mutate(Json::Value diff, std::string& err_msg);
+
    public:
     StateVar();
     void add_transport(std::shared_ptr<StateTransport> transport);
+    // new_value is shared with the peer states once synced and must not be modified afterwards
     void update(std::shared_ptr<StateValue> new_value);
+
+    // Mutations of state at a '/' separated path such as "jobs/3/status", "" being the whole document. Parents
+    // must exist, array items are addressed by index. Each mutation is a small diff applied to state and kept
+    // for sync(), which then does not need to diff the documents to find the changes.
+    bool set(const std::string& path, const Json::Value& value, std::string& err_msg);
+    // Removes a member of an object or an item of an array
+    bool erase(const std::string& path, std::string& err_msg);
+    // Appends item to the array at path
+    bool append(const std::string& path, const Json::Value& item, std::string& err_msg);
+    // Sets the members of members on the object at path, other members are kept
+    bool merge(const std::string& path, const Json::Value& members, std::string& err_msg);
+    std::shared_ptr<const StateValue> get_state() const { return state; }
+
     void sync();
     CallbackId on_update(OnUpdateCallback callback);
+    void set_diff_options(const DiffOptions& options);
 };
 
 #endif  // __PROJECTS_SYNCLIBCPP_SRC_STATEVAR_HPP_
\ No newline at end of file
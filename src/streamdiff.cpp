@@ -0,0 +1,561 @@
+#include <cstdlib>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "diff.hpp"
+#include "diff_impl.hpp"
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
+// Nesting depth at which documents are rejected, the same as Json::Reader's
+#define STREAM_DIFF_MAX_DEPTH 1000
+
+namespace {
+
+/**
+ * Pull parser over serialized json. Values are read one at a time: skipped, parsed into a Json::Value,
+ * or entered member by member or item by item. Numbers and strings are decoded like Json::Reader does.
+ */
+class JsonStreamReader {
+   public:
+    explicit JsonStreamReader(std::istream &in) : buf(in.rdbuf()) {}
+
+    // Next character that is not whitespace, without consuming it. EOF at the end.
+    int peek() {
+        while (true) {
+            int c = get_char(false);
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return c;
+            get_char(true);
+        }
+    }
+
+    bool expect(char expected, std::string &err_msg) {
+        if (peek() != expected) {
+            return fail(std::string("Expected '") + expected + "'", err_msg);
+        }
+        get_char(true);
+        return true;
+    }
+
+    // Moves to the next member of an object entered with expect('{'), done is set at its end
+    bool next_member(bool first, std::string &name, bool &done, std::string &err_msg) {
+        done = peek() == '}';
+        if (done) {
+            get_char(true);
+            return true;
+        }
+        if (!first && !expect(',', err_msg)) return false;
+        if (peek() != '"') return fail("Expected a member name", err_msg);
+        name.clear();
+        return read_string(name, err_msg) && expect(':', err_msg);
+    }
+
+    // Moves to the next item of an array entered with expect('['), done is set at its end
+    bool next_item(bool first, bool &done, std::string &err_msg) {
+        done = peek() == ']';
+        if (done) {
+            get_char(true);
+            return true;
+        }
+        return first || expect(',', err_msg);
+    }
+
+    bool read_value(Json::Value &val, std::string &err_msg, int depth = 0) {
+        if (depth > STREAM_DIFF_MAX_DEPTH) return fail("Document nested too deep", err_msg);
+        bool done;
+        switch (peek()) {
+            case '{': {
+                get_char(true);
+                val = Json::objectValue;
+                std::string name;
+                for (bool first = true;; first = false) {
+                    if (!next_member(first, name, done, err_msg)) return false;
+                    if (done) return true;
+                    if (!read_value(val[name], err_msg, depth + 1)) return false;
+                }
+            }
+            case '[': {
+                get_char(true);
+                val = Json::arrayValue;
+                for (bool first = true;; first = false) {
+                    if (!next_item(first, done, err_msg)) return false;
+                    if (done) return true;
+                    if (!read_value(val.append(Json::Value()), err_msg, depth + 1)) return false;
+                }
+            }
+            case '"': {
+                std::string str;
+                if (!read_string(str, err_msg)) return false;
+                val = str;
+                return true;
+            }
+            case 't':
+                val = true;
+                return read_literal("true", err_msg);
+            case 'f':
+                val = false;
+                return read_literal("false", err_msg);
+            case 'n':
+                val = Json::Value();
+                return read_literal("null", err_msg);
+            default:
+                return read_number(val, err_msg);
+        }
+    }
+
+    // Reads past a value without keeping it
+    bool skip_value(std::string &err_msg, int depth = 0) {
+        if (depth > STREAM_DIFF_MAX_DEPTH) return fail("Document nested too deep", err_msg);
+        int c = peek();
+        bool done;
+        if (c == '{') {
+            get_char(true);
+            for (bool first = true;; first = false) {
+                if (!next_member(first, scratch, done, err_msg)) return false;
+                if (done) return true;
+                if (!skip_value(err_msg, depth + 1)) return false;
+            }
+        }
+        if (c == '[') {
+            get_char(true);
+            for (bool first = true;; first = false) {
+                if (!next_item(first, done, err_msg)) return false;
+                if (done) return true;
+                if (!skip_value(err_msg, depth + 1)) return false;
+            }
+        }
+        if (c == '"') {
+            scratch.clear();
+            return read_string(scratch, err_msg);
+        }
+        Json::Value leaf;
+        return read_value(leaf, err_msg, depth);
+    }
+
+    // True if only whitespace is left
+    bool at_end() { return peek() == EOF; }
+
+   private:
+    std::streambuf *buf;
+    size_t offset = 0;
+    // Names and strings that are skipped
+    std::string scratch;
+
+    int get_char(bool consume) {
+        if (buf == nullptr) return EOF;
+        if (!consume) return buf->sgetc();
+        offset++;
+        return buf->sbumpc();
+    }
+
+    bool fail(const std::string &what, std::string &err_msg) {
+        RET_ERROR(what + " at offset " + std::to_string(offset));
+    }
+
+    bool read_literal(const char *literal, std::string &err_msg) {
+        for (const char *c = literal; *c != '\0'; c++) {
+            if (get_char(true) != *c) return fail(std::string("Expected '") + literal + "'", err_msg);
+        }
+        return true;
+    }
+
+    bool read_hex4(unsigned &value, std::string &err_msg) {
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            int c = get_char(true);
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                return fail("Bad unicode escape sequence", err_msg);
+            }
+        }
+        return true;
+    }
+
+    static void append_utf8(unsigned cp, std::string &str) {
+        if (cp <= 0x7f) {
+            str += static_cast<char>(cp);
+        } else if (cp <= 0x7ff) {
+            str += static_cast<char>(0xc0 | (cp >> 6));
+            str += static_cast<char>(0x80 | (cp & 0x3f));
+        } else if (cp <= 0xffff) {
+            str += static_cast<char>(0xe0 | (cp >> 12));
+            str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            str += static_cast<char>(0x80 | (cp & 0x3f));
+        } else {
+            str += static_cast<char>(0xf0 | (cp >> 18));
+            str += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+            str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            str += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    // Appends the decoded string at the reader to str
+    bool read_string(std::string &str, std::string &err_msg) {
+        get_char(true);
+        while (true) {
+            int c = get_char(true);
+            if (c == EOF) return fail("Missing '\"' at the end of a string", err_msg);
+            if (c == '"') return true;
+            if (c != '\\') {
+                str += static_cast<char>(c);
+                continue;
+            }
+            c = get_char(true);
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    str += static_cast<char>(c);
+                    break;
+                case 'b':
+                    str += '\b';
+                    break;
+                case 'f':
+                    str += '\f';
+                    break;
+                case 'n':
+                    str += '\n';
+                    break;
+                case 'r':
+                    str += '\r';
+                    break;
+                case 't':
+                    str += '\t';
+                    break;
+                case 'u': {
+                    unsigned cp;
+                    if (!read_hex4(cp, err_msg)) return false;
+                    if (cp >= 0xd800 && cp <= 0xdbff) {
+                        // Surrogate pair
+                        unsigned low;
+                        if (get_char(true) != '\\' || get_char(true) != 'u' || !read_hex4(low, err_msg)) {
+                            return fail("Expected the second half of a surrogate pair", err_msg);
+                        }
+                        cp = 0x10000 + ((cp & 0x3ff) << 10) + (low & 0x3ff);
+                    }
+                    append_utf8(cp, str);
+                    break;
+                }
+                default:
+                    return fail("Bad escape sequence in string", err_msg);
+            }
+        }
+    }
+
+    // Integers that fit are int or uint values as with Json::Reader, the rest are doubles
+    bool read_number(Json::Value &val, std::string &err_msg) {
+        scratch.clear();
+        while (true) {
+            int c = get_char(false);
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+                scratch += static_cast<char>(get_char(true));
+            } else {
+                break;
+            }
+        }
+        if (scratch.empty() || scratch == "-") return fail("Syntax error, value expected", err_msg);
+
+        const bool negative = scratch[0] == '-';
+        const Json::LargestUInt max_value =
+            negative ? Json::LargestUInt(Json::Value::maxLargestInt) + 1 : Json::Value::maxLargestUInt;
+        Json::LargestUInt value = 0;
+        bool integral = true;
+        for (size_t i = negative ? 1 : 0; i < scratch.size() && integral; i++) {
+            char c = scratch[i];
+            unsigned digit = c - '0';
+            if (c < '0' || c > '9' || value > (max_value - digit) / 10) {
+                integral = false;
+            } else {
+                value = value * 10 + digit;
+            }
+        }
+        if (integral) {
+            if (negative && value == max_value) {
+                val = Json::Value::minLargestInt;
+            } else if (negative) {
+                val = -Json::LargestInt(value);
+            } else if (value <= Json::LargestUInt(Json::Value::maxInt)) {
+                val = Json::LargestInt(value);
+            } else {
+                val = value;
+            }
+            return true;
+        }
+
+        char *end;
+        double d = strtod(scratch.c_str(), &end);
+        if (end != scratch.c_str() + scratch.size()) return fail("'" + scratch + "' is not a number", err_msg);
+        val = d;
+        return true;
+    }
+};
+
+// Adds offset to the old indices of a 'P' array diff of the items from offset on
+void shift_array_diff(Json::Value &diff, int offset) {
+    Json::Value shifted = make_diff_json(DiffType::PatchArray);
+    std::vector<PathSegment> segments;
+    for (Json::Value::iterator it = diff.begin(); it != diff.end(); ++it) {
+        const char *end;
+        const char *begin = it.memberName(&end);
+        std::string_view key(begin, end - begin);
+        if (key == "_t") continue;
+        if (key == ">") {
+            // Order of the kept old items, which the items before offset lead
+            Json::Value &order = shifted[">"] = Json::arrayValue;
+            if (offset == 1) {
+                order.append(0);
+            } else if (offset > 1) {
+                Json::Value &run = order.append(Json::arrayValue);
+                run.append(0);
+                run.append(offset);
+            }
+            for (auto &entry : *it) {
+                if (entry.isArray()) {
+                    Json::Value &run = order.append(Json::arrayValue);
+                    run.append(entry[0].asInt() + offset);
+                    run.append(entry[1].asInt() + offset);
+                } else {
+                    order.append(entry.asInt() + offset);
+                }
+            }
+            continue;
+        }
+        split_diff_path(key, segments);
+        const PathSegment &first = segments[0];
+        std::string shifted_key = std::to_string(first.start + offset);
+        if (first.is_range) shifted_key += ":" + std::to_string(first.end + offset);
+        shifted_key.append(key.substr(first.name.size()));
+        shifted[shifted_key].swap(*it);
+    }
+    diff.swap(shifted);
+}
+
+/**
+ * Walks two serialized documents in lockstep. Objects are entered member by member, arrays are compared item by
+ * item until the first change and then buffered from there on, other values are parsed and diffed with get_diff.
+ */
+class StreamDiffer {
+   public:
+    StreamDiffer(std::istream &old_in, std::istream &new_in, const DiffEntryCallback &on_entry,
+                 const DiffOptions &options)
+        : old_reader(old_in), new_reader(new_in), on_entry(on_entry), hashed_options(options) {
+        hashed_options.old_hashes = &old_hashes;
+        hashed_options.new_hashes = &new_hashes;
+    }
+
+    bool diff(std::string &err_msg) {
+        if (!diff_values(err_msg, 0)) return false;
+        if (!old_reader.at_end() || !new_reader.at_end()) {
+            RET_ERROR("Extra characters after the document");
+        }
+        return true;
+    }
+
+   private:
+    JsonStreamReader old_reader, new_reader;
+    const DiffEntryCallback &on_entry;
+    // Hash caches for the values diffed with get_diff, cleared after every diff since the values are freed
+    HashCache old_hashes, new_hashes;
+    DiffOptions hashed_options;
+    // Diff path of the value at the readers, and the path array_keys are looked up by
+    std::string path, key_path;
+
+    bool diff_buffered(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                       std::string &err_msg) {
+        bool ok = get_diff_at(old_json, new_json, diff_json, err_msg, hashed_options, key_path);
+        old_hashes.clear();
+        new_hashes.clear();
+        return ok;
+    }
+
+    bool diff_values(std::string &err_msg, int depth) {
+        if (depth > STREAM_DIFF_MAX_DEPTH) {
+            RET_ERROR("Document nested too deep");
+        }
+        int old_c = old_reader.peek(), new_c = new_reader.peek();
+        if (old_c == '{' && new_c == '{') return diff_objects(err_msg, depth);
+        if (old_c == '[' && new_c == '[') return diff_arrays(err_msg);
+
+        Json::Value old_json, new_json, diff_json;
+        if (old_c == '{' || old_c == '[' || new_c == '{' || new_c == '[') {
+            // The type changed, so the new value is sent whatever the old one is
+            if (!old_reader.skip_value(err_msg) || !new_reader.read_value(new_json, err_msg)) return false;
+            on_entry(path, new_json);
+            return true;
+        }
+        if (!old_reader.read_value(old_json, err_msg) || !new_reader.read_value(new_json, err_msg)) return false;
+        // Most leaves are unchanged, those are not worth a get_diff call
+        if (old_json == new_json) return true;
+        if (!diff_buffered(old_json, new_json, diff_json, err_msg)) return false;
+        if (get_diff_type(diff_json) != DiffType::Unchanged) {
+            on_entry(path, diff_json);
+        }
+        return true;
+    }
+
+    bool diff_objects(std::string &err_msg, int depth) {
+        old_reader.expect('{', err_msg);
+        new_reader.expect('{', err_msg);
+        std::string old_name, new_name, prev_name;
+        bool old_done, new_done;
+        // Members are matched by position as long as both have the same names. After the first member that is
+        // only in one of them, they are matched by merging, which needs names in sorted order.
+        bool sorted = true, merging = false;
+        auto next_member = [&](JsonStreamReader &reader, std::string &name, bool &done) {
+            prev_name.swap(name);
+            if (!reader.next_member(false, name, done, err_msg)) return false;
+            if (!done && name <= prev_name) {
+                sorted = false;
+                if (merging) {
+                    RET_ERROR("Members of objects are not sorted, cannot match them in a stream");
+                }
+            }
+            return true;
+        };
+        if (!old_reader.next_member(true, old_name, old_done, err_msg) ||
+            !new_reader.next_member(true, new_name, new_done, err_msg)) {
+            return false;
+        }
+
+        while (!old_done || !new_done) {
+            int comp = old_done ? 1 : (new_done ? -1 : old_name.compare(new_name));
+            if (comp != 0) {
+                if (!sorted) {
+                    RET_ERROR("Members of objects are not sorted, cannot match them in a stream");
+                }
+                merging = true;
+            }
+            const std::string &name = comp <= 0 ? old_name : new_name;
+            size_t path_length = path.size();
+            if (depth > 0) path += '/';
+            path += name;
+            size_t key_path_length = push_path(hashed_options, key_path, name);
+
+            if (comp < 0) {
+                if (!old_reader.skip_value(err_msg)) return false;
+                Json::Value delete_diff = DIFF_DELETE;
+                on_entry(path, delete_diff);
+            } else if (comp > 0) {
+                Json::Value new_json;
+                if (!new_reader.read_value(new_json, err_msg)) return false;
+                on_entry(path, new_json);
+            } else if (!diff_values(err_msg, depth + 1)) {
+                return false;
+            }
+
+            path.resize(path_length);
+            key_path.resize(key_path_length);
+            // The name of the member just diffed is compared with the next one
+            if (comp <= 0 && !next_member(old_reader, old_name, old_done)) return false;
+            if (comp >= 0 && !next_member(new_reader, new_name, new_done)) return false;
+        }
+        return true;
+    }
+
+    bool diff_arrays(std::string &err_msg) {
+        old_reader.expect('[', err_msg);
+        new_reader.expect('[', err_msg);
+        bool old_done, new_done;
+        if (!old_reader.next_item(true, old_done, err_msg) || !new_reader.next_item(true, new_done, err_msg)) {
+            return false;
+        }
+
+        // Equal items at the start are dropped one by one
+        int offset = 0;
+        Json::Value old_rest = Json::arrayValue, new_rest = Json::arrayValue;
+        while (!old_done && !new_done) {
+            Json::Value old_item, new_item;
+            if (!old_reader.read_value(old_item, err_msg) || !new_reader.read_value(new_item, err_msg)) return false;
+            bool equal = old_item == new_item;
+            if (!equal) {
+                old_rest.append(Json::Value()).swap(old_item);
+                new_rest.append(Json::Value()).swap(new_item);
+            }
+            if (!old_reader.next_item(false, old_done, err_msg) || !new_reader.next_item(false, new_done, err_msg)) {
+                return false;
+            }
+            if (!equal) break;
+            offset++;
+        }
+        // From the first change on both are buffered
+        while (!old_done) {
+            if (!old_reader.read_value(old_rest.append(Json::Value()), err_msg) ||
+                !old_reader.next_item(false, old_done, err_msg)) {
+                return false;
+            }
+        }
+        while (!new_done) {
+            if (!new_reader.read_value(new_rest.append(Json::Value()), err_msg) ||
+                !new_reader.next_item(false, new_done, err_msg)) {
+                return false;
+            }
+        }
+        if (old_rest.empty() && new_rest.empty()) return true;
+
+        Json::Value diff_json;
+        if (old_rest.empty() && offset > 0) {
+            // Only items appended
+            diff_json = make_diff_json(DiffType::AppendArray);
+            diff_json["v"].swap(new_rest);
+        } else {
+            if (!diff_buffered(old_rest, new_rest, diff_json, err_msg)) return false;
+            DiffType diff_type = get_diff_type(diff_json);
+            if (diff_type == DiffType::Unchanged) return true;
+            if (offset > 0 && diff_type == DiffType::PatchArray) {
+                shift_array_diff(diff_json, offset);
+            } else if (offset > 0 && diff_type == DiffType::Replace) {
+                // The rest is replaced, as one splice since the items before it were not kept
+                Json::Value splice = make_diff_json(DiffType::PatchArray);
+                splice[std::to_string(offset) + ":" + std::to_string(offset + old_rest.size())].swap(diff_json);
+                diff_json.swap(splice);
+            }
+        }
+        on_entry(path, diff_json);
+        return true;
+    }
+};
+
+}  // namespace
+
+bool stream_diff(std::istream &old_in, std::istream &new_in, const DiffEntryCallback &on_entry,
+                 std::string &err_msg, const DiffOptions &options) {
+    StreamDiffer differ(old_in, new_in, on_entry, options);
+    return differ.diff(err_msg);
+}
+
+bool stream_diff(std::istream &old_in, std::istream &new_in, Json::Value &diff_json, std::string &err_msg,
+                 const DiffOptions &options) {
+    // Entries have paths when both documents are objects, otherwise the only entry is the whole diff
+    old_in >> std::ws;
+    new_in >> std::ws;
+    const bool patch = old_in.peek() == '{' && new_in.peek() == '{';
+    Json::Value diff = DIFF_UNCHANGED;
+    if (patch) {
+        diff = make_diff_json(DiffType::PatchObject);
+    }
+    auto add_entry = [&](const std::string &path, Json::Value &entry) {
+        if (patch) {
+            diff[path].swap(entry);
+        } else {
+            diff.swap(entry);
+        }
+    };
+    if (!stream_diff(old_in, new_in, add_entry, err_msg, options)) {
+        return false;
+    }
+    if (patch && diff.size() == 1) {
+        diff = DIFF_UNCHANGED;
+    }
+    diff_json.swap(diff);
+    return true;
+}
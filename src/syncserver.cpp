@@ -2,6 +2,7 @@
 #include <boost/asio/dispatch.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <cstdlib>
 #include <functional>
@@ -13,6 +14,7 @@
 #include <set>
 #include "diff.hpp"
 #include "statevar.hpp"
+#include "wireformat.hpp"
 
 namespace beast = boost::beast;          // from <boost/beast.hpp>
 namespace http = beast::http;            // from <boost/beast/http.hpp>
@@ -20,6 +22,10 @@ namespace websocket = beast::websocket;  // from <boost/beast/websocket.hpp>
 namespace net = boost::asio;             // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
 
+// WebSocket subprotocols, clients offering the binary one get binary diff frames
+#define SUBPROTOCOL_BINARY "synclib.bin.v1"
+#define SUBPROTOCOL_JSON "synclib.json"
+
 //------------------------------------------------------------------------------
 
 // Report a failure
@@ -34,37 +40,44 @@ class Session : public std::enable_shared_from_this<Session> {
     std::string session_id;
     bool is_closed_ = false;
     OnDiffReceiveCallback callback;
+    http::request<http::string_body> upgrade_req_;
+
+    // Negotiated on accept, json text unless the client offered the binary subprotocol
+    bool binary_ = false;
+    // Interned keys of the diffs sent / received, mirrored by the client. The send dictionary is shared with the
+    // sessions that were sent the same frames, so that they share the encoding of the next one too.
+    SharedKeyDictionary send_keys_;
+    KeyDictionary recv_keys_;
 
    public:
     // Take ownership of the socket
-    explicit Session(tcp::socket&& socket, std::string session_id, OnDiffReceiveCallback callback)
-        : ws_(std::move(socket)), session_id(session_id), callback(callback) {}
+    explicit Session(tcp::socket&& socket, std::string session_id, OnDiffReceiveCallback callback,
+                     SharedKeyDictionary send_keys)
+        : ws_(std::move(socket)), session_id(session_id), callback(callback), send_keys_(std::move(send_keys)) {}
 
     bool is_closed() { return is_closed_; }
-
-    bool send_diff(StateDiff& diff) {
-        // Get encoded data
-        std::string data = diff.to_string();
-
-        // Write to buffer
-        buffer_.consume(buffer_.size());
-        memcpy(buffer_.prepare(data.size()).data(), data.data(), data.size());
-        buffer_.commit(data.size());
-
-        // Send
-        ws_.async_write(buffer_.data(), beast::bind_front_handler(&Session::on_write, shared_from_this()));
-
+    bool is_binary() { return binary_; }
+    SharedKeyDictionary& send_keys() { return send_keys_; }
+
+    // Sends an encoded diff, frames are shared by the sessions they are sent to and kept alive until written
+    bool send_frame(std::shared_ptr<const std::string> frame) {
+        ws_.binary(binary_);
+        net::const_buffer data = net::buffer(*frame);
+        ws_.async_write(data, [self = shared_from_this(), frame = std::move(frame)](beast::error_code ec,
+                                                                                   std::size_t bytes_transferred) {
+            self->on_write(ec, bytes_transferred);
+        });
         return true;
     }
 
     void on_write(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
-        if (ec)
+        if (ec) {
+            // The peer missed this frame, its key dictionary is behind ours from now on
+            is_closed_ = true;
             return fail(ec, "write");
-
-        // Clear the buffer
-        buffer_.consume(buffer_.size());
+        }
     }
 
     // Get on the correct executor
@@ -81,12 +94,52 @@ class Session : public std::enable_shared_from_this<Session> {
         // Set suggested timeout settings for the websocket
         ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
 
+        // Read the upgrade request first to see which subprotocols the client offers
+        http::async_read(ws_.next_layer(), buffer_, upgrade_req_,
+                         beast::bind_front_handler(&Session::on_upgrade_request, shared_from_this()));
+    }
+
+    void on_upgrade_request(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        if (ec)
+            return fail(ec, "upgrade request");
+
+        std::string protocol;
+        for (auto offered : split_protocols(upgrade_req_[http::field::sec_websocket_protocol])) {
+            if (offered == SUBPROTOCOL_BINARY) {
+                binary_ = true;
+                protocol = SUBPROTOCOL_BINARY;
+                break;
+            }
+            if (offered == SUBPROTOCOL_JSON) {
+                protocol = SUBPROTOCOL_JSON;
+            }
+        }
+
         // Set a decorator to change the Server of the handshake
-        ws_.set_option(websocket::stream_base::decorator([](websocket::response_type& res) {
+        ws_.set_option(websocket::stream_base::decorator([protocol](websocket::response_type& res) {
             res.set(http::field::server, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-server-async");
+            if (!protocol.empty())
+                res.set(http::field::sec_websocket_protocol, protocol);
         }));
         // Accept the websocket handshake
-        ws_.async_accept(beast::bind_front_handler(&Session::on_accept, shared_from_this()));
+        ws_.async_accept(upgrade_req_, beast::bind_front_handler(&Session::on_accept, shared_from_this()));
+    }
+
+    static std::vector<std::string> split_protocols(beast::string_view header) {
+        std::vector<std::string> protocols;
+        size_t start = 0;
+        while (start <= header.size()) {
+            size_t end = std::min(header.find(',', start), header.size());
+            beast::string_view token = header.substr(start, end - start);
+            while (!token.empty() && token.front() == ' ') token.remove_prefix(1);
+            while (!token.empty() && token.back() == ' ') token.remove_suffix(1);
+            if (!token.empty())
+                protocols.emplace_back(token);
+            start = end + 1;
+        }
+        return protocols;
     }
 
     void on_accept(beast::error_code ec) {
@@ -115,18 +168,37 @@ class Session : public std::enable_shared_from_this<Session> {
         if (ec)
             return fail(ec, "read");
 
-        // Echo the message
-        ws_.text(ws_.got_text());
         StateDiff diff;
         std::string err_msg;
         std::string message = beast::buffers_to_string(buffer_.data());
-        std::cout << "Received message: " << message << std::endl;
 
-        StateDiff::from_string(message, diff, err_msg);
+        // Each frame says how it is encoded, so a binary session still accepts json text
+        bool ok;
+        if (ws_.got_binary()) {
+            std::cout << "Received binary message: " << message.size() << " bytes" << std::endl;
+            ok = StateDiff::from_binary(message, recv_keys_, diff, err_msg);
+        } else {
+            std::cout << "Received message: " << message << std::endl;
+            ok = StateDiff::from_string(message, diff, err_msg);
+        }
+
+        if (!ok && recv_keys_.is_broken()) {
+            // Keys of later frames cannot be resolved, the client has to reconnect with a new dictionary
+            is_closed_ = true;
+            ws_.async_close(websocket::close_code::protocol_error,
+                            beast::bind_front_handler(&Session::on_close, shared_from_this()));
+            return;
+        }
 
-        callback(session_id, diff);
+        if (ok)
+            callback(session_id, diff);
         do_read();
     }
+
+    void on_close(beast::error_code ec) {
+        if (ec)
+            return fail(ec, "close");
+    }
 };
 
 //------------------------------------------------------------------------------
@@ -141,24 +213,57 @@ class WsStateServer : public std::enable_shared_from_this<WsStateServer>, public
     uint32_t session_counter;
     std::map<std::string, std::shared_ptr<Session>> peers;
     std::vector<std::thread> threads;
+    // Send dictionary of new binary sessions, copied by the first diff they are sent
+    SharedKeyDictionary fresh_keys = std::make_shared<KeyDictionary>();
 
     WsStateServer(uint8_t num_threads, tcp::endpoint endpoint)
         : num_threads(num_threads), ioc{num_threads}, acceptor(ioc), endpoint(endpoint) {}
 
-    bool send_diff(const std::string& peer_id, StateDiff& diff) {
-        if (peers.find(peer_id) == peers.end()) {
-            std::cout << "Session not found : " << peer_id << std::endl;
-            return false;
+    bool send_diff(const std::string& peer_id, StateDiff& diff) { return broadcast_diff({peer_id}, diff); }
+
+    // Serializes diff once for the json sessions and once per distinct send dictionary for the binary ones
+    bool broadcast_diff(const std::vector<std::string>& peer_ids, StateDiff& diff) {
+        bool ok = true;
+        std::vector<std::shared_ptr<Session>> json_sessions, binary_sessions;
+        for (auto& peer_id : peer_ids) {
+            auto it = peers.find(peer_id);
+            if (it == peers.end()) {
+                std::cout << "Session not found : " << peer_id << std::endl;
+                ok = false;
+                continue;
+            }
+            if (it->second->is_closed()) {
+                std::cout << "Session is closed, erasing : " << peer_id << std::endl;
+                peers.erase(it);
+                ok = false;
+                continue;
+            }
+            (it->second->is_binary() ? binary_sessions : json_sessions).push_back(it->second);
         }
 
-        auto const peer = peers[peer_id];
-        if (peer->is_closed()) {
-            std::cout << "Session is closed, erasing : " << peer_id << std::endl;
-            peers.erase(peer_id);
-            return false;
+        if (!json_sessions.empty()) {
+            auto text = std::make_shared<const std::string>(diff.to_string());
+            for (auto& session : json_sessions) {
+                session->send_frame(text);
+            }
         }
 
-        return peer->send_diff(diff);
+        if (!binary_sessions.empty()) {
+            std::vector<SharedKeyDictionary*> keys;
+            for (auto& session : binary_sessions) {
+                keys.push_back(&session->send_keys());
+            }
+            std::vector<std::shared_ptr<const std::string>> frames;
+            std::string err_msg;
+            if (!encode_binary_diff_shared(diff.diff, diff.time, keys, frames, err_msg)) {
+                std::cout << "Binary diff encoding error : " << err_msg << std::endl;
+                return false;
+            }
+            for (size_t i = 0; i < binary_sessions.size(); i++) {
+                binary_sessions[i]->send_frame(frames[i]);
+            }
+        }
+        return ok;
     }
 
     std::vector<std::string> get_peers() {
@@ -229,7 +334,8 @@ class WsStateServer : public std::enable_shared_from_this<WsStateServer>, public
             std::shared_ptr<Session> session =
                 std::make_shared<Session>(std::move(socket), sid,
                                           std::bind(&WsStateServer::diff_received, shared_from_this(),
-                                                    std::placeholders::_1, std::placeholders::_2));
+                                                    std::placeholders::_1, std::placeholders::_2),
+                                          fresh_keys);
             this->peers[sid] = session;
             session->run();
         }
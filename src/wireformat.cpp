@@ -0,0 +1,476 @@
+#include "wireformat.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include "diff.hpp"
+
+#define WIRE_MAGIC 0xB1
+// Nesting deeper than this is rejected when decoding
+#define WIRE_MAX_DEPTH 512
+
+#define RET_ERROR(_err_msg) \
+    err_msg = _err_msg;     \
+    return false;
+
+enum WireTag : uint8_t {
+    TAG_NULL = 0x00,
+    TAG_FALSE = 0x01,
+    TAG_TRUE = 0x02,
+    TAG_INT = 0x03,
+    TAG_UINT = 0x04,
+    TAG_REAL = 0x05,
+    TAG_STRING = 0x06,
+    TAG_ARRAY = 0x07,
+    TAG_OBJECT = 0x08,
+    // Diff objects, one tag per DiffType
+    TAG_DELETE = 0x10,
+    TAG_UNCHANGED = 0x11,
+    TAG_PATCH_OBJECT = 0x12,
+    TAG_PATCH_ARRAY = 0x13,
+    TAG_PATCH_STRING = 0x14,
+    TAG_APPEND_ARRAY = 0x15,
+    TAG_APPEND_STRING = 0x16,
+    TAG_INCREMENT = 0x17,
+};
+
+enum SegmentKind : uint8_t {
+    SEGMENT_REF = 0,
+    SEGMENT_NAME = 1,
+    SEGMENT_INDEX = 2,
+    SEGMENT_RANGE = 3,
+};
+
+int KeyDictionary::find(const std::string &key) const {
+    auto it = ids.find(key);
+    return it == ids.end() ? -1 : it->second;
+}
+
+void KeyDictionary::add_inline(const std::string &key) {
+    num_inline++;
+    if (keys.size() >= KEY_DICTIONARY_MAX) return;
+    if (seen_once.erase(key) == 0) {
+        // Forgetting all candidates at once keeps both ends in step
+        if (seen_once.size() >= KEY_CANDIDATES_MAX) seen_once.clear();
+        seen_once.insert(key);
+        return;
+    }
+    ids.emplace(key, keys.size());
+    keys.push_back(key);
+}
+
+const std::string *KeyDictionary::get(uint32_t id) const {
+    return id < keys.size() ? &keys[id] : nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Encoding
+
+inline void put_varint(uint64_t v, std::string &out) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+inline uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int diff_tag(const Json::Value &val) {
+    const Json::Value *type = val.find("_t", "_t" + 2);
+    if (type == nullptr || !type->isString()) return -1;
+    const char *begin, *end;
+    type->getString(&begin, &end);
+    if (end - begin != 1) return -1;
+    switch (static_cast<DiffType>(*begin)) {
+        case DiffType::Delete:
+            return TAG_DELETE;
+        case DiffType::Unchanged:
+            return TAG_UNCHANGED;
+        case DiffType::PatchObject:
+            return TAG_PATCH_OBJECT;
+        case DiffType::PatchArray:
+            return TAG_PATCH_ARRAY;
+        case DiffType::PatchString:
+            return TAG_PATCH_STRING;
+        case DiffType::AppendArray:
+            return TAG_APPEND_ARRAY;
+        case DiffType::AppendString:
+            return TAG_APPEND_STRING;
+        case DiffType::Increment:
+            return TAG_INCREMENT;
+        default:
+            return -1;
+    }
+}
+
+// Parses a canonical decimal ("0", "17", not "017" or "+1")
+inline bool parse_index(std::string_view s, uint64_t &v) {
+    if (s.empty() || s.size() > 18 || (s[0] == '0' && s.size() > 1)) return false;
+    v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (c - '0');
+    }
+    return true;
+}
+
+inline void put_name(std::string_view name, KeyDictionary &keys, std::string &out) {
+    std::string key(name);
+    int id = keys.find(key);
+    if (id >= 0) {
+        put_varint(static_cast<uint64_t>(id) << 2 | SEGMENT_REF, out);
+        return;
+    }
+    put_varint(static_cast<uint64_t>(name.size()) << 2 | SEGMENT_NAME, out);
+    out.append(name.data(), name.size());
+    keys.add_inline(key);
+}
+
+inline void put_segment(std::string_view seg, KeyDictionary &keys, std::string &out) {
+    uint64_t start, end;
+    if (parse_index(seg, start)) {
+        put_varint(start << 2 | SEGMENT_INDEX, out);
+        return;
+    }
+    size_t colon = seg.find(':');
+    if (colon != std::string_view::npos && parse_index(seg.substr(0, colon), start) &&
+        parse_index(seg.substr(colon + 1), end) && start <= end) {
+        put_varint(start << 2 | SEGMENT_RANGE, out);
+        put_varint(end - start, out);
+        return;
+    }
+    put_name(seg, keys, out);
+}
+
+inline void put_path(std::string_view path, KeyDictionary &keys, std::string &out) {
+    size_t count = std::count(path.begin(), path.end(), '/') + 1;
+    put_varint(count, out);
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos) end = path.size();
+        put_segment(path.substr(start, end - start), keys, out);
+        start = end + 1;
+    }
+}
+
+void encode_value(const Json::Value &val, KeyDictionary &keys, std::string &out) {
+    switch (val.type()) {
+        case Json::ValueType::nullValue:
+            out.push_back(TAG_NULL);
+            break;
+        case Json::ValueType::booleanValue:
+            out.push_back(val.asBool() ? TAG_TRUE : TAG_FALSE);
+            break;
+        case Json::ValueType::intValue:
+            out.push_back(TAG_INT);
+            put_varint(zigzag(val.asInt64()), out);
+            break;
+        case Json::ValueType::uintValue:
+            out.push_back(TAG_UINT);
+            put_varint(val.asUInt64(), out);
+            break;
+        case Json::ValueType::realValue: {
+            double d = val.asDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            out.push_back(TAG_REAL);
+            for (int i = 0; i < 8; i++) out.push_back(static_cast<char>(bits >> (8 * i)));
+            break;
+        }
+        case Json::ValueType::stringValue: {
+            const char *begin, *end;
+            val.getString(&begin, &end);
+            out.push_back(TAG_STRING);
+            put_varint(end - begin, out);
+            out.append(begin, end - begin);
+            break;
+        }
+        case Json::ValueType::arrayValue:
+            out.push_back(TAG_ARRAY);
+            put_varint(val.size(), out);
+            for (Json::ArrayIndex i = 0; i < val.size(); i++) {
+                encode_value(val[i], keys, out);
+            }
+            break;
+        case Json::ValueType::objectValue: {
+            int tag = diff_tag(val);
+            if ((tag == TAG_DELETE || tag == TAG_UNCHANGED) && val.size() != 1) tag = -1;
+            if (tag >= TAG_APPEND_ARRAY && (val.size() != 2 || !val.isMember("v"))) tag = -1;
+            if (tag == TAG_DELETE || tag == TAG_UNCHANGED) {
+                out.push_back(static_cast<char>(tag));
+                break;
+            }
+            if (tag >= TAG_APPEND_ARRAY) {
+                // Appends and increments only carry their "v" value
+                out.push_back(static_cast<char>(tag));
+                encode_value(val["v"], keys, out);
+                break;
+            }
+            out.push_back(static_cast<char>(tag < 0 ? TAG_OBJECT : tag));
+            put_varint(tag < 0 ? val.size() : val.size() - 1, out);
+            for (auto it = val.begin(); it != val.end(); ++it) {
+                const char *end;
+                const char *begin = it.memberName(&end);
+                std::string_view key(begin, end - begin);
+                if (tag < 0) {
+                    // Plain member names are never split into path segments
+                    put_name(key, keys, out);
+                } else if (key != "_t") {
+                    put_path(key, keys, out);
+                } else {
+                    continue;
+                }
+                encode_value(*it, keys, out);
+            }
+            break;
+        }
+    }
+}
+
+bool encode_binary_diff(const Json::Value &diff, uint64_t time, KeyDictionary &keys, std::string &out,
+                        std::string &err_msg) {
+    out.clear();
+    out.push_back(static_cast<char>(WIRE_MAGIC));
+    put_varint(keys.version(), out);
+    put_varint(time, out);
+    encode_value(diff, keys, out);
+    return true;
+}
+
+bool encode_binary_diff_shared(const Json::Value &diff, uint64_t time, const std::vector<SharedKeyDictionary *> &keys,
+                               std::vector<std::shared_ptr<const std::string>> &frames, std::string &err_msg) {
+    struct Encoded {
+        long num_sessions = 0;
+        SharedKeyDictionary updated;
+        std::shared_ptr<const std::string> frame;
+    };
+    std::unordered_map<const KeyDictionary *, Encoded> encoded;
+    for (auto *session_keys : keys) {
+        encoded[session_keys->get()].num_sessions++;
+    }
+
+    frames.clear();
+    for (auto *session_keys : keys) {
+        Encoded &enc = encoded[session_keys->get()];
+        if (enc.frame == nullptr) {
+            // Updated in place when the sessions are the only holders, nobody else sees the change
+            enc.updated = session_keys->use_count() == enc.num_sessions
+                              ? *session_keys
+                              : std::make_shared<KeyDictionary>(**session_keys);
+            auto frame = std::make_shared<std::string>();
+            if (!encode_binary_diff(diff, time, *enc.updated, *frame, err_msg)) return false;
+            enc.frame = std::move(frame);
+        }
+        frames.push_back(enc.frame);
+    }
+    for (auto *session_keys : keys) {
+        *session_keys = encoded[session_keys->get()].updated;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Decoding
+
+struct WireReader {
+    const uint8_t *pos;
+    const uint8_t *end;
+    KeyDictionary &keys;
+    std::string &err_msg;
+
+    bool get_varint(uint64_t &v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos == end) {
+                RET_ERROR("Truncated varint");
+            }
+            uint8_t b = *pos++;
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        RET_ERROR("Varint too long");
+    }
+
+    bool get_length(uint64_t &n) {
+        if (!get_varint(n)) return false;
+        if (n > static_cast<uint64_t>(end - pos)) {
+            RET_ERROR("Length exceeds message : " + std::to_string(n));
+        }
+        return true;
+    }
+
+    bool get_segment(std::string &key) {
+        uint64_t h;
+        if (!get_varint(h)) return false;
+        switch (h & 3) {
+            case SEGMENT_REF: {
+                const std::string *name = keys.get(h >> 2);
+                if (name == nullptr) {
+                    RET_ERROR("Unknown key id : " + std::to_string(h >> 2));
+                }
+                key.append(*name);
+                return true;
+            }
+            case SEGMENT_NAME: {
+                uint64_t len = h >> 2;
+                if (len > static_cast<uint64_t>(end - pos)) {
+                    RET_ERROR("Truncated key");
+                }
+                std::string name(reinterpret_cast<const char *>(pos), len);
+                pos += len;
+                key.append(name);
+                keys.add_inline(name);
+                return true;
+            }
+            case SEGMENT_INDEX:
+                key.append(std::to_string(h >> 2));
+                return true;
+            default: {
+                uint64_t len;
+                if (!get_varint(len)) return false;
+                key.append(std::to_string(h >> 2)).append(":").append(std::to_string((h >> 2) + len));
+                return true;
+            }
+        }
+    }
+
+    bool get_path(std::string &key) {
+        uint64_t count;
+        if (!get_length(count)) return false;
+        if (count == 0) {
+            RET_ERROR("Empty path");
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            if (i > 0) key.push_back('/');
+            if (!get_segment(key)) return false;
+        }
+        return true;
+    }
+
+    bool get_value(Json::Value &val, int depth) {
+        if (pos == end) {
+            RET_ERROR("Truncated value");
+        }
+        if (depth > WIRE_MAX_DEPTH) {
+            RET_ERROR("Value nested too deep");
+        }
+        uint8_t tag = *pos++;
+        uint64_t n;
+        switch (tag) {
+            case TAG_NULL:
+                val = Json::Value(Json::nullValue);
+                return true;
+            case TAG_FALSE:
+            case TAG_TRUE:
+                val = tag == TAG_TRUE;
+                return true;
+            case TAG_INT:
+                if (!get_varint(n)) return false;
+                val = static_cast<Json::Int64>((n >> 1) ^ (~(n & 1) + 1));
+                return true;
+            case TAG_UINT:
+                if (!get_varint(n)) return false;
+                val = static_cast<Json::UInt64>(n);
+                return true;
+            case TAG_REAL: {
+                if (end - pos < 8) {
+                    RET_ERROR("Truncated real");
+                }
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; i++) bits |= static_cast<uint64_t>(pos[i]) << (8 * i);
+                pos += 8;
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                val = d;
+                return true;
+            }
+            case TAG_STRING:
+                if (!get_length(n)) return false;
+                val = Json::Value(reinterpret_cast<const char *>(pos), reinterpret_cast<const char *>(pos + n));
+                pos += n;
+                return true;
+            case TAG_ARRAY:
+                if (!get_length(n)) return false;
+                val = Json::Value(Json::arrayValue);
+                for (uint64_t i = 0; i < n; i++) {
+                    if (!get_value(val[static_cast<Json::ArrayIndex>(i)], depth + 1)) return false;
+                }
+                return true;
+            case TAG_OBJECT:
+                if (!get_length(n)) return false;
+                val = Json::Value(Json::objectValue);
+                for (uint64_t i = 0; i < n; i++) {
+                    std::string key;
+                    if (!get_segment(key)) return false;
+                    if (!get_value(val[key], depth + 1)) return false;
+                }
+                return true;
+            case TAG_DELETE:
+            case TAG_UNCHANGED:
+            case TAG_PATCH_OBJECT:
+            case TAG_PATCH_ARRAY:
+            case TAG_PATCH_STRING:
+            case TAG_APPEND_ARRAY:
+            case TAG_APPEND_STRING:
+            case TAG_INCREMENT: {
+                static const char types[] = {
+                    static_cast<char>(DiffType::Delete),       static_cast<char>(DiffType::Unchanged),
+                    static_cast<char>(DiffType::PatchObject),  static_cast<char>(DiffType::PatchArray),
+                    static_cast<char>(DiffType::PatchString),  static_cast<char>(DiffType::AppendArray),
+                    static_cast<char>(DiffType::AppendString), static_cast<char>(DiffType::Increment),
+                };
+                val = Json::Value(Json::objectValue);
+                val["_t"] = std::string{types[tag - TAG_DELETE]};
+                if (tag == TAG_DELETE || tag == TAG_UNCHANGED) return true;
+                if (tag >= TAG_APPEND_ARRAY) return get_value(val["v"], depth + 1);
+                if (!get_length(n)) return false;
+                for (uint64_t i = 0; i < n; i++) {
+                    std::string key;
+                    if (!get_path(key)) return false;
+                    if (!get_value(val[key], depth + 1)) return false;
+                }
+                return true;
+            }
+            default:
+                RET_ERROR("Unknown tag : " + std::to_string(tag));
+        }
+    }
+};
+
+bool decode_binary_diff(const char *data, size_t size, KeyDictionary &keys, Json::Value &diff, uint64_t &time,
+                        std::string &err_msg) {
+    const uint8_t *begin = reinterpret_cast<const uint8_t *>(data);
+    if (size == 0 || begin[0] != WIRE_MAGIC) {
+        RET_ERROR("Not a binary diff message");
+    }
+    if (keys.is_broken()) {
+        RET_ERROR("Key dictionary out of sync");
+    }
+
+    // Any error from here on may have left keys half updated, so the dictionary is not used again
+    WireReader reader{begin + 1, begin + size, keys, err_msg};
+    uint64_t version;
+    if (!reader.get_varint(version)) {
+        keys.set_broken();
+        return false;
+    }
+    if (version != keys.version()) {
+        keys.set_broken();
+        RET_ERROR("Key dictionary out of sync : expected version " + std::to_string(keys.version()) + ", got " +
+                  std::to_string(version));
+    }
+    if (!reader.get_varint(time) || !reader.get_value(diff, 0)) {
+        keys.set_broken();
+        return false;
+    }
+    if (reader.pos != reader.end) {
+        keys.set_broken();
+        RET_ERROR("Trailing bytes after diff");
+    }
+    return true;
+}
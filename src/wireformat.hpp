@@ -0,0 +1,83 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_WIREFORMAT_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_WIREFORMAT_HPP_
+
+#include <json/json.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Entries per dictionary. Nothing is evicted, names first repeated after it is full are always sent inline.
+#define KEY_DICTIONARY_MAX 4096
+// Names sent inline once and waiting for a second use, the candidates are dropped together when full
+#define KEY_CANDIDATES_MAX 16384
+
+/**
+ * Object keys and path segments interned for one direction of one session.
+ *
+ * A name is sent inline the first two times it is used and interned on the
+ * second, so one-off names (e.g. "record123") do not fill the dictionary.
+ * The sender and the receiver each keep one and update it in the order names
+ * are written / read. Every message carries the sender's version() and the
+ * receiver rejects it if its own differs, i.e. after a lost or bad message.
+ */
+class KeyDictionary {
+   public:
+    // Id of key, -1 if not interned
+    int find(const std::string &key) const;
+    // Records a name sent inline, interning it if it was sent inline before and there is room
+    void add_inline(const std::string &key);
+    // Key for id, nullptr if unknown
+    const std::string *get(uint32_t id) const;
+    size_t size() const { return keys.size(); }
+    // Number of names sent inline so far
+    uint64_t version() const { return num_inline; }
+
+    // Set when decoding failed, both ends have to start over with new dictionaries
+    bool is_broken() const { return broken; }
+    void set_broken() { broken = true; }
+
+   private:
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> keys;
+    std::unordered_set<std::string> seen_once;
+    uint64_t num_inline = 0;
+    bool broken = false;
+};
+
+/**
+ * Binary encoding of a StateDiff, the alternative to the json text format.
+ *
+ * message := MAGIC varint(dictionary version) varint(time) value
+ * value   := NULL | FALSE | TRUE | INT zigzag | UINT varint | REAL f64 | STRING varint(len) bytes
+ *          | ARRAY varint(n) value* | OBJECT varint(n) (segment value)*
+ *          | X | U | P/A/S varint(n) (path value)*             diff objects, "_t" is implied
+ *          | L/C/I value                                        {"_t": L/C/I, "v": value}
+ * path    := varint(n) segment*                                 "a/3/0:5" as name, index and range
+ * segment := varint(id << 2)                                    interned name
+ *          | varint(len << 2 | 1) bytes                         inline name
+ *          | varint(index << 2 | 2)                             array index
+ *          | varint(start << 2 | 3) varint(end - start)         array/string range
+ */
+bool encode_binary_diff(const Json::Value &diff, uint64_t time, KeyDictionary &keys, std::string &out,
+                        std::string &err_msg);
+
+// Send dictionary of a session, shared by the sessions that were sent the same frames since they started
+typedef std::shared_ptr<KeyDictionary> SharedKeyDictionary;
+
+/**
+ * Encodes one diff for several sessions, frames[i] being the frame for keys[i]. Sessions sharing a dictionary
+ * get one frame encoded once, and share the updated dictionary afterwards. Dictionaries that are also held
+ * outside of keys are copied before they are updated.
+ */
+bool encode_binary_diff_shared(const Json::Value &diff, uint64_t time, const std::vector<SharedKeyDictionary *> &keys,
+                               std::vector<std::shared_ptr<const std::string>> &frames, std::string &err_msg);
+
+// Fails for every message after one that failed, see KeyDictionary::is_broken
+bool decode_binary_diff(const char *data, size_t size, KeyDictionary &keys, Json::Value &diff, uint64_t &time,
+                        std::string &err_msg);
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_WIREFORMAT_HPP_
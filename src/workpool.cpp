@@ -0,0 +1,98 @@
+#include "workpool.hpp"
+
+#include <algorithm>
+
+// Pool and queue of the worker thread running, so that tasks spawned by tasks go to the deque of their worker
+thread_local const WorkPool *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+WorkPool::WorkPool(int num_threads) {
+    int num_workers = std::max(num_threads, 1) - 1;
+    for (int i = 0; i <= num_workers; i++) {
+        queues.emplace_back(new Queue());
+    }
+    for (int i = 1; i <= num_workers; i++) {
+        workers.emplace_back([this, i] { work(i); });
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+size_t WorkPool::own_queue() const { return current_pool == this ? current_queue : 0; }
+
+void WorkPool::spawn(Group &group, std::function<void()> task) {
+    group.pending.fetch_add(1, std::memory_order_relaxed);
+    Queue &queue = *queues[own_queue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(Task{std::move(task), &group});
+    }
+    num_queued.fetch_add(1, std::memory_order_release);
+    if (!workers.empty()) {
+        // Taking the lock orders this with a worker that checked num_queued and is about to sleep
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wakeup.notify_one();
+    }
+}
+
+bool WorkPool::take(size_t own, Task &task) {
+    if (num_queued.load(std::memory_order_acquire) == 0) return false;
+    size_t num_queues = queues.size();
+    for (size_t k = 0; k < num_queues; k++) {
+        Queue &queue = *queues[(own + k) % num_queues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (k == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        num_queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void WorkPool::run(Task &task) {
+    task.fn();
+    task.group->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+void WorkPool::wait(Group &group) {
+    size_t own = own_queue();
+    while (group.pending.load(std::memory_order_acquire) != 0) {
+        Task task;
+        if (take(own, task)) {
+            run(task);
+        } else {
+            // The remaining tasks are running on other threads
+            std::this_thread::yield();
+        }
+    }
+}
+
+void WorkPool::work(size_t own) {
+    current_pool = this;
+    current_queue = own;
+    while (true) {
+        Task task;
+        if (take(own, task)) {
+            run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wakeup.wait(lock, [this] { return stopping || num_queued.load(std::memory_order_acquire) > 0; });
+        if (stopping && num_queued.load(std::memory_order_acquire) == 0) return;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __PROJECTS_SYNCLIBCPP_SRC_WORKPOOL_HPP_
+#define __PROJECTS_SYNCLIBCPP_SRC_WORKPOOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing thread pool for fork-join work such as diffing large documents.
+ *
+ * Every worker has its own deque: it runs the tasks it spawned itself newest
+ * first and steals the oldest tasks of the others when it runs out. Threads
+ * outside the pool add their tasks to a shared queue. wait() runs tasks until
+ * the group is done instead of blocking, so tasks can spawn and wait for tasks
+ * of their own without tying up a worker.
+ */
+class WorkPool {
+   public:
+    // Tasks spawned together and waited for together
+    class Group {
+       public:
+        Group() = default;
+        Group(const Group &) = delete;
+        Group &operator=(const Group &) = delete;
+
+       private:
+        std::atomic<size_t> pending{0};
+        friend class WorkPool;
+    };
+
+    // num_threads counts the thread that waits, so a pool of 1 runs all tasks in wait()
+    explicit WorkPool(int num_threads);
+    ~WorkPool();
+    WorkPool(const WorkPool &) = delete;
+    WorkPool &operator=(const WorkPool &) = delete;
+
+    int num_threads() const { return workers.size() + 1; }
+
+    // Tasks must not throw
+    void spawn(Group &group, std::function<void()> task);
+    // Runs tasks, of any group, until all tasks of group are done
+    void wait(Group &group);
+
+   private:
+    struct Task {
+        std::function<void()> fn;
+        Group *group;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // queues[0] is shared by outside threads, queues[i] belongs to worker i - 1
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> num_queued{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+
+    // Queue of the calling thread, 0 if it is not a worker of this pool
+    size_t own_queue() const;
+    // Takes a task from queue own, newest first, or steals the oldest of another queue
+    bool take(size_t own, Task &task);
+    void run(Task &task);
+    void work(size_t own);
+};
+
+#endif  // __PROJECTS_SYNCLIBCPP_SRC_WORKPOOL_HPP_
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "diff.hpp"
+#include "test_utils.hpp"
+
+// Composes first and second and checks that the result turns old_json into new_json, false if they do not compose
+bool expect_compose(const Json::Value &old_json, const Json::Value &first, const Json::Value &second,
+                    const Json::Value &new_json) {
+    Json::Value composed;
+    std::string err_msg;
+    if (!compose_diff(first, second, composed, err_msg)) {
+        // Only appends and patches of unknown length may fail
+        EXPECT_NE(err_msg.find("Cannot compose"), std::string::npos) << err_msg << "\n" << first << second;
+        return false;
+    }
+    Json::Value target = old_json, applied = composed;
+    EXPECT_TRUE(apply_diff(target, applied, err_msg)) << err_msg << "\n" << first << second << composed;
+    EXPECT_EQ(target, new_json) << old_json << first << second << composed;
+    return true;
+}
+
+TEST(ComposeTest, FixtureDiffsCompose) {
+    Json::Value jsons = load_fixtures();
+    std::vector<Json::Value> docs(jsons.begin(), jsons.end());
+    std::string err_msg;
+    int num_composed = 0, num_failed = 0;
+
+    for (auto &x : docs) {
+        for (auto &y : docs) {
+            Json::Value first;
+            ASSERT_TRUE(get_diff(x, y, first, err_msg));
+            for (auto &z : docs) {
+                Json::Value second;
+                ASSERT_TRUE(get_diff(y, z, second, err_msg));
+                (expect_compose(x, first, second, z) ? num_composed : num_failed)++;
+                if (HasFailure()) return;
+            }
+        }
+    }
+    EXPECT_LT(num_failed * 10, num_composed);
+}
+
+TEST(ComposeTest, RandomEditChainsCompose) {
+    std::mt19937 rng(11);
+    DiffOptions keyed;
+    keyed.array_key = "a";
+    std::string err_msg;
+    int num_composed = 0, num_failed = 0;
+
+    for (int round = 0; round < 3000; round++) {
+        const DiffOptions &options = round % 2 ? keyed : DiffOptions{};
+        Json::Value doc = random_json(rng);
+        Json::Value first_doc = doc, composed = DIFF_UNCHANGED, diffs = Json::arrayValue;
+        for (int step = 0; step < 6; step++) {
+            Json::Value next_doc = random_json_edit(rng, doc), diff_json, squashed;
+            ASSERT_TRUE(get_diff(doc, next_doc, diff_json, err_msg, options));
+            doc = next_doc;
+            diffs.append(diff_json);
+            if (!compose_diff(composed, diff_json, squashed, err_msg)) {
+                // Only patches after appends of unknown length may fail
+                EXPECT_NE(err_msg.find("Cannot compose"), std::string::npos) << err_msg;
+                num_failed++;
+                break;
+            }
+            composed = squashed;
+            Json::Value target = first_doc, applied = composed;
+            ASSERT_TRUE(apply_diff(target, applied, err_msg)) << err_msg << composed;
+            ASSERT_EQ(target, doc) << first_doc << diffs << composed;
+            num_composed++;
+        }
+
+        // Squashed at once
+        std::vector<const Json::Value *> sequence;
+        for (auto &diff_json : diffs) sequence.push_back(&diff_json);
+        Json::Value squashed;
+        if (compose_diff(sequence, squashed, err_msg)) {
+            Json::Value target = first_doc;
+            ASSERT_TRUE(apply_diff(target, squashed, err_msg)) << err_msg << diffs;
+            ASSERT_EQ(target, doc) << first_doc << diffs;
+        }
+    }
+    EXPECT_LT(num_failed * 10, num_composed);
+}
+
+TEST(ComposeTest, AppendsAndIncrementsAreMerged) {
+    Json::Value first, second, composed;
+    std::string err_msg;
+    Json::Reader().parse("{\"_t\": \"P\", \"log\": {\"_t\": \"L\", \"v\": [1]}, \"n\": {\"_t\": \"I\", \"v\": 5}}", first);
+    Json::Reader().parse("{\"_t\": \"P\", \"log\": {\"_t\": \"L\", \"v\": [2]}, \"n\": {\"_t\": \"I\", \"v\": -7}}",
+                         second);
+    ASSERT_TRUE(compose_diff(first, second, composed, err_msg)) << err_msg;
+    EXPECT_EQ(composed["log"]["_t"], "L");
+    EXPECT_EQ(composed["log"]["v"].size(), 2u);
+    EXPECT_EQ(composed["n"]["_t"], "I");
+    EXPECT_EQ(composed["n"]["v"].asInt(), -2);
+
+    // Where the appended items end up is not known without the array
+    Json::Reader().parse("{\"_t\": \"A\", \"log/0:1\": []}", second);
+    EXPECT_FALSE(compose_diff(first, second, composed, err_msg));
+}
+
+TEST(ComposeTest, DeletedAndReaddedMembers) {
+    Json::Value x, y, z;
+    Json::Reader().parse("{\"a\": {\"b\": 1}, \"c\": [1, 2, 3]}", x);
+    Json::Reader().parse("{\"c\": [1, 2, 3], \"d\": 4}", y);
+    Json::Reader().parse("{\"a\": {\"b\": 2}, \"c\": [3, 2, 1]}", z);
+    Json::Value first, second;
+    std::string err_msg;
+    ASSERT_TRUE(get_diff(x, y, first, err_msg));
+    ASSERT_TRUE(get_diff(y, z, second, err_msg));
+    EXPECT_TRUE(expect_compose(x, first, second, z));
+}
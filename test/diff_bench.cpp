@@ -0,0 +1,871 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "diff.hpp"
+#include "persistent.hpp"
+#include "statevar.hpp"
+#include "test_utils.hpp"
+#include "wireformat.hpp"
+#include "workpool.hpp"
+
+// Allocations of the benchmarked code. jsoncpp allocates its nodes with new and its strings with malloc, both end
+// up in malloc, which glibc lets the executable replace.
+std::atomic<size_t> num_allocs{0}, num_alloc_bytes{0};
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(count * size, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+// Used by aligned operator new, which the allocators of std::pmr call
+void *aligned_alloc(size_t alignment, size_t size) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == nullptr ? ENOMEM : 0;
+}
+}
+#endif
+
+// Reports the allocations made since it was created, per call of the benchmarked function
+class AllocationCounters {
+   public:
+    AllocationCounters() : allocs(num_allocs.load()), bytes(num_alloc_bytes.load()) {}
+
+    void report(benchmark::State &state, size_t num_calls) {
+        if (num_calls == 0) return;
+        state.counters["allocs_per_diff"] = static_cast<double>(num_allocs.load() - allocs) / num_calls;
+        state.counters["alloc_bytes_per_diff"] = static_cast<double>(num_alloc_bytes.load() - bytes) / num_calls;
+    }
+
+   private:
+    size_t allocs, bytes;
+};
+
+// Object with `num_records` records of a few fields each, shaped like our job states
+Json::Value make_records(int num_records) {
+    Json::Value doc = Json::objectValue;
+    for (int i = 0; i < num_records; i++) {
+        Json::Value record;
+        record["id"] = i;
+        record["name"] = "Record " + std::to_string(i);
+        record["status"] = "Running";
+        record["logs"] = Json::arrayValue;
+        for (int j = 0; j < 4; j++) {
+            record["logs"].append("line " + std::to_string(j));
+        }
+        doc["record" + std::to_string(i)] = record;
+    }
+    return doc;
+}
+
+// Same document with a single leaf changed in the middle
+Json::Value change_one_leaf(const Json::Value &doc, int num_records) {
+    Json::Value changed = doc;
+    changed["record" + std::to_string(num_records / 2)]["status"] = "Done";
+    return changed;
+}
+
+static void BM_GetDiff_SingleLeaf(benchmark::State &state) {
+    int num_records = state.range(0);
+    Json::Value old_json = make_records(num_records);
+    Json::Value new_json = change_one_leaf(old_json, num_records);
+    std::string err_msg;
+
+    AllocationCounters counters;
+    for (auto _ : state) {
+        Json::Value diff_json;
+        get_diff(old_json, new_json, diff_json, err_msg);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    counters.report(state, state.iterations());
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_GetDiff_SingleLeaf)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// Hashes computed during the diff, as on the first sync of a new state
+static void BM_GetDiff_SingleLeaf_HashedCold(benchmark::State &state) {
+    int num_records = state.range(0);
+    Json::Value old_json = make_records(num_records);
+    Json::Value new_json = change_one_leaf(old_json, num_records);
+    std::string err_msg;
+
+    for (auto _ : state) {
+        HashCache old_hashes, new_hashes;
+        DiffOptions options;
+        options.old_hashes = &old_hashes;
+        options.new_hashes = &new_hashes;
+        Json::Value diff_json;
+        get_diff(old_json, new_json, diff_json, err_msg, options);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_GetDiff_SingleLeaf_HashedCold)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// Hashes already cached next to both states, as when syncing the same state to further peers
+static void BM_GetDiff_SingleLeaf_HashedWarm(benchmark::State &state) {
+    int num_records = state.range(0);
+    Json::Value old_json = make_records(num_records);
+    Json::Value new_json = change_one_leaf(old_json, num_records);
+    std::string err_msg;
+    HashCache old_hashes, new_hashes;
+    DiffOptions options;
+    options.old_hashes = &old_hashes;
+    options.new_hashes = &new_hashes;
+
+    for (auto _ : state) {
+        Json::Value diff_json;
+        get_diff(old_json, new_json, diff_json, err_msg, options);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_GetDiff_SingleLeaf_HashedWarm)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// One leaf changed by a received diff, as on the sync path: the state keeps its hashes
+// across the apply and only the changed path is hashed again
+template <bool nested>
+static void BM_GetDiff_SingleLeaf_Incremental(benchmark::State &state) {
+    int num_records = state.range(0);
+    Json::Value old_json = make_records(num_records);
+    std::string key = "record" + std::to_string(num_records / 2) + "/status";
+    if (nested) {
+        // Records grouped 32 per object, so only the changed group is compared member by member
+        Json::Value groups = Json::objectValue;
+        for (int i = 0; i < num_records; i++) {
+            std::string name = "record" + std::to_string(i);
+            groups["group" + std::to_string(i / 32)][name] = old_json[name];
+        }
+        old_json = groups;
+        key = "group" + std::to_string(num_records / 2 / 32) + "/" + key;
+    }
+    Json::Value new_json = old_json;
+    std::string err_msg;
+    HashCache old_hashes, new_hashes;
+    old_hashes.get(old_json);
+    new_hashes.get(new_json);
+    DiffOptions options;
+    options.old_hashes = &old_hashes;
+    options.new_hashes = &new_hashes;
+
+    Json::Value set_done, set_running;
+    set_done["_t"] = "P";
+    set_done[key] = "Done";
+    set_running["_t"] = "P";
+    set_running[key] = "Running";
+
+    bool done = false;
+    for (auto _ : state) {
+        done = !done;
+        apply_diff(new_json, done ? set_done : set_running, err_msg, new_hashes);
+        Json::Value diff_json;
+        get_diff(old_json, new_json, diff_json, err_msg, options);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK_TEMPLATE(BM_GetDiff_SingleLeaf_Incremental, false)
+    ->Name("BM_GetDiff_SingleLeaf_Incremental/flat")
+    ->RangeMultiplier(8)
+    ->Range(8, 32768)
+    ->Complexity();
+BENCHMARK_TEMPLATE(BM_GetDiff_SingleLeaf_Incremental, true)
+    ->Name("BM_GetDiff_SingleLeaf_Incremental/nested")
+    ->RangeMultiplier(8)
+    ->Range(8, 32768)
+    ->Complexity();
+
+// The single prefix/suffix splice get_diff_array produced before the sequence diff, kept as a baseline
+Json::Value splice_diff(const Json::Value &old_json, const Json::Value &new_json) {
+    std::string err_msg;
+    int old_length = old_json.size();
+    int new_length = new_json.size();
+    int start = 0;
+    for (; start < std::min(old_length, new_length) && old_json[start] == new_json[start]; start++) {
+    }
+    int end = old_length, new_end = new_length;
+    for (; end > start && new_end > start && old_json[end - 1] == new_json[new_end - 1]; end--, new_end--) {
+    }
+
+    Json::Value diff_array = Json::arrayValue;
+    int i = start;
+    for (; i < std::min(end, new_end); i++) {
+        Json::Value item_diff;
+        get_diff(old_json[i], new_json[i], item_diff, err_msg);
+        diff_array.append(item_diff);
+    }
+    for (; i < new_end; i++) {
+        diff_array.append(new_json[i]);
+    }
+
+    Json::Value diff;
+    diff["_t"] = "A";
+    diff[std::to_string(start) + ":" + std::to_string(end)] = diff_array;
+    return diff;
+}
+
+// Pairs of array fixtures with different lengths, where the splice and the sequence diff differ
+std::vector<std::pair<Json::Value, Json::Value>> array_fixture_pairs() {
+    Json::Value jsons = load_fixtures();
+    std::vector<Json::Value> arrays;
+    for (Json::Value::const_iterator it = jsons.begin(); it != jsons.end(); ++it) {
+        std::string name = it.name();
+        if (name.rfind("ARRAY_", 0) == 0) {
+            arrays.push_back(*it);
+        } else if (name.rfind("JOB_", 0) == 0) {
+            arrays.push_back((*it)["job1"]["logs"]);
+        }
+    }
+
+    std::vector<std::pair<Json::Value, Json::Value>> pairs;
+    for (auto &old_json : arrays) {
+        for (auto &new_json : arrays) {
+            if (old_json.size() != new_json.size()) {
+                pairs.emplace_back(old_json, new_json);
+            }
+        }
+    }
+    return pairs;
+}
+
+template <bool sequence_diff>
+static void BM_ArrayDiff_Fixtures(benchmark::State &state) {
+    auto pairs = array_fixture_pairs();
+    Json::FastWriter writer;
+    std::string err_msg;
+    size_t diff_bytes = 0, new_bytes = 0;
+
+    for (auto _ : state) {
+        diff_bytes = new_bytes = 0;
+        for (auto &pair : pairs) {
+            Json::Value diff_json;
+            if (sequence_diff) {
+                get_diff(pair.first, pair.second, diff_json, err_msg);
+            } else {
+                diff_json = splice_diff(pair.first, pair.second);
+            }
+            state.PauseTiming();
+            diff_bytes += writer.write(diff_json).size();
+            new_bytes += writer.write(pair.second).size();
+            state.ResumeTiming();
+        }
+    }
+    state.counters["diff_bytes"] = diff_bytes;
+    state.counters["new_bytes"] = new_bytes;
+}
+BENCHMARK_TEMPLATE(BM_ArrayDiff_Fixtures, false)->Name("BM_ArrayDiff_Fixtures/splice");
+BENCHMARK_TEMPLATE(BM_ArrayDiff_Fixtures, true)->Name("BM_ArrayDiff_Fixtures/sequence");
+
+// Array of `length` records with one record inserted near the front and one removed near the back
+template <bool sequence_diff>
+static void BM_ArrayDiff_InsertDelete(benchmark::State &state) {
+    int length = state.range(0);
+    Json::Value old_json = Json::arrayValue, new_json = Json::arrayValue;
+    for (int i = 0; i < length; i++) {
+        Json::Value record;
+        record["id"] = i;
+        record["name"] = "Record " + std::to_string(i);
+        old_json.append(record);
+        if (i == 3) {
+            Json::Value inserted;
+            inserted["id"] = -1;
+            new_json.append(inserted);
+        }
+        if (i != length - 3) {
+            new_json.append(record);
+        }
+    }
+
+    Json::FastWriter writer;
+    std::string err_msg;
+    Json::Value diff_json;
+    for (auto _ : state) {
+        if (sequence_diff) {
+            get_diff(old_json, new_json, diff_json, err_msg);
+        } else {
+            diff_json = splice_diff(old_json, new_json);
+        }
+        benchmark::DoNotOptimize(diff_json);
+    }
+    state.counters["diff_bytes"] = writer.write(diff_json).size();
+}
+BENCHMARK_TEMPLATE(BM_ArrayDiff_InsertDelete, false)
+    ->Name("BM_ArrayDiff_InsertDelete/splice")
+    ->RangeMultiplier(10)
+    ->Range(100, 100000);
+BENCHMARK_TEMPLATE(BM_ArrayDiff_InsertDelete, true)
+    ->Name("BM_ArrayDiff_InsertDelete/sequence")
+    ->RangeMultiplier(10)
+    ->Range(100, 100000);
+
+// Applying a splice to an array of `length` records: one record replaced in the middle, which keeps the
+// length, or one record inserted near the back
+template <bool same_length>
+static void BM_ArrayApply_Splice(benchmark::State &state) {
+    int length = state.range(0);
+    Json::Value records = make_records(length);
+    Json::Value other = make_records(1)["record0"];
+    other["id"] = -1;
+    Json::Value old_json = Json::arrayValue, new_json = Json::arrayValue;
+    for (int i = 0; i < length; i++) {
+        const Json::Value &record = records["record" + std::to_string(i)];
+        old_json.append(record);
+        if (!same_length && i == length - 2) {
+            new_json.append(other);
+        }
+        new_json.append(same_length && i == length / 2 ? other : record);
+    }
+    std::string err_msg;
+    Json::Value forward, backward;
+    get_diff(old_json, new_json, forward, err_msg);
+    get_diff(new_json, old_json, backward, err_msg);
+
+    // The splice is applied and undone, copying the array per iteration would cost more than applying
+    Json::Value target = old_json, pending[2];
+    for (auto _ : state) {
+        state.PauseTiming();
+        pending[0] = forward;
+        pending[1] = backward;
+        state.ResumeTiming();
+        if (!apply_diff(target, pending[0], err_msg) || !apply_diff(target, pending[1], err_msg)) {
+            state.SkipWithError(err_msg.c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+    state.SetComplexityN(length);
+}
+BENCHMARK_TEMPLATE(BM_ArrayApply_Splice, true)
+    ->Name("BM_ArrayApply_Splice/replace")
+    ->RangeMultiplier(8)
+    ->Range(64, 32768)
+    ->Complexity();
+BENCHMARK_TEMPLATE(BM_ArrayApply_Splice, false)
+    ->Name("BM_ArrayApply_Splice/insert")
+    ->RangeMultiplier(8)
+    ->Range(64, 32768)
+    ->Complexity();
+
+// One small edit per 16 KB plus a 4 KB block moved from the front to the back
+std::string edit_text(const std::string &text) {
+    std::string edited = text;
+    for (size_t pos = 1000; pos + 100 < edited.size(); pos += 16384) {
+        edited.insert(pos, "edited");
+        edited.erase(pos + 50, 3);
+    }
+    if (edited.size() > 16384) {
+        std::string block = edited.substr(8192, 4096);
+        edited.erase(8192, 4096);
+        edited.append(block);
+    }
+    return edited;
+}
+
+static void BM_StringDiff_ScatteredEdits(benchmark::State &state) {
+    Json::Value old_json = make_text(state.range(0), state.range(0));
+    Json::Value new_json = edit_text(old_json.asString());
+    Json::FastWriter writer;
+    std::string err_msg;
+    Json::Value diff_json;
+
+    for (auto _ : state) {
+        get_diff(old_json, new_json, diff_json, err_msg);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.counters["diff_bytes"] = writer.write(diff_json).size();
+    state.counters["new_bytes"] = new_json.asString().size();
+}
+BENCHMARK(BM_StringDiff_ScatteredEdits)->RangeMultiplier(8)->Range(1 << 10, 1 << 22);
+
+static void BM_StringApply_ScatteredEdits(benchmark::State &state) {
+    Json::Value old_json = make_text(state.range(0), state.range(0));
+    Json::Value new_json = edit_text(old_json.asString());
+    std::string err_msg;
+    Json::Value diff_json;
+    get_diff(old_json, new_json, diff_json, err_msg);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        Json::Value target = old_json;
+        state.ResumeTiming();
+        apply_diff(target, diff_json, err_msg);
+        benchmark::DoNotOptimize(target);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StringApply_ScatteredEdits)->RangeMultiplier(8)->Range(1 << 10, 1 << 22);
+
+// Appending one line to a log of `length` lines, which should not depend on `length`
+static void BM_ApplyDiff_LogAppend(benchmark::State &state) {
+    int length = state.range(0);
+    Json::Value log = Json::arrayValue;
+    for (int i = 0; i < length; i++) {
+        log.append("line " + std::to_string(i));
+    }
+    Json::Value appended = log;
+    appended.append("line " + std::to_string(length));
+    std::string err_msg;
+    Json::Value diff_json;
+    get_diff(log, appended, diff_json, err_msg);
+
+    for (auto _ : state) {
+        // Appended items are moved out of the diff
+        state.PauseTiming();
+        Json::Value diff_copy = diff_json;
+        state.ResumeTiming();
+        apply_diff(log, diff_copy, err_msg);
+        state.PauseTiming();
+        log.resize(length);
+        state.ResumeTiming();
+    }
+    state.SetComplexityN(length);
+}
+BENCHMARK(BM_ApplyDiff_LogAppend)->RangeMultiplier(10)->Range(10, 1000000)->Complexity();
+
+// Diffs of a job state where a few records change per sync, as sent on one session
+std::vector<Json::Value> make_diff_stream(int num_diffs) {
+    const int num_records = 256;
+    std::mt19937 rng(7);
+    Json::Value doc = make_records(num_records);
+    std::vector<Json::Value> diffs;
+    std::string err_msg;
+    for (int i = 0; i < num_diffs; i++) {
+        Json::Value next = doc;
+        for (int j = 0; j < 4; j++) {
+            Json::Value &record = next["record" + std::to_string(rng() % num_records)];
+            record["status"] = (rng() % 2) ? "Running" : "Done";
+            record["logs"].append("line " + std::to_string(rng()));
+        }
+        Json::Value diff_json;
+        get_diff(doc, next, diff_json, err_msg);
+        diffs.push_back(diff_json);
+        doc = next;
+    }
+    return diffs;
+}
+
+static void BM_WireEncode_Json(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(64);
+    Json::FastWriter writer;
+    size_t bytes = 0;
+    for (auto _ : state) {
+        bytes = 0;
+        for (auto &diff : diffs) {
+            Json::Value message;
+            message["time"] = 1;
+            message["diff"] = diff;
+            std::string data = writer.write(message);
+            bytes += data.size();
+            benchmark::DoNotOptimize(data);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * diffs.size());
+    state.counters["bytes_per_diff"] = static_cast<double>(bytes) / diffs.size();
+}
+BENCHMARK(BM_WireEncode_Json);
+
+static void BM_WireEncode_Binary(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(64);
+    size_t bytes = 0;
+    std::string err_msg;
+    for (auto _ : state) {
+        // A fresh dictionary per stream, so the first diffs pay for sending keys
+        KeyDictionary keys;
+        bytes = 0;
+        for (auto &diff : diffs) {
+            std::string data;
+            encode_binary_diff(diff, 1, keys, data, err_msg);
+            bytes += data.size();
+            benchmark::DoNotOptimize(data);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * diffs.size());
+    state.counters["bytes_per_diff"] = static_cast<double>(bytes) / diffs.size();
+}
+BENCHMARK(BM_WireEncode_Binary);
+
+static void BM_WireDecode_Json(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(64);
+    Json::FastWriter writer;
+    std::vector<std::string> messages;
+    for (auto &diff : diffs) {
+        Json::Value message;
+        message["time"] = 1;
+        message["diff"] = diff;
+        messages.push_back(writer.write(message));
+    }
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string err_msg;
+    for (auto _ : state) {
+        for (auto &data : messages) {
+            Json::Value message;
+            reader->parse(data.data(), data.data() + data.size(), &message, &err_msg);
+            benchmark::DoNotOptimize(message);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * messages.size());
+}
+BENCHMARK(BM_WireDecode_Json);
+
+static void BM_WireDecode_Binary(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(64);
+    std::vector<std::string> messages;
+    KeyDictionary send_keys;
+    std::string err_msg;
+    for (auto &diff : diffs) {
+        messages.emplace_back();
+        encode_binary_diff(diff, 1, send_keys, messages.back(), err_msg);
+    }
+    for (auto _ : state) {
+        KeyDictionary recv_keys;
+        for (auto &data : messages) {
+            Json::Value diff;
+            uint64_t time;
+            decode_binary_diff(data.data(), data.size(), recv_keys, diff, time, err_msg);
+            benchmark::DoNotOptimize(diff);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * messages.size());
+}
+BENCHMARK(BM_WireDecode_Binary);
+
+// Receive side of the same stream, the diffs are applied one after the other to the session's copy of the state
+static void BM_ApplyDiff_Stream(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(64);
+    const Json::Value doc = make_records(256);
+    std::string err_msg;
+    Json::Value target;
+    std::vector<Json::Value> pending;
+    for (auto _ : state) {
+        // Diffs are consumed by apply_diff, the copies are made and destroyed outside of the timed part
+        state.PauseTiming();
+        target = doc;
+        pending = diffs;
+        state.ResumeTiming();
+        for (auto &diff : pending) {
+            if (!apply_diff(target, diff, err_msg)) {
+                state.SkipWithError(err_msg.c_str());
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(target);
+    }
+    state.SetItemsProcessed(state.iterations() * diffs.size());
+}
+BENCHMARK(BM_ApplyDiff_Stream);
+
+// Catching up a lagging session: the diffs it missed are squashed into one
+template <bool pairwise>
+static void BM_ComposeDiff_Stream(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(state.range(0));
+    std::vector<const Json::Value *> pending;
+    for (auto &diff : diffs) pending.push_back(&diff);
+    std::string err_msg;
+    for (auto _ : state) {
+        Json::Value composed = diffs[0];
+        bool composed_ok = true;
+        if (pairwise) {
+            for (size_t i = 1; i < diffs.size() && composed_ok; i++) {
+                Json::Value next;
+                composed_ok = compose_diff(composed, diffs[i], next, err_msg);
+                composed.swap(next);
+            }
+        } else {
+            composed_ok = compose_diff(pending, composed, err_msg);
+        }
+        if (!composed_ok) {
+            state.SkipWithError(err_msg.c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(composed);
+    }
+    state.SetItemsProcessed(state.iterations() * diffs.size());
+}
+BENCHMARK_TEMPLATE(BM_ComposeDiff_Stream, true)->Name("BM_ComposeDiff_Stream/pairwise")->Arg(4)->Arg(64);
+BENCHMARK_TEMPLATE(BM_ComposeDiff_Stream, false)->Name("BM_ComposeDiff_Stream/sequence")->Arg(4)->Arg(64);
+
+// The same catch-up diffed from the snapshots before and after the missed diffs
+static void BM_GetDiff_FromSnapshots(benchmark::State &state) {
+    std::vector<Json::Value> diffs = make_diff_stream(state.range(0));
+    const Json::Value doc = make_records(256);
+    Json::Value target = doc;
+    std::string err_msg;
+    for (auto &diff : diffs) {
+        Json::Value applied = diff;
+        apply_diff(target, applied, err_msg);
+    }
+    AllocationCounters counters;
+    for (auto _ : state) {
+        Json::Value diff_json;
+        if (!get_diff(doc, target, diff_json, err_msg)) {
+            state.SkipWithError(err_msg.c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(diff_json);
+    }
+    counters.report(state, state.iterations());
+    state.SetItemsProcessed(state.iterations() * diffs.size());
+}
+BENCHMARK(BM_GetDiff_FromSnapshots)->Arg(4)->Arg(64);
+
+// Diff of a state with a few large top-level members, on a pool of range(0) threads, 0 without a pool. The hashes
+// are computed during the diff, as on the first sync of a new state, which is most of the work.
+static void BM_GetDiff_Parallel(benchmark::State &state) {
+    const int num_threads = state.range(0);
+    const int num_records = 16384;
+    Json::Value old_json, new_json;
+    for (const char *key : {"jobs", "nodes", "tasks", "users"}) {
+        old_json[key] = make_records(num_records);
+        new_json[key] = change_one_leaf(old_json[key], num_records);
+    }
+    std::unique_ptr<WorkPool> pool;
+    DiffOptions options;
+    if (num_threads > 0) {
+        pool.reset(new WorkPool(num_threads));
+        options.pool = pool.get();
+    }
+    std::string err_msg;
+    for (auto _ : state) {
+        Json::Value diff_json;
+        get_diff(old_json, new_json, diff_json, err_msg, options);
+        benchmark::DoNotOptimize(diff_json);
+    }
+}
+BENCHMARK(BM_GetDiff_Parallel)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Diffs between all pairs of the fixtures
+static void BM_GetDiff_Fixtures(benchmark::State &state) {
+    Json::Value jsons = load_fixtures();
+    std::string err_msg;
+    AllocationCounters counters;
+    for (auto _ : state) {
+        for (auto &old_json : jsons) {
+            for (auto &new_json : jsons) {
+                Json::Value diff_json;
+                get_diff(old_json, new_json, diff_json, err_msg);
+                benchmark::DoNotOptimize(diff_json);
+            }
+        }
+    }
+    counters.report(state, state.iterations() * jsons.size() * jsons.size());
+}
+BENCHMARK(BM_GetDiff_Fixtures);
+
+// One update of a large state kept as Json::Value: the previous version is kept for diffing, so the document is
+// copied before the change is applied, and both versions are walked to find it again
+static void BM_StateUpdate_Json(benchmark::State &state) {
+    const int num_records = state.range(0);
+    Json::Value doc = make_records(num_records);
+    Json::Value diffs[2];
+    std::string err_msg;
+    get_diff(doc, change_one_leaf(doc, num_records), diffs[0], err_msg);
+    get_diff(change_one_leaf(doc, num_records), doc, diffs[1], err_msg);
+    int i = 0;
+    for (auto _ : state) {
+        Json::Value next = doc, diff = diffs[i++ % 2], sent;
+        apply_diff(next, diff, err_msg);
+        get_diff(doc, next, sent, err_msg);
+        doc.swap(next);
+        benchmark::DoNotOptimize(sent);
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_StateUpdate_Json)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// The same update of a PersistentValue: the previous version is an O(1) snapshot and only the changed path is copied
+static void BM_StateUpdate_Persistent(benchmark::State &state) {
+    const int num_records = state.range(0);
+    Json::Value json = make_records(num_records);
+    PersistentValue doc(json);
+    Json::Value diffs[2];
+    std::string err_msg;
+    get_diff(json, change_one_leaf(json, num_records), diffs[0], err_msg);
+    get_diff(change_one_leaf(json, num_records), json, diffs[1], err_msg);
+    int i = 0;
+    for (auto _ : state) {
+        PersistentValue next;
+        Json::Value sent;
+        apply_diff(doc, diffs[i++ % 2], next, err_msg);
+        get_diff(doc, next, sent, err_msg);
+        doc = next;
+        benchmark::DoNotOptimize(sent);
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_StateUpdate_Persistent)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// Diff of two serialized versions of a large state as it is done without streaming: both are parsed, then diffed
+static void BM_SerializedDiff_Parse(benchmark::State &state) {
+    const int num_records = state.range(0);
+    Json::Value doc = make_records(num_records);
+    const std::string old_text = Json::FastWriter().write(doc);
+    const std::string new_text = Json::FastWriter().write(change_one_leaf(doc, num_records));
+    std::string err_msg;
+
+    AllocationCounters counters;
+    for (auto _ : state) {
+        Json::Value old_json, new_json, diff_json;
+        Json::Reader().parse(old_text, old_json);
+        Json::Reader().parse(new_text, new_json);
+        get_diff(old_json, new_json, diff_json, err_msg);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    counters.report(state, state.iterations());
+    state.SetBytesProcessed(state.iterations() * (old_text.size() + new_text.size()));
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_SerializedDiff_Parse)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// The same diff with stream_diff, which reads both in lockstep and only parses the changed leaf
+static void BM_SerializedDiff_Stream(benchmark::State &state) {
+    const int num_records = state.range(0);
+    Json::Value doc = make_records(num_records);
+    const std::string old_text = Json::FastWriter().write(doc);
+    const std::string new_text = Json::FastWriter().write(change_one_leaf(doc, num_records));
+    std::string err_msg;
+
+    AllocationCounters counters;
+    for (auto _ : state) {
+        std::istringstream old_in(old_text), new_in(new_text);
+        Json::Value diff_json;
+        stream_diff(old_in, new_in, diff_json, err_msg);
+        benchmark::DoNotOptimize(diff_json);
+    }
+    counters.report(state, state.iterations());
+    state.SetBytesProcessed(state.iterations() * (old_text.size() + new_text.size()));
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_SerializedDiff_Stream)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// Transport that drops the diffs, so that the benchmarks only measure finding them
+class NullTransport : public StateTransport {
+   public:
+    std::vector<std::string> get_peers() override { return {"peer"}; }
+    bool send_diff(const std::string &peer_id, StateDiff &diff) override {
+        benchmark::DoNotOptimize(diff.diff);
+        return true;
+    }
+};
+
+// One leaf of a large state changed through the mutation API and synced, the diff is the one of the mutation
+static void BM_StateSync_Mutation(benchmark::State &state) {
+    const int num_records = state.range(0);
+    auto state_var = std::make_shared<StateVar>();
+    state_var->add_transport(std::make_shared<NullTransport>());
+    std::string err_msg;
+    state_var->set("", make_records(num_records), err_msg);
+    state_var->sync();
+    const std::string path = "record" + std::to_string(num_records / 2) + "/status";
+    int i = 0;
+    for (auto _ : state) {
+        state_var->set(path, i++ % 2 ? "Done" : "Running", err_msg);
+        state_var->sync();
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_StateSync_Mutation)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// The same change made on a copy passed to update(), sync then diffs the documents
+static void BM_StateSync_Update(benchmark::State &state) {
+    const int num_records = state.range(0);
+    auto state_var = std::make_shared<StateVar>();
+    state_var->add_transport(std::make_shared<NullTransport>());
+    std::string err_msg;
+    state_var->set("", make_records(num_records), err_msg);
+    state_var->sync();
+    const std::string record = "record" + std::to_string(num_records / 2);
+    int i = 0;
+    for (auto _ : state) {
+        auto next = std::make_shared<StateValue>();
+        next->value = state_var->get_state()->value;
+        next->value[record]["status"] = i % 2 ? "Done" : "Running";
+        next->time = state_var->get_state()->time + 1;
+        i++;
+        state_var->update(next);
+        state_var->sync();
+    }
+    state.SetComplexityN(num_records);
+}
+BENCHMARK(BM_StateSync_Update)->RangeMultiplier(8)->Range(8, 32768)->Complexity();
+
+// Transport of many peers that serializes every diff it sends, once per broadcast when shared is set
+template <bool shared>
+class SerializingTransport : public StateTransport {
+   public:
+    std::vector<std::string> peers;
+    std::vector<std::string> get_peers() override { return peers; }
+    bool send_diff(const std::string &peer_id, StateDiff &diff) override {
+        benchmark::DoNotOptimize(diff.to_string());
+        return true;
+    }
+    bool broadcast_diff(const std::vector<std::string> &peer_ids, StateDiff &diff) override {
+        if (!shared) return StateTransport::broadcast_diff(peer_ids, diff);
+        benchmark::DoNotOptimize(diff.to_string());
+        return true;
+    }
+};
+
+// One change synced to state.range(0) peers at the same version, diffed once and serialized once or per peer
+template <bool shared>
+static void BM_StateSync_Fanout(benchmark::State &state) {
+    const int num_records = 256;
+    auto state_var = std::make_shared<StateVar>();
+    auto transport = std::make_shared<SerializingTransport<shared>>();
+    for (int i = 0; i < state.range(0); i++) {
+        transport->peers.push_back("peer" + std::to_string(i));
+    }
+    state_var->add_transport(transport);
+    std::string err_msg;
+    state_var->set("", make_records(num_records), err_msg);
+    state_var->sync();
+    const std::string record = "record" + std::to_string(num_records / 2);
+    int i = 0;
+    for (auto _ : state) {
+        auto next = std::make_shared<StateValue>();
+        next->value = state_var->get_state()->value;
+        next->value[record]["logs"].append("line " + std::to_string(i++));
+        next->time = state_var->get_state()->time + 1;
+        state_var->update(next);
+        state_var->sync();
+    }
+}
+BENCHMARK_TEMPLATE(BM_StateSync_Fanout, false)->Name("BM_StateSync_Fanout/per_peer")->Arg(1)->Arg(100)->Arg(2000);
+BENCHMARK_TEMPLATE(BM_StateSync_Fanout, true)->Name("BM_StateSync_Fanout/shared")->Arg(1)->Arg(100)->Arg(2000);
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
-#include <fstream>
+#include <random>
 
 #include "diff.hpp"
+#include "diff_impl.hpp"
+#include "test_utils.hpp"
+#include "workpool.hpp"
 
 bool test_diff(std::string& old_str, std::string& new_str) {
     static Json::FastWriter writer;
@@ -57,9 +60,7 @@ bool test_diff(std::string& old_str, std::string& new_str) {
 
 // Demonstrate some basic assertions.
 TEST(DiffTest, BasicAssertions) {
-    std::ifstream f("/mnt/c/projects/synclibcpp/test/resources/objects.json");
-    Json::Value jsons;
-    f >> jsons;
+    Json::Value jsons = load_fixtures();
 
     std::cout << "File read" << std::endl;
 
@@ -77,4 +78,514 @@ TEST(DiffTest, BasicAssertions) {
             EXPECT_TRUE(passed);
         }
     }
-}
\ No newline at end of file
+}
+
+TEST(DiffTest, HashCacheMatchesEquality) {
+    Json::Value jsons = load_fixtures();
+
+    for (Json::Value::const_iterator it1 = jsons.begin(); it1 != jsons.end(); ++it1) {
+        for (Json::Value::const_iterator it2 = jsons.begin(); it2 != jsons.end(); ++it2) {
+            HashCache hashes1, hashes2;
+            EXPECT_EQ(*it1 == *it2, hashes1.get(*it1) == hashes2.get(*it2)) << it1.name() << " " << it2.name();
+        }
+    }
+}
+
+TEST(DiffTest, HashedDiffMatchesPlainDiff) {
+    Json::Value jsons = load_fixtures();
+
+    for (Json::Value::const_iterator it1 = jsons.begin(); it1 != jsons.end(); ++it1) {
+        for (Json::Value::const_iterator it2 = jsons.begin(); it2 != jsons.end(); ++it2) {
+            Json::Value plain_diff, hashed_diff;
+            std::string err_msg;
+            HashCache old_hashes, new_hashes;
+            DiffOptions options;
+            options.old_hashes = &old_hashes;
+            options.new_hashes = &new_hashes;
+
+            ASSERT_TRUE(get_diff(*it1, *it2, plain_diff, err_msg));
+            ASSERT_TRUE(get_diff(*it1, *it2, hashed_diff, err_msg, options));
+            EXPECT_EQ(plain_diff, hashed_diff) << it1.name() << " " << it2.name();
+
+            // Caches whose entries live in an arena
+            std::pmr::monotonic_buffer_resource arena;
+            HashCache old_arena_hashes(&arena), new_arena_hashes(&arena);
+            options.old_hashes = &old_arena_hashes;
+            options.new_hashes = &new_arena_hashes;
+            Json::Value arena_diff;
+            ASSERT_TRUE(get_diff(*it1, *it2, arena_diff, err_msg, options));
+            EXPECT_EQ(plain_diff, arena_diff) << it1.name() << " " << it2.name();
+        }
+    }
+}
+
+TEST(DiffTest, HashCacheCopyIsEmpty) {
+    Json::Value doc;
+    doc["a"]["b"] = Json::arrayValue;
+    doc["a"]["b"].append("x");
+
+    HashCache hashes;
+    JsonHash before = hashes.get(doc);
+    HashCache copy = hashes;
+
+    doc["a"]["b"].append("y");
+    EXPECT_NE(before, copy.get(doc));
+    hashes.clear();
+    EXPECT_EQ(copy.get(doc), hashes.get(doc));
+}
+
+TEST(DiffTest, ArrayInsertNearFrontIsSmall) {
+    Json::Value old_json = Json::arrayValue;
+    for (int i = 0; i < 10000; i++) {
+        old_json.append(i);
+    }
+    Json::Value new_json = Json::arrayValue;
+    for (int i = 0; i < 10000; i++) {
+        if (i == 3) new_json.append("inserted");
+        if (i == 5000) continue;
+        new_json.append(i);
+    }
+
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json));
+    EXPECT_LT(Json::FastWriter().write(diff_json).size(), 64u) << diff_json;
+}
+
+TEST(DiffTest, ArrayRandomEditsRoundtrip) {
+    std::mt19937 rng(42);
+    for (int round = 0; round < 200; round++) {
+        Json::Value old_json = Json::arrayValue;
+        int length = rng() % 40;
+        for (int i = 0; i < length; i++) {
+            old_json.append(static_cast<int>(rng() % 10));
+        }
+
+        Json::Value new_json = Json::arrayValue;
+        for (int i = 0; i < length; i++) {
+            switch (rng() % 6) {
+                case 0:
+                    break;
+                case 1:
+                    new_json.append(static_cast<int>(rng() % 10));
+                    new_json.append(old_json[i]);
+                    break;
+                case 2: {
+                    Json::Value item;
+                    item["v"] = static_cast<int>(rng() % 10);
+                    new_json.append(item);
+                    break;
+                }
+                default:
+                    new_json.append(old_json[i]);
+            }
+        }
+
+        Json::Value diff_json;
+        EXPECT_TRUE(diff_roundtrip(old_json, new_json, diff_json)) << old_json << new_json << diff_json;
+    }
+}
+
+Json::Value make_record_list(int length) {
+    Json::Value list = Json::arrayValue;
+    for (int i = 0; i < length; i++) {
+        Json::Value record;
+        record["id"] = "job" + std::to_string(i);
+        record["status"] = "Running";
+        record["logs"] = Json::arrayValue;
+        record["logs"].append("line1");
+        list.append(record);
+    }
+    return list;
+}
+
+// Every cached hash of doc, as kept up to date by apply_diff, matches a freshly computed one
+void expect_hashes_match(const Json::Value &doc, HashCache &hashes) {
+    if (!doc.isArray() && !doc.isObject()) return;
+    HashCache fresh;
+    EXPECT_EQ(hashes.get(doc), fresh.get(doc)) << doc;
+    for (Json::Value::const_iterator it = doc.begin(); it != doc.end(); ++it) {
+        expect_hashes_match(*it, hashes);
+    }
+}
+
+TEST(DiffTest, HashCacheStaysValidAcrossApply) {
+    Json::Value jsons = load_fixtures();
+    jsons["records"] = make_record_list(20);
+    jsons["edited_records"] = make_record_list(25);
+    Json::Value removed;
+    jsons["edited_records"].removeIndex(3, &removed);
+    jsons["edited_records"][7]["logs"].append("line2");
+    jsons["edited_records"][9] = "replaced";
+
+    for (Json::Value::const_iterator it1 = jsons.begin(); it1 != jsons.end(); ++it1) {
+        for (Json::Value::const_iterator it2 = jsons.begin(); it2 != jsons.end(); ++it2) {
+            Json::Value doc = *it1, diff_json;
+            std::string err_msg;
+            HashCache hashes;
+            hashes.get(doc);
+            ASSERT_TRUE(get_diff(*it1, *it2, diff_json, err_msg));
+            ASSERT_TRUE(apply_diff(doc, diff_json, err_msg, hashes)) << err_msg;
+            ASSERT_EQ(doc, *it2);
+            expect_hashes_match(doc, hashes);
+
+            // Hashes carried over to a copy match the copy
+            Json::Value copy = doc;
+            HashCache copy_hashes;
+            hashes.copy_to(doc, copy, copy_hashes);
+            expect_hashes_match(copy, copy_hashes);
+        }
+    }
+}
+
+TEST(DiffTest, KeyedArrayReorderSendsIndices) {
+    Json::Value old_json = make_record_list(1000);
+    Json::Value new_json = Json::arrayValue;
+    for (int i = 999; i >= 0; i--) {
+        new_json.append(old_json[i]);
+    }
+
+    DiffOptions options;
+    options.array_key = "id";
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json, options));
+    EXPECT_EQ(diff_json.size(), 2u) << diff_json;
+    EXPECT_TRUE(diff_json.isMember(">"));
+}
+
+TEST(DiffTest, KeyedArrayRemoveMoveAndPatch) {
+    Json::Value old_json;
+    old_json["jobs"] = make_record_list(100);
+    Json::Value new_json;
+    Json::Value &jobs = new_json["jobs"] = Json::arrayValue;
+
+    // Record 50 moved to the front and patched, record 10 removed and one inserted at 20
+    Json::Value moved = old_json["jobs"][50];
+    moved["status"] = "Done";
+    jobs.append(moved);
+    for (int i = 0; i < 100; i++) {
+        if (i == 10 || i == 50) continue;
+        if (i == 20) {
+            Json::Value added;
+            added["id"] = "new";
+            jobs.append(added);
+        }
+        jobs.append(old_json["jobs"][i]);
+    }
+
+    DiffOptions options;
+    options.array_keys["jobs"] = "id";
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json, options));
+    EXPECT_LT(Json::FastWriter().write(diff_json).size(), 150u) << diff_json;
+
+    // Not configured for this path
+    options.array_keys.clear();
+    options.array_keys["other"] = "id";
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json, options));
+    EXPECT_FALSE(diff_json.isMember("jobs/>")) << diff_json;
+}
+
+TEST(DiffTest, KeyedArrayFallsBackWithoutUniqueKeys) {
+    Json::Value old_json = make_record_list(10);
+    Json::Value new_json = old_json;
+    new_json[3]["id"] = "job4";
+    new_json[5].removeMember("id");
+
+    DiffOptions options;
+    options.array_key = "id";
+    Json::Value diff_json;
+    EXPECT_TRUE(diff_roundtrip(old_json, new_json, diff_json, options));
+}
+
+TEST(DiffTest, StringScatteredEditsUseSeveralHunks) {
+    Json::Value old_json = make_text(5000, 1);
+    std::string new_str = old_json.asString();
+    new_str.insert(4000, "inserted");
+    new_str.erase(2500, 10);
+    new_str.insert(100, "inserted");
+    Json::Value new_json = new_str;
+
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json));
+    EXPECT_EQ(diff_json.size(), 4u) << diff_json;
+}
+
+TEST(DiffTest, StringMovedBlockIsReferenced) {
+    std::string old_str = make_text(200000, 2);
+    std::string block = old_str.substr(50000, 30000);
+    std::string new_str = old_str;
+    new_str.erase(50000, 30000);
+    new_str.insert(150000, block);
+    new_str.insert(1000, "edit");
+
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_str, new_str, diff_json));
+    EXPECT_LT(Json::FastWriter().write(diff_json).size(), 4096u);
+}
+
+TEST(DiffTest, LogAppendsUseAppendDiffs) {
+    Json::Value jsons = load_fixtures();
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(jsons["JOB_3"], jsons["JOB_4"], diff_json));
+    EXPECT_EQ(diff_json["job1/logs"]["_t"], "L") << diff_json;
+
+    Json::Value old_log = make_text(1000, 3);
+    Json::Value new_log = old_log.asString() + "\nnext line";
+    ASSERT_TRUE(diff_roundtrip(old_log, new_log, diff_json));
+    EXPECT_EQ(diff_json["_t"], "C") << diff_json;
+    EXPECT_EQ(diff_json["v"], "\nnext line");
+}
+
+TEST(DiffTest, LargeCountersUseIncrements) {
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(Json::Value(Json::Int64(1234567890123456789)),
+                               Json::Value(Json::Int64(1234567890123456792)), diff_json));
+    EXPECT_EQ(diff_json["_t"], "I") << diff_json;
+    EXPECT_EQ(diff_json["v"], 3);
+
+    ASSERT_TRUE(diff_roundtrip(Json::Value(Json::UInt64(18446744073709551000ULL)),
+                               Json::Value(Json::UInt64(18446744073709550999ULL)), diff_json));
+    EXPECT_EQ(diff_json["_t"], "I") << diff_json;
+
+    ASSERT_TRUE(diff_roundtrip(Json::Value(1.25e100), Json::Value(1.25e100 + 1e85), diff_json));
+
+    // Small counters are cheaper to replace
+    ASSERT_TRUE(diff_roundtrip(Json::Value(41), Json::Value(42), diff_json));
+    EXPECT_EQ(diff_json, 42);
+}
+
+TEST(DiffTest, TimestampsUseIncrementsInBinaryEncoding) {
+    // A job heartbeat in ms, ticking every 5 s, and a byte counter parsed from json text
+    Json::Value old_json, new_json;
+    Json::Reader().parse("{\"updated_at\": 1697040000000, \"bytes\": 73400320, \"done\": 1.5}", old_json);
+    Json::Reader().parse("{\"updated_at\": 1697040005000, \"bytes\": 73400832, \"done\": 2.5}", new_json);
+
+    DiffOptions options;
+    options.encoding = DiffEncoding::Binary;
+    Json::Value diff_json;
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json, options));
+    EXPECT_EQ(diff_json["updated_at"]["_t"], "I") << diff_json;
+    EXPECT_EQ(diff_json["updated_at"]["v"].asInt(), 5000);
+    EXPECT_EQ(diff_json["bytes"]["_t"], "I") << diff_json;
+    EXPECT_EQ(diff_json["done"]["_t"], "I") << diff_json;
+
+    // In json text the 15 bytes around the delta cost more than the new value
+    ASSERT_TRUE(diff_roundtrip(old_json, new_json, diff_json));
+    EXPECT_EQ(diff_json["updated_at"], new_json["updated_at"]) << diff_json;
+}
+
+TEST(DiffTest, AppendMovesItemsAndChecksPayload) {
+    Json::Value log = Json::arrayValue;
+    log.append("line1");
+    Json::Value diff_json;
+    diff_json["_t"] = "L";
+    diff_json["v"].append("line2");
+    std::string err_msg;
+    ASSERT_TRUE(apply_diff(log, diff_json, err_msg)) << err_msg;
+    EXPECT_EQ(log.size(), 2u);
+    EXPECT_EQ(log[1], "line2");
+
+    diff_json["v"] = "line3";
+    EXPECT_FALSE(apply_diff(log, diff_json, err_msg));
+    EXPECT_EQ(log.size(), 2u);
+}
+
+TEST(DiffTest, DiffPathsAreSplitIntoSegments) {
+    std::vector<PathSegment> segments;
+    split_diff_path("jobs/007/0:12/x:1/", segments);
+    ASSERT_EQ(segments.size(), 5u);
+    EXPECT_EQ(segments[0].name, "jobs");
+    EXPECT_FALSE(segments[0].is_index || segments[0].is_range);
+    EXPECT_TRUE(segments[1].is_index);
+    EXPECT_EQ(segments[1].start, 7);
+    EXPECT_TRUE(segments[2].is_range);
+    EXPECT_EQ(segments[2].start, 0);
+    EXPECT_EQ(segments[2].end, 12);
+    EXPECT_FALSE(segments[3].is_index || segments[3].is_range);
+    EXPECT_EQ(segments[4].name, "");
+
+    split_diff_path("99999999999", segments);
+    ASSERT_EQ(segments.size(), 1u);
+    EXPECT_FALSE(segments[0].is_index);
+}
+
+TEST(DiffTest, InvalidPathsAreRejected) {
+    Json::Value doc;
+    Json::Reader().parse("{\"jobs\": [{\"name\": \"a\"}], \"text\": \"abc\"}", doc);
+    const char *diffs[] = {
+        "{\"_t\": \"P\", \"jobs/x/name\": \"b\"}",
+        "{\"_t\": \"P\", \"jobs/-1/name\": \"b\"}",
+        "{\"_t\": \"P\", \"missing/name\": \"b\"}",
+        "{\"_t\": \"P\", \"jobs/name\": \"b\"}",
+        "{\"_t\": \"A\", \"jobs/a:1\": []}",
+        "{\"_t\": \"A\", \"jobs/0:2\": []}",
+        "{\"_t\": \"A\", \"jobs/0:1\": \"b\"}",
+        "{\"_t\": \"S\", \"text/a\": \"b\"}",
+    };
+    for (auto diff_text : diffs) {
+        Json::Value target = doc, diff_json;
+        Json::Reader().parse(diff_text, diff_json);
+        std::string err_msg;
+        EXPECT_FALSE(apply_diff(target, diff_json, err_msg)) << diff_text;
+    }
+}
+
+TEST(DiffTest, ArraySplicesOnlyMoveItemsInBetween) {
+    Json::Value arr = Json::arrayValue;
+    for (int i = 0; i < 20; i++) {
+        arr[i]["id"] = i;
+    }
+    HashCache hashes;
+    hashes.get(arr);
+    std::vector<const Json::Value *> nodes;
+    for (auto &item : arr) {
+        nodes.push_back(&item);
+    }
+    const Json::Value *last_id = &arr[19]["id"];
+
+    // Insert before item 5, delete item 15 and replace 17:19 by one item
+    Json::Value diff_json, expected = Json::arrayValue;
+    Json::Reader().parse("{\"_t\": \"A\", \"5:5\": [{\"id\": -1}], \"15:16\": [], \"17:19\": [{\"id\": -2}]}",
+                         diff_json);
+    for (int i : {0, 1, 2, 3, 4, -1, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, -2, 19}) {
+        expected.append(Json::Value(Json::objectValue))["id"] = i;
+    }
+    std::string err_msg;
+    ASSERT_TRUE(apply_diff(arr, diff_json, err_msg, hashes)) << err_msg;
+    EXPECT_EQ(arr, expected);
+    EXPECT_EQ(hashes.get(arr), HashCache().get(expected));
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(&arr[i], nodes[i]);
+    }
+    // Item 16 is back at its index, the tail after the last splice is moved without copying its subtrees
+    EXPECT_EQ(&arr[16], nodes[16]);
+    EXPECT_EQ(&arr[18]["id"], last_id);
+}
+
+// Diffs of fixtures and random edits, with the encoding of options
+template <typename Check>
+void for_each_diff(const DiffOptions &options, Check check) {
+    Json::Value jsons = load_fixtures();
+    std::string err_msg;
+    for (auto &old_json : jsons) {
+        for (auto &new_json : jsons) {
+            Json::Value diff_json;
+            ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg, options)) << err_msg;
+            check(old_json, new_json, diff_json);
+        }
+    }
+    std::mt19937 rng(9);
+    for (int round = 0; round < 2000; round++) {
+        Json::Value old_json = random_json(rng), new_json = random_json_edit(rng, old_json), diff_json;
+        ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg, options)) << err_msg;
+        check(old_json, new_json, diff_json);
+    }
+}
+
+TEST(DiffTest, EncodedSizeMatchesTheWriter) {
+    Json::FastWriter writer;
+    for_each_diff(DiffOptions{}, [&](const Json::Value &, const Json::Value &new_json, const Json::Value &diff_json) {
+        // Without the trailing newline
+        EXPECT_EQ(encoded_size(diff_json, DiffEncoding::Json) + 1, writer.write(diff_json).size()) << diff_json;
+        EXPECT_EQ(encoded_size(new_json, DiffEncoding::Json) + 1, writer.write(new_json).size()) << new_json;
+        size_t limited = encoded_size(new_json, DiffEncoding::Json, 10);
+        EXPECT_TRUE(limited > 10 || limited + 1 == writer.write(new_json).size());
+    });
+}
+
+TEST(DiffTest, DiffIsNeverLargerThanTheNewValue) {
+    Json::FastWriter writer;
+    for_each_diff(DiffOptions{}, [&](const Json::Value &, const Json::Value &new_json, const Json::Value &diff_json) {
+        if (get_diff_type(diff_json) == DiffType::Unchanged) return;
+        EXPECT_LE(writer.write(diff_json).size(), writer.write(new_json).size()) << new_json << diff_json;
+    });
+}
+
+TEST(DiffTest, DiffShapeOptions) {
+    Json::Value old_json, new_json;
+    Json::Reader().parse("{\"jobs\": {\"a\": {\"status\": \"Running\", \"logs\": [1, 2, 3, 4, 5, 6, 7, 8]}}, "
+                         "\"owner\": \"scheduler\"}",
+                         old_json);
+    new_json = old_json;
+    new_json["jobs"]["a"]["status"] = "Done";
+    std::string err_msg;
+
+    // Small patches are flattened into paths
+    Json::Value diff_json;
+    ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg));
+    EXPECT_EQ(diff_json["jobs/a/status"], "Done") << diff_json;
+
+    DiffOptions nested;
+    nested.merge_threshold = 1;
+    ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg, nested));
+    EXPECT_EQ(diff_json["jobs"]["a"]["status"], "Done") << diff_json;
+
+    // A patch of a few bytes less than the value is not worth it with a higher ratio
+    DiffOptions replacing;
+    replacing.replace_ratio = 4;
+    ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg, replacing));
+    EXPECT_EQ(diff_json, new_json);
+
+    // Deleting most members sends the rest
+    new_json = Json::objectValue;
+    new_json["owner"] = "scheduler";
+    ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg));
+    EXPECT_EQ(diff_json, new_json);
+}
+
+TEST(DiffTest, ParallelDiffMatchesSerialDiff) {
+    WorkPool pool(4);
+    DiffOptions parallel, parallel_keyed, keyed;
+    parallel.pool = &pool;
+    // Chunks of one or two members, so that small documents are split as well
+    parallel.parallel_min_size = 2;
+    keyed.array_key = "id";
+    parallel_keyed = parallel;
+    parallel_keyed.array_key = "id";
+    Json::FastWriter writer;
+    std::string err_msg;
+    for_each_diff(DiffOptions{}, [&](const Json::Value &old_json, const Json::Value &new_json,
+                                     const Json::Value &diff_json) {
+        Json::Value parallel_diff, keyed_diff, parallel_keyed_diff;
+        ASSERT_TRUE(get_diff(old_json, new_json, parallel_diff, err_msg, parallel)) << err_msg;
+        EXPECT_EQ(writer.write(parallel_diff), writer.write(diff_json));
+        ASSERT_TRUE(get_diff(old_json, new_json, keyed_diff, err_msg, keyed)) << err_msg;
+        ASSERT_TRUE(get_diff(old_json, new_json, parallel_keyed_diff, err_msg, parallel_keyed)) << err_msg;
+        EXPECT_EQ(writer.write(parallel_keyed_diff), writer.write(keyed_diff));
+    });
+}
+
+TEST(DiffTest, ParallelDiffFillsTheCallersHashCaches) {
+    Json::Value old_json;
+    for (int i = 0; i < 2000; i++) {
+        Json::Value record;
+        record["id"] = i;
+        record["status"] = "Running";
+        old_json["jobs"]["job" + std::to_string(i)] = record;
+        old_json["queue"].append(record);
+    }
+    Json::Value new_json = old_json;
+    new_json["jobs"]["job7"]["status"] = "Done";
+    new_json["queue"][1500]["status"] = "Done";
+    new_json["jobs"].removeMember("job42");
+
+    WorkPool pool(3);
+    HashCache old_hashes, new_hashes;
+    DiffOptions options;
+    options.pool = &pool;
+    options.parallel_min_size = 64;
+    options.old_hashes = &old_hashes;
+    options.new_hashes = &new_hashes;
+    Json::Value parallel_diff, serial_diff;
+    std::string err_msg;
+    ASSERT_TRUE(get_diff(old_json, new_json, parallel_diff, err_msg, options)) << err_msg;
+    ASSERT_TRUE(get_diff(old_json, new_json, serial_diff, err_msg)) << err_msg;
+    EXPECT_EQ(parallel_diff, serial_diff);
+
+    // The hashes the tasks computed are cached for the next diff
+    HashCache fresh;
+    EXPECT_EQ(old_hashes.get(old_json["jobs"]["job1999"]), fresh.get(old_json["jobs"]["job1999"]));
+    EXPECT_EQ(new_hashes.get(new_json["queue"]), fresh.get(new_json["queue"]));
+    Json::Value new_record = new_json["jobs"]["job1999"];
+    EXPECT_EQ(new_hashes.get(new_json["jobs"]["job1999"]), fresh.get(new_record));
+}
@@ -0,0 +1,209 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "diff.hpp"
+#include "persistent.hpp"
+#include "test_utils.hpp"
+
+// Diffs both representations, the diffs have to be the same and turn old_json into new_json
+void expect_same_diff(const Json::Value &old_json, const Json::Value &new_json, const DiffOptions &options = {}) {
+    PersistentValue old_value(old_json), new_value(new_json);
+    Json::Value json_diff, persistent_diff;
+    std::string err_msg;
+    ASSERT_TRUE(get_diff(old_json, new_json, json_diff, err_msg, options)) << err_msg;
+    ASSERT_TRUE(get_diff(old_value, new_value, persistent_diff, err_msg, options)) << err_msg;
+    EXPECT_EQ(json_diff, persistent_diff) << old_json << new_json;
+
+    PersistentValue applied;
+    ASSERT_TRUE(apply_diff(old_value, persistent_diff, applied, err_msg)) << err_msg << persistent_diff;
+    EXPECT_EQ(applied.to_json(), new_json) << old_json << persistent_diff;
+    EXPECT_EQ(applied.hash(), new_value.hash());
+}
+
+Json::Value patch_object() {
+    Json::Value diff;
+    diff["_t"] = "P";
+    return diff;
+}
+
+TEST(PersistentTest, FixturesRoundtrip) {
+    Json::Value jsons = load_fixtures();
+    for (auto &json : jsons) {
+        PersistentValue value(json);
+        EXPECT_EQ(value.to_json(), json);
+        EXPECT_EQ(PersistentValue(value.to_json()).hash(), value.hash());
+    }
+}
+
+TEST(PersistentTest, LargeObjectsDependOnlyOnTheirMembers) {
+    Json::Value json = Json::objectValue;
+    for (int i = 0; i < 3000; i++) {
+        json["member" + std::to_string(i)] = i;
+    }
+    PersistentValue value(Json::Value(Json::objectValue));
+    std::string err_msg;
+    for (int i = 0; i < 3000; i += 100) {
+        // Inserted in batches, then partly deleted again
+        Json::Value diff = patch_object();
+        for (int j = i; j < i + 100; j++) {
+            diff["member" + std::to_string(j)] = j;
+            diff["extra" + std::to_string(j)] = j;
+        }
+        ASSERT_TRUE(apply_diff(value, diff, value, err_msg)) << err_msg;
+    }
+    Json::Value deletes = patch_object();
+    for (int j = 0; j < 3000; j++) {
+        deletes["extra" + std::to_string(j)] = DIFF_DELETE;
+    }
+    ASSERT_TRUE(apply_diff(value, deletes, value, err_msg)) << err_msg;
+
+    const PersistentValue built(json);
+    EXPECT_EQ(value.size(), 3000u);
+    EXPECT_EQ(value.hash(), built.hash());
+    EXPECT_EQ(value.to_json(), json);
+    EXPECT_EQ(value.find("member1234")->leaf(), 1234);
+    EXPECT_EQ(value.find("extra1234"), nullptr);
+    Json::Value diff_json;
+    ASSERT_TRUE(get_diff(value, built, diff_json, err_msg)) << err_msg;
+    EXPECT_EQ(diff_json, DIFF_UNCHANGED);
+
+    // Shrinking back below a bucket gives the same value as well
+    Json::Value small = Json::objectValue;
+    Json::Value shrink = patch_object();
+    for (int j = 0; j < 3000; j++) {
+        if (j % 200 == 0) {
+            small["member" + std::to_string(j)] = j;
+        } else {
+            shrink["member" + std::to_string(j)] = DIFF_DELETE;
+        }
+    }
+    ASSERT_TRUE(apply_diff(value, shrink, value, err_msg)) << err_msg;
+    EXPECT_EQ(value.hash(), PersistentValue(small).hash());
+    HashCache hashes;
+    EXPECT_EQ(value.hash(), hashes.get(small));
+}
+
+TEST(PersistentTest, LargeObjectDiffsMatchJsonDiffs) {
+    std::mt19937 rng(7);
+    Json::Value doc = Json::objectValue;
+    for (int i = 0; i < 2000; i++) {
+        doc["k" + std::to_string(i)]["v"] = i;
+    }
+    for (int round = 0; round < 50; round++) {
+        Json::Value next_doc = doc;
+        for (int edit = 0; edit < (round % 5) * 20 + 1; edit++) {
+            std::string key = "k" + std::to_string(rng() % 2500);
+            switch (rng() % 3) {
+                case 0:
+                    next_doc.removeMember(key);
+                    break;
+                case 1:
+                    next_doc[key] = Json::objectValue;
+                    next_doc[key]["v"] = (int)(rng() % 100);
+                    break;
+                default:
+                    next_doc[key] = random_json(rng);
+            }
+        }
+        expect_same_diff(doc, next_doc);
+        if (HasFailure()) return;
+        doc = next_doc;
+    }
+}
+
+TEST(PersistentTest, FixtureDiffsMatchJsonDiffs) {
+    Json::Value jsons = load_fixtures();
+    DiffOptions keyed, binary;
+    keyed.array_key = "id";
+    binary.encoding = DiffEncoding::Binary;
+    for (auto &old_json : jsons) {
+        for (auto &new_json : jsons) {
+            expect_same_diff(old_json, new_json);
+            expect_same_diff(old_json, new_json, keyed);
+            expect_same_diff(old_json, new_json, binary);
+        }
+    }
+}
+
+TEST(PersistentTest, RandomEditsMatchJsonDiffs) {
+    std::mt19937 rng(5);
+    DiffOptions options[3];
+    options[1].array_key = "a";
+    options[2].encoding = DiffEncoding::Binary;
+    for (int round = 0; round < 2000; round++) {
+        Json::Value doc = random_json(rng);
+        for (int step = 0; step < 4; step++) {
+            Json::Value next_doc = random_json_edit(rng, doc);
+            expect_same_diff(doc, next_doc, options[round % 3]);
+            if (HasFailure()) return;
+            doc = next_doc;
+        }
+    }
+}
+
+TEST(PersistentTest, ApplyCopiesOnlyTheChangedPath) {
+    Json::Value json;
+    for (int i = 0; i < 100; i++) {
+        json["jobs"]["job" + std::to_string(i)]["status"] = "Running";
+        json["jobs"]["job" + std::to_string(i)]["logs"].append("started");
+    }
+    json["owner"] = "scheduler";
+    const PersistentValue old_value(json);
+
+    Json::Value diff;
+    Json::Reader().parse("{\"_t\": \"P\", \"jobs/job7/status\": \"Done\", \"jobs/job9/logs\": "
+                         "{\"_t\": \"L\", \"v\": [\"done\"]}}",
+                         diff);
+    PersistentValue new_value;
+    std::string err_msg;
+    ASSERT_TRUE(apply_diff(old_value, diff, new_value, err_msg)) << err_msg;
+
+    // The old version is a snapshot that is not affected
+    EXPECT_EQ(old_value.to_json(), json);
+    EXPECT_EQ(new_value.find("jobs")->find("job7")->find("status")->leaf(), "Done");
+    EXPECT_EQ(new_value.find("jobs")->find("job9")->find("logs")->size(), 2u);
+
+    EXPECT_TRUE(new_value.find("owner")->shares(*old_value.find("owner")));
+    const PersistentValue &old_jobs = *old_value.find("jobs"), &new_jobs = *new_value.find("jobs");
+    EXPECT_FALSE(new_jobs.shares(old_jobs));
+    int num_shared = 0;
+    new_jobs.for_each_member([&](const std::string &name, const PersistentValue &job) {
+        num_shared += job.shares(*old_jobs.find(name));
+    });
+    EXPECT_EQ(num_shared, 98);
+    EXPECT_TRUE(new_value.find("jobs")->find("job7")->find("logs")->shares(*old_jobs.find("job7")->find("logs")));
+
+    // Diffing the versions only walks the changed path
+    Json::Value diff_back;
+    ASSERT_TRUE(get_diff(new_value, old_value, diff_back, err_msg)) << err_msg;
+    PersistentValue restored;
+    ASSERT_TRUE(apply_diff(new_value, diff_back, restored, err_msg)) << err_msg;
+    EXPECT_EQ(restored.hash(), old_value.hash());
+    EXPECT_EQ(restored.to_json(), json);
+}
+
+TEST(PersistentTest, InvalidDiffsAreRejected) {
+    Json::Value json;
+    Json::Reader().parse("{\"list\": [1, 2, 3], \"name\": \"abc\"}", json);
+    const PersistentValue value(json);
+    const char *diffs[] = {
+        "{\"_t\": \"P\", \"missing/a\": 1}",
+        "{\"_t\": \"A\", \"list/5\": 1}",
+        "{\"_t\": \"A\", \"list/2:4\": []}",
+        "{\"_t\": \"A\", \"name/0\": 1}",
+        "{\"_t\": \"S\", \"name/1:5\": \"x\"}",
+        "{\"_t\": \"P\", \"list\": {\"_t\": \"C\", \"v\": \"x\"}}",
+        "{\"_t\": \"A\", \"list/>\": [2, 1]}",
+        "{\"_t\": \"X\"}",
+    };
+    for (const char *text : diffs) {
+        Json::Value diff;
+        Json::Reader().parse(text, diff);
+        PersistentValue result;
+        std::string err_msg;
+        EXPECT_FALSE(apply_diff(value, diff, result, err_msg)) << text;
+        EXPECT_FALSE(err_msg.empty());
+    }
+}
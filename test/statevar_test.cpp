@@ -0,0 +1,181 @@
+#include <gtest/gtest.h>
+
+#include "diff_impl.hpp"
+#include "statevar.hpp"
+#include "test_utils.hpp"
+
+// Transport with one peer whose copy of the state is patched with every diff sent to it
+class ReplicaTransport : public StateTransport {
+   public:
+    Json::Value replica;
+    std::vector<Json::Value> sent;
+
+    std::vector<std::string> get_peers() override { return {"peer"}; }
+    bool send_diff(const std::string& peer_id, StateDiff& diff) override {
+        sent.push_back(diff.diff);
+        Json::Value applied = diff.diff;
+        std::string err_msg;
+        EXPECT_TRUE(apply_diff(replica, applied, err_msg)) << err_msg << diff.diff;
+        return true;
+    }
+};
+
+Json::Value make_jobs(int length) {
+    Json::Value doc;
+    for (int i = 0; i < length; i++) {
+        Json::Value job;
+        job["id"] = i;
+        job["status"] = "Running";
+        job["logs"] = Json::arrayValue;
+        doc["jobs"].append(job);
+    }
+    doc["owner"] = "me";
+    return doc;
+}
+
+TEST(StateVarTest, MutationsAreSentAsTheirDiff) {
+    auto state_var = std::make_shared<StateVar>();
+    auto transport = std::make_shared<ReplicaTransport>();
+    state_var->add_transport(transport);
+    std::string err_msg;
+
+    ASSERT_TRUE(state_var->set("", make_jobs(100), err_msg)) << err_msg;
+    state_var->sync();
+    EXPECT_EQ(transport->replica, state_var->get_state()->value);
+
+    ASSERT_TRUE(state_var->set("jobs/42/status", "Done", err_msg)) << err_msg;
+    state_var->sync();
+    ASSERT_EQ(transport->sent.size(), 2u);
+    Json::Value expected = make_diff_json(DiffType::PatchObject);
+    expected["jobs/42/status"] = "Done";
+    EXPECT_EQ(transport->sent.back(), expected);
+    EXPECT_EQ(transport->replica, state_var->get_state()->value);
+
+    // Several mutations are squashed into one diff
+    ASSERT_TRUE(state_var->append("jobs/3/logs", "line1", err_msg)) << err_msg;
+    ASSERT_TRUE(state_var->append("jobs/3/logs", "line2", err_msg)) << err_msg;
+    Json::Value members;
+    members["status"] = "Failed";
+    members["code"] = 3;
+    ASSERT_TRUE(state_var->merge("jobs/3", members, err_msg)) << err_msg;
+    ASSERT_TRUE(state_var->erase("owner", err_msg)) << err_msg;
+    ASSERT_TRUE(state_var->erase("jobs/0", err_msg)) << err_msg;
+    ASSERT_TRUE(state_var->set("jobs/0/id", 100, err_msg)) << err_msg;
+    state_var->sync();
+    ASSERT_EQ(transport->sent.size(), 3u);
+    EXPECT_EQ(transport->replica, state_var->get_state()->value);
+    EXPECT_LT(Json::FastWriter().write(transport->sent.back()).size(), 200u) << transport->sent.back();
+    EXPECT_EQ(state_var->get_state()->value["jobs"][2]["logs"].size(), 2u);
+    EXPECT_FALSE(state_var->get_state()->value.isMember("owner"));
+
+    // Nothing changed
+    state_var->sync();
+    EXPECT_EQ(transport->sent.size(), 3u);
+}
+
+TEST(StateVarTest, MutationsAfterUpdateAreDiffed) {
+    auto state_var = std::make_shared<StateVar>();
+    auto transport = std::make_shared<ReplicaTransport>();
+    state_var->add_transport(transport);
+    std::string err_msg;
+
+    ASSERT_TRUE(state_var->set("", make_jobs(10), err_msg)) << err_msg;
+    state_var->sync();
+    Json::Value synced = state_var->get_state()->value;
+
+    Json::Value updated = make_jobs(12);
+    auto new_value = std::make_shared<StateValue>();
+    new_value->value = updated;
+    new_value->time = state_var->get_state()->time + 1;
+    state_var->update(new_value);
+    ASSERT_TRUE(state_var->set("jobs/11/status", "Done", err_msg)) << err_msg;
+    state_var->sync();
+    EXPECT_EQ(transport->replica, state_var->get_state()->value);
+    EXPECT_EQ(transport->replica["jobs"].size(), 12u);
+
+    // The value passed to update is shared with the peer states, mutations copy it first
+    ASSERT_TRUE(state_var->set("jobs/0/status", "Done", err_msg)) << err_msg;
+    EXPECT_EQ(new_value->value["jobs"][0]["status"], "Running");
+    EXPECT_EQ(synced["jobs"][0]["status"], "Running");
+    state_var->sync();
+    EXPECT_EQ(transport->replica, state_var->get_state()->value);
+}
+
+TEST(StateVarTest, InvalidPathsAreRejected) {
+    auto state_var = std::make_shared<StateVar>();
+    std::string err_msg;
+    ASSERT_TRUE(state_var->set("", make_jobs(3), err_msg)) << err_msg;
+    Json::Value before = state_var->get_state()->value;
+
+    EXPECT_FALSE(state_var->set("missing/status", 1, err_msg));
+    EXPECT_FALSE(state_var->set("jobs/3", 1, err_msg));
+    EXPECT_FALSE(state_var->set("jobs/x", 1, err_msg));
+    EXPECT_FALSE(state_var->set("owner/name", 1, err_msg));
+    EXPECT_FALSE(state_var->erase("", err_msg));
+    EXPECT_FALSE(state_var->erase("missing", err_msg));
+    EXPECT_FALSE(state_var->append("owner", 1, err_msg));
+    EXPECT_FALSE(state_var->append("missing", 1, err_msg));
+    EXPECT_FALSE(state_var->merge("jobs", Json::objectValue, err_msg));
+    EXPECT_FALSE(state_var->merge("jobs/0", 1, err_msg));
+    EXPECT_EQ(state_var->get_state()->value, before);
+
+    // New members can be set where their object exists
+    EXPECT_TRUE(state_var->set("jobs/0/started", true, err_msg)) << err_msg;
+    EXPECT_TRUE(state_var->get_state()->value["jobs"][0]["started"].asBool());
+}
+
+// Transport of several peers that records how often diffs are sent
+class CountingTransport : public StateTransport {
+   public:
+    std::vector<std::string> peers;
+    std::vector<std::vector<std::string>> broadcasts;
+
+    std::vector<std::string> get_peers() override { return peers; }
+    bool send_diff(const std::string& peer_id, StateDiff& diff) override { return broadcast_diff({peer_id}, diff); }
+    bool broadcast_diff(const std::vector<std::string>& peer_ids, StateDiff& diff) override {
+        broadcasts.push_back(peer_ids);
+        return true;
+    }
+    void receive(const std::string& peer_id, StateDiff diff) {
+        for (auto& listener : listeners) {
+            listener.second(peer_id, diff);
+        }
+    }
+};
+
+TEST(StateVarTest, PeersAtTheSameVersionShareOneDiff) {
+    auto state_var = std::make_shared<StateVar>();
+    auto transport = std::make_shared<CountingTransport>();
+    transport->peers = {"a", "b", "c", "d"};
+    state_var->add_transport(transport);
+    std::string err_msg;
+
+    ASSERT_TRUE(state_var->set("", make_jobs(10), err_msg)) << err_msg;
+    state_var->sync();
+    ASSERT_EQ(transport->broadcasts.size(), 1u);
+    EXPECT_EQ(transport->broadcasts[0].size(), 4u);
+
+    // Peer b sends a change, it is at another version than the others from then on
+    StateDiff received;
+    received.time = state_var->get_state()->time + 1;
+    received.diff = make_diff_json(DiffType::PatchObject);
+    received.diff["owner"] = "b";
+    transport->receive("b", received);
+    ASSERT_TRUE(state_var->set("jobs/1/status", "Done", err_msg)) << err_msg;
+    transport->peers.push_back("e");
+    state_var->sync();
+    // a, c and d, b and the new peer e
+    ASSERT_EQ(transport->broadcasts.size(), 4u);
+    std::vector<size_t> group_sizes;
+    for (size_t i = 1; i < 4; i++) {
+        group_sizes.push_back(transport->broadcasts[i].size());
+    }
+    std::sort(group_sizes.begin(), group_sizes.end());
+    EXPECT_EQ(group_sizes, (std::vector<size_t>{1, 1, 3}));
+
+    // All are at the same version again
+    ASSERT_TRUE(state_var->set("jobs/2/status", "Done", err_msg)) << err_msg;
+    state_var->sync();
+    ASSERT_EQ(transport->broadcasts.size(), 5u);
+    EXPECT_EQ(transport->broadcasts[4].size(), 5u);
+}
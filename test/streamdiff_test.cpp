@@ -0,0 +1,215 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <sstream>
+
+#include "diff.hpp"
+#include "test_utils.hpp"
+
+// Diffs the serialized documents as streams, true if applying the diff to old_json gives new_json
+bool stream_roundtrip(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                      const DiffOptions &options = {}, bool styled = false) {
+    std::string old_text, new_text;
+    if (styled) {
+        old_text = Json::StyledWriter().write(old_json);
+        new_text = Json::StyledWriter().write(new_json);
+    } else {
+        old_text = Json::FastWriter().write(old_json);
+        new_text = Json::FastWriter().write(new_json);
+    }
+    std::istringstream old_in(old_text), new_in(new_text);
+    std::string err_msg;
+    if (!stream_diff(old_in, new_in, diff_json, err_msg, options)) {
+        std::cout << "stream_diff failed: " << err_msg << std::endl;
+        return false;
+    }
+    Json::Value recon_json = old_json, applied_diff = diff_json;
+    if (!apply_diff(recon_json, applied_diff, err_msg)) {
+        std::cout << "apply_diff failed: " << err_msg << std::endl;
+        return false;
+    }
+    return recon_json == new_json;
+}
+
+Json::Value make_records(int length) {
+    Json::Value doc;
+    for (int i = 0; i < length; i++) {
+        Json::Value &record = doc["record" + std::to_string(i)];
+        record["id"] = i;
+        record["status"] = "Running";
+        record["tags"].append("a");
+    }
+    return doc;
+}
+
+TEST(StreamDiffTest, FixturePairsRoundtrip) {
+    Json::Value jsons = load_fixtures();
+    for (auto &old_name : jsons.getMemberNames()) {
+        for (auto &new_name : jsons.getMemberNames()) {
+            Json::Value diff_json;
+            EXPECT_TRUE(stream_roundtrip(jsons[old_name], jsons[new_name], diff_json))
+                << old_name << " -> " << new_name << ": " << diff_json;
+        }
+    }
+}
+
+TEST(StreamDiffTest, RandomEditsRoundtrip) {
+    std::mt19937 rng(7);
+    for (int round = 0; round < 500; round++) {
+        Json::Value old_json = random_json(rng);
+        Json::Value new_json = random_json_edit(rng, old_json);
+        Json::Value diff_json;
+        EXPECT_TRUE(stream_roundtrip(old_json, new_json, diff_json, {}, round % 2 == 1))
+            << old_json << new_json << diff_json;
+    }
+}
+
+TEST(StreamDiffTest, UnchangedDocumentsGiveUnchangedDiff) {
+    Json::Value doc = make_records(100);
+    Json::Value diff_json;
+    ASSERT_TRUE(stream_roundtrip(doc, doc, diff_json));
+    EXPECT_EQ(get_diff_type(diff_json), DiffType::Unchanged) << diff_json;
+
+    ASSERT_TRUE(stream_roundtrip(doc["record1"]["tags"], doc["record1"]["tags"], diff_json));
+    EXPECT_EQ(get_diff_type(diff_json), DiffType::Unchanged) << diff_json;
+}
+
+TEST(StreamDiffTest, LeafChangeIsOneEntry) {
+    Json::Value old_json = make_records(5000);
+    Json::Value new_json = old_json;
+    new_json["record4321"]["status"] = "Done";
+    std::istringstream old_in(Json::FastWriter().write(old_json)), new_in(Json::FastWriter().write(new_json));
+
+    std::vector<std::string> paths;
+    Json::Value entry;
+    std::string err_msg;
+    ASSERT_TRUE(stream_diff(
+        old_in, new_in,
+        [&](const std::string &path, Json::Value &diff) {
+            paths.push_back(path);
+            entry = diff;
+        },
+        err_msg))
+        << err_msg;
+    ASSERT_EQ(paths.size(), 1u);
+    EXPECT_EQ(paths[0], "record4321/status");
+    EXPECT_EQ(entry, "Done");
+}
+
+TEST(StreamDiffTest, AddedAndRemovedMembers) {
+    Json::Value old_json = make_records(20);
+    Json::Value new_json = old_json;
+    new_json.removeMember("record3");
+    new_json["record5"].removeMember("tags");
+    new_json["record55"]["id"] = 55;
+    new_json["record7"]["extra"] = true;
+
+    Json::Value diff_json;
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json));
+    EXPECT_EQ(get_diff_type(diff_json["record3"]), DiffType::Delete) << diff_json;
+    EXPECT_EQ(get_diff_type(diff_json["record5/tags"]), DiffType::Delete) << diff_json;
+    EXPECT_EQ(diff_json["record55"], new_json["record55"]) << diff_json;
+    EXPECT_EQ(diff_json["record7/extra"], true) << diff_json;
+}
+
+TEST(StreamDiffTest, ArrayAppendsAndChangesAfterEqualItems) {
+    Json::Value old_json;
+    for (int i = 0; i < 100; i++) {
+        old_json["log"].append("line" + std::to_string(i));
+    }
+
+    Json::Value new_json = old_json;
+    new_json["log"].append("line100");
+    Json::Value diff_json;
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json));
+    EXPECT_EQ(get_diff_type(diff_json["log"]), DiffType::AppendArray) << diff_json;
+
+    // Only the items from the first change on are diffed, their indices are those of the whole array
+    new_json = old_json;
+    new_json["log"][90] = "changed";
+    new_json["log"].resize(95);
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json));
+    EXPECT_EQ(get_diff_type(diff_json["log"]), DiffType::PatchArray) << diff_json;
+    EXPECT_LT(Json::FastWriter().write(diff_json).size(), 80u) << diff_json;
+
+    new_json = old_json;
+    new_json["log"].resize(50);
+    new_json["log"].append(1);
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json));
+
+    new_json = old_json;
+    new_json["log"].resize(0);
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json));
+}
+
+TEST(StreamDiffTest, KeyedArraysUseArrayKeys) {
+    Json::Value old_json;
+    for (int i = 0; i < 100; i++) {
+        Json::Value job;
+        job["id"] = "job" + std::to_string(i);
+        job["status"] = "Running";
+        old_json["jobs"].append(job);
+    }
+    // Record 60 moved to after record 9 and patched
+    Json::Value new_json = old_json;
+    Json::Value &jobs = new_json["jobs"] = Json::arrayValue;
+    for (int i = 0; i < 100; i++) {
+        if (i == 60) continue;
+        jobs.append(old_json["jobs"][i]);
+        if (i == 9) {
+            jobs.append(old_json["jobs"][60]);
+            jobs[10]["status"] = "Done";
+        }
+    }
+
+    DiffOptions options;
+    options.array_keys["jobs"] = "id";
+    Json::Value diff_json;
+    ASSERT_TRUE(stream_roundtrip(old_json, new_json, diff_json, options));
+    EXPECT_TRUE(diff_json["jobs"].isMember(">")) << diff_json;
+    EXPECT_LT(Json::FastWriter().write(diff_json).size(), 100u) << diff_json;
+}
+
+TEST(StreamDiffTest, NumbersAndStringsDecodeLikeReader) {
+    std::string old_text = R"({"a":1,"b":"x","c":[1,2]})";
+    std::string new_text =
+        R"({"a":-9223372036854775808,"b":"é😀\n\"","c":[1,18446744073709551615,1e300,2.5,3000000000]})";
+    Json::Value expected;
+    ASSERT_TRUE(Json::Reader().parse(new_text, expected));
+
+    std::istringstream old_in(old_text), new_in(new_text);
+    Json::Value diff_json;
+    std::string err_msg;
+    ASSERT_TRUE(stream_diff(old_in, new_in, diff_json, err_msg)) << err_msg;
+    Json::Value recon_json;
+    ASSERT_TRUE(Json::Reader().parse(old_text, recon_json));
+    ASSERT_TRUE(apply_diff(recon_json, diff_json, err_msg)) << err_msg;
+    EXPECT_EQ(recon_json, expected);
+    EXPECT_EQ(recon_json["c"][4].type(), expected["c"][4].type());
+}
+
+TEST(StreamDiffTest, UnsortedMembersOnlyFailWhenTheyDiffer) {
+    std::istringstream old_in(R"({"b":1,"a":{"y":1,"x":2}})"), new_in(R"({"b":1,"a":{"y":1,"x":3}})");
+    Json::Value diff_json;
+    std::string err_msg;
+    ASSERT_TRUE(stream_diff(old_in, new_in, diff_json, err_msg)) << err_msg;
+    EXPECT_EQ(diff_json["a/x"], 3) << diff_json;
+
+    std::istringstream unsorted_old(R"({"b":1,"a":2})"), unsorted_new(R"({"b":1,"c":2})");
+    EXPECT_FALSE(stream_diff(unsorted_old, unsorted_new, diff_json, err_msg));
+    EXPECT_NE(err_msg.find("not sorted"), std::string::npos) << err_msg;
+}
+
+TEST(StreamDiffTest, MalformedInputIsRejected) {
+    const char *bad_inputs[] = {
+        R"({"a":1)",  R"({"a" 1})", R"({"a":1,})", R"([1,2)", R"([1 2])",  R"({"a":tru})",
+        R"({"a":"x)", R"({"a":-})", R"({a:1})",    R"({"a":1} x)", R"("\q")", R"({"a":"\u12g4"})",
+    };
+    for (const char *bad : bad_inputs) {
+        std::istringstream old_in(R"({"a":0})"), new_in(bad);
+        Json::Value diff_json;
+        std::string err_msg;
+        EXPECT_FALSE(stream_diff(old_in, new_in, diff_json, err_msg)) << bad;
+        EXPECT_FALSE(err_msg.empty()) << bad;
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef __PROJECTS_SYNCLIBCPP_TEST_TEST_UTILS_HPP_
+#define __PROJECTS_SYNCLIBCPP_TEST_TEST_UTILS_HPP_
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "diff.hpp"
+
+#ifndef TEST_RESOURCES_DIR
+#define TEST_RESOURCES_DIR "test/resources"
+#endif
+
+// Named documents of test/resources/objects.json
+inline Json::Value load_fixtures() {
+    std::ifstream f(TEST_RESOURCES_DIR "/objects.json");
+    Json::Value jsons;
+    f >> jsons;
+    return jsons;
+}
+
+// Random lowercase words and lines
+inline std::string make_text(int length, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::string text;
+    text.reserve(length);
+    for (int i = 0; i < length; i++) {
+        text += "abcdefghijklmnopqrstuvwxyz \n"[rng() % 28];
+    }
+    return text;
+}
+
+// Diffs old_json against new_json, true if applying the diff to old_json gives new_json
+inline bool diff_roundtrip(const Json::Value &old_json, const Json::Value &new_json, Json::Value &diff_json,
+                           const DiffOptions &options = {}) {
+    std::string err_msg;
+    if (!get_diff(old_json, new_json, diff_json, err_msg, options)) {
+        std::cout << "get_diff failed: " << err_msg << std::endl;
+        return false;
+    }
+    // apply_diff consumes the diff, diff_json is left for the caller to inspect
+    Json::Value recon_json = old_json, applied_diff = diff_json;
+    if (!apply_diff(recon_json, applied_diff, err_msg)) {
+        std::cout << "apply_diff failed: " << err_msg << std::endl;
+        return false;
+    }
+    return recon_json == new_json;
+}
+
+// Random document of nested objects, arrays, strings and numbers
+inline Json::Value random_json(std::mt19937 &rng, int depth = 0) {
+    int type = depth > 2 ? rng() % 3 : rng() % 6;
+    switch (type) {
+        case 0:
+            return static_cast<int>(rng() % 5);
+        case 1:
+            return make_text(rng() % 12, rng());
+        case 2:
+            return Json::Value::null;
+        case 3:
+        case 4: {
+            Json::Value arr = Json::arrayValue;
+            for (int i = rng() % 8; i > 0; i--) {
+                arr.append(random_json(rng, depth + 1));
+            }
+            return arr;
+        }
+        default: {
+            Json::Value obj = Json::objectValue;
+            for (int i = rng() % 4; i > 0; i--) {
+                obj[std::string(1, 'a' + rng() % 4)] = random_json(rng, depth + 1);
+            }
+            return obj;
+        }
+    }
+}
+
+// Random edits of every kind the diff has types for: appends, splices, reorders and string edits
+inline Json::Value random_json_edit(std::mt19937 &rng, const Json::Value &val, int depth = 0) {
+    if (rng() % 8 == 0) return random_json(rng, depth);
+    if (val.isArray()) {
+        Json::Value arr = Json::arrayValue;
+        if (rng() % 3 == 0) {
+            // Appends only
+            arr = val;
+            for (int i = rng() % 3; i >= 0; i--) arr.append(random_json(rng, depth + 1));
+            return arr;
+        }
+        std::vector<Json::Value> items(val.begin(), val.end());
+        if (rng() % 4 == 0) std::shuffle(items.begin(), items.end(), rng);
+        for (auto &item : items) {
+            switch (rng() % 6) {
+                case 0:
+                    break;
+                case 1:
+                    arr.append(random_json(rng, depth + 1));
+                    arr.append(item);
+                    break;
+                case 2:
+                    arr.append(random_json_edit(rng, item, depth + 1));
+                    break;
+                default:
+                    arr.append(item);
+            }
+        }
+        return arr;
+    }
+    if (val.isObject()) {
+        Json::Value obj = val;
+        for (auto &name : val.getMemberNames()) {
+            if (rng() % 3 == 0) obj[name] = random_json_edit(rng, val[name], depth + 1);
+            if (rng() % 6 == 0) obj.removeMember(name);
+        }
+        if (rng() % 4 == 0) obj[std::string(1, 'a' + rng() % 4)] = random_json(rng, depth + 1);
+        return obj;
+    }
+    if (val.isString()) {
+        std::string str = val.asString();
+        if (rng() % 2) return str + make_text(rng() % 5 + 1, rng());
+        size_t pos = str.empty() ? 0 : rng() % str.size();
+        return str.substr(0, pos) + make_text(rng() % 3, rng()) + str.substr(std::min(str.size(), pos + rng() % 3));
+    }
+    if (val.isInt()) return val.asInt() + static_cast<int>(rng() % 5) - 2;
+    return val;
+}
+
+#endif  // __PROJECTS_SYNCLIBCPP_TEST_TEST_UTILS_HPP_
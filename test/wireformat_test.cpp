@@ -0,0 +1,233 @@
+#include <gtest/gtest.h>
+
+#include "diff.hpp"
+#include "diff_impl.hpp"
+#include "test_utils.hpp"
+#include "wireformat.hpp"
+
+// Encodes with one dictionary and decodes with its mirror, like the two ends of a session
+void expect_roundtrip(const Json::Value &diff, uint64_t time, KeyDictionary &send_keys, KeyDictionary &recv_keys) {
+    std::string data, err_msg;
+    Json::Value decoded;
+    uint64_t decoded_time;
+    ASSERT_TRUE(encode_binary_diff(diff, time, send_keys, data, err_msg));
+    ASSERT_TRUE(decode_binary_diff(data.data(), data.size(), recv_keys, decoded, decoded_time, err_msg)) << err_msg;
+    EXPECT_EQ(diff, decoded);
+    EXPECT_EQ(diff.toStyledString(), decoded.toStyledString());
+    EXPECT_EQ(time, decoded_time);
+    EXPECT_EQ(send_keys.size(), recv_keys.size());
+}
+
+TEST(WireFormatTest, FixtureDiffsRoundtrip) {
+    Json::Value jsons = load_fixtures();
+    KeyDictionary send_keys, recv_keys;
+    uint64_t time = 1;
+
+    for (Json::Value::const_iterator it1 = jsons.begin(); it1 != jsons.end(); ++it1) {
+        for (Json::Value::const_iterator it2 = jsons.begin(); it2 != jsons.end(); ++it2) {
+            Json::Value diff;
+            std::string err_msg;
+            ASSERT_TRUE(get_diff(*it1, *it2, diff, err_msg));
+            expect_roundtrip(diff, time++, send_keys, recv_keys);
+        }
+    }
+}
+
+TEST(WireFormatTest, ValuesAndKeysRoundtrip) {
+    Json::Value diff;
+    diff["_t"] = "P";
+    diff["a/3/0:5"]["_t"] = "S";
+    diff["a/3/0:5"]["2:4"] = "xy";
+    diff["007/x:1/5:3"] = "not indices";
+    diff["list"]["_t"] = "A";
+    diff["list"][">"].append(2);
+    diff["list"]["0:0"].append(Json::Value::null);
+    diff["counter"]["_t"] = "I";
+    diff["counter"]["v"] = Json::Value(static_cast<Json::Int64>(-9000000000LL));
+    diff["log"]["_t"] = "L";
+    diff["log"]["v"].append(Json::Value::maxUInt64);
+    diff["big"] = Json::Value::minInt64;
+    diff["pi"] = 3.14159;
+    diff["flags"].append(true);
+    diff["flags"].append(false);
+    diff["empty"] = "";
+    // Plain objects are sent member by member, even if they look like diffs
+    diff["plain"]["a/b"] = 1;
+    diff["plain"]["_t"] = "Z";
+    diff["fake"]["_t"] = "U";
+    diff["fake"]["extra"] = 1;
+    diff["del"]["_t"] = "X";
+    diff["odd_append"]["_t"] = "C";
+    diff["odd_append"]["v"] = "x";
+    diff["odd_append"]["w"] = 1;
+    diff[""] = Json::Value(Json::objectValue);
+
+    KeyDictionary send_keys, recv_keys;
+    expect_roundtrip(diff, 42, send_keys, recv_keys);
+}
+
+TEST(WireFormatTest, InternedKeysShrinkLaterMessages) {
+    Json::Value diff;
+    diff["_t"] = "P";
+    diff["jobs/12/status"] = "running";
+    diff["jobs/12/progress"] = 10;
+
+    // Names are interned when they are used the second time, "jobs" already within the first message
+    KeyDictionary send_keys, recv_keys;
+    std::string messages[3], err_msg;
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(encode_binary_diff(diff, i, send_keys, messages[i], err_msg));
+    }
+    EXPECT_LT(messages[1].size(), messages[0].size());
+    EXPECT_LT(messages[2].size(), messages[1].size());
+    EXPECT_LT(messages[2].size(), Json::FastWriter().write(diff).size() / 2);
+
+    for (auto &message : messages) {
+        Json::Value decoded;
+        uint64_t time;
+        ASSERT_TRUE(decode_binary_diff(message.data(), message.size(), recv_keys, decoded, time, err_msg)) << err_msg;
+        EXPECT_EQ(diff, decoded);
+    }
+    EXPECT_EQ(send_keys.size(), 3u);
+    EXPECT_EQ(recv_keys.size(), 3u);
+}
+
+TEST(WireFormatTest, OneOffNamesAreNotInterned) {
+    // Every diff names a different record, only the member names repeat
+    KeyDictionary send_keys, recv_keys;
+    std::string err_msg;
+    for (int i = 0; i < 20000; i++) {
+        Json::Value diff;
+        diff["_t"] = "P";
+        diff["record" + std::to_string(i) + "/status"] = "Done";
+        std::string data;
+        ASSERT_TRUE(encode_binary_diff(diff, i, send_keys, data, err_msg));
+        Json::Value decoded;
+        uint64_t time;
+        ASSERT_TRUE(decode_binary_diff(data.data(), data.size(), recv_keys, decoded, time, err_msg)) << err_msg;
+        ASSERT_EQ(diff, decoded);
+    }
+    EXPECT_EQ(send_keys.size(), 1u);
+    EXPECT_EQ(recv_keys.size(), 1u);
+
+    // Room is left for names that do repeat
+    Json::Value diff;
+    diff["_t"] = "P";
+    diff["summary/total"] = 1;
+    std::string messages[3];
+    for (auto &message : messages) {
+        ASSERT_TRUE(encode_binary_diff(diff, 0, send_keys, message, err_msg));
+    }
+    EXPECT_EQ(send_keys.find("summary"), 1);
+    EXPECT_EQ(send_keys.find("total"), 2);
+    EXPECT_LT(messages[2].size() + 10, messages[0].size());
+}
+
+TEST(WireFormatTest, LostMessageIsDetected) {
+    KeyDictionary send_keys, recv_keys;
+    std::string messages[3], err_msg;
+    for (int i = 0; i < 3; i++) {
+        Json::Value diff;
+        diff["_t"] = "P";
+        diff["jobs/job" + std::to_string(i % 2) + "/status"] = "Running";
+        ASSERT_TRUE(encode_binary_diff(diff, i, send_keys, messages[i], err_msg));
+    }
+
+    Json::Value decoded;
+    uint64_t time;
+    ASSERT_TRUE(decode_binary_diff(messages[0].data(), messages[0].size(), recv_keys, decoded, time, err_msg));
+    // messages[1] is lost, messages[2] uses keys it interned
+    EXPECT_FALSE(decode_binary_diff(messages[2].data(), messages[2].size(), recv_keys, decoded, time, err_msg));
+    EXPECT_NE(err_msg.find("out of sync"), std::string::npos) << err_msg;
+    EXPECT_TRUE(recv_keys.is_broken());
+
+    // The dictionary stays unusable
+    EXPECT_FALSE(decode_binary_diff(messages[1].data(), messages[1].size(), recv_keys, decoded, time, err_msg));
+}
+
+TEST(WireFormatTest, SharedDictionariesAreEncodedOnce) {
+    // Sessions 0 and 1 were sent the same frames, session 2 got one more, fresh is held by the server too
+    SharedKeyDictionary fresh = std::make_shared<KeyDictionary>();
+    std::vector<SharedKeyDictionary> sessions = {fresh, fresh, fresh};
+    std::vector<KeyDictionary> receivers(3);
+    std::vector<SharedKeyDictionary *> keys = {&sessions[0], &sessions[1], &sessions[2]};
+    std::vector<std::shared_ptr<const std::string>> frames;
+    std::string err_msg;
+    Json::Value decoded;
+    uint64_t time;
+
+    for (int i = 0; i < 4; i++) {
+        Json::Value diff;
+        diff["_t"] = "P";
+        diff["jobs/job" + std::to_string(i % 2) + "/status"] = "Running";
+        if (i == 1) {
+            std::vector<SharedKeyDictionary *> one = {&sessions[2]};
+            ASSERT_TRUE(encode_binary_diff_shared(diff, i, one, frames, err_msg));
+            ASSERT_TRUE(decode_binary_diff(frames[0]->data(), frames[0]->size(), receivers[2], decoded, time, err_msg));
+            continue;
+        }
+        ASSERT_TRUE(encode_binary_diff_shared(diff, i, keys, frames, err_msg));
+        ASSERT_EQ(frames.size(), 3u);
+        EXPECT_EQ(frames[0], frames[1]);
+        EXPECT_EQ(sessions[0], sessions[1]);
+        if (i > 1) EXPECT_NE(frames[0], frames[2]);
+        for (int k = 0; k < 3; k++) {
+            ASSERT_TRUE(decode_binary_diff(frames[k]->data(), frames[k]->size(), receivers[k], decoded, time, err_msg))
+                << err_msg;
+            EXPECT_EQ(decoded, diff);
+        }
+    }
+    // The dictionary held outside the sessions is left as it was
+    EXPECT_EQ(fresh->version(), 0u);
+    EXPECT_EQ(sessions[0]->size(), receivers[0].size());
+    EXPECT_EQ(sessions[2]->size(), receivers[2].size());
+}
+
+TEST(WireFormatTest, MalformedMessagesAreRejected) {
+    Json::Value diff;
+    diff["_t"] = "P";
+    diff["name"] = "value";
+    KeyDictionary send_keys;
+    std::string data, err_msg;
+    ASSERT_TRUE(encode_binary_diff(diff, 7, send_keys, data, err_msg));
+
+    for (size_t len = 0; len < data.size(); len++) {
+        KeyDictionary recv_keys;
+        Json::Value decoded;
+        uint64_t time;
+        EXPECT_FALSE(decode_binary_diff(data.data(), len, recv_keys, decoded, time, err_msg)) << len;
+    }
+
+    // Messages have to be decoded in order
+    std::string second;
+    ASSERT_TRUE(encode_binary_diff(diff, 8, send_keys, second, err_msg));
+    KeyDictionary recv_keys;
+    Json::Value decoded;
+    uint64_t time;
+    EXPECT_FALSE(decode_binary_diff(second.data(), second.size(), recv_keys, decoded, time, err_msg));
+
+    std::string text = "{\"time\":1}";
+    EXPECT_FALSE(decode_binary_diff(text.data(), text.size(), recv_keys, decoded, time, err_msg));
+}
+
+TEST(WireFormatTest, DiffsPickTheSmallestShapeForTheEncoding) {
+    DiffOptions options;
+    options.encoding = DiffEncoding::Binary;
+    std::string err_msg;
+    std::mt19937 rng(4);
+    for (int round = 0; round < 3000; round++) {
+        Json::Value old_json = random_json(rng), new_json = random_json_edit(rng, old_json), diff_json;
+        ASSERT_TRUE(get_diff(old_json, new_json, diff_json, err_msg, options)) << err_msg;
+
+        // The estimate counts names as sent inline, they are interned from their second use on
+        KeyDictionary diff_keys, value_keys;
+        std::string diff_data, value_data;
+        ASSERT_TRUE(encode_binary_diff(diff_json, 1, diff_keys, diff_data, err_msg)) << err_msg;
+        ASSERT_TRUE(encode_binary_diff(new_json, 1, value_keys, value_data, err_msg)) << err_msg;
+        // Message header of 3 bytes
+        EXPECT_GE(encoded_size(diff_json, DiffEncoding::Binary) + 3, diff_data.size());
+        if (get_diff_type(diff_json) != DiffType::Unchanged) {
+            EXPECT_LE(diff_data.size(), value_data.size()) << new_json << diff_json;
+        }
+    }
+}
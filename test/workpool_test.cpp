@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+
+#include "workpool.hpp"
+
+// Sums 0..n-1 by splitting the range in halves down to single numbers
+void parallel_sum(WorkPool &pool, int begin, int end, std::atomic<long> &sum) {
+    if (end - begin == 1) {
+        sum += begin;
+        return;
+    }
+    int mid = (begin + end) / 2;
+    WorkPool::Group group;
+    pool.spawn(group, [&] { parallel_sum(pool, begin, mid, sum); });
+    parallel_sum(pool, mid, end, sum);
+    pool.wait(group);
+}
+
+TEST(WorkPoolTest, NestedTasks) {
+    for (int num_threads : {1, 2, 8}) {
+        WorkPool pool(num_threads);
+        EXPECT_EQ(pool.num_threads(), num_threads);
+        std::atomic<long> sum{0};
+        parallel_sum(pool, 0, 10000, sum);
+        EXPECT_EQ(sum.load(), 10000L * 9999 / 2);
+    }
+}
+
+TEST(WorkPoolTest, GroupsAreWaitedForSeparately) {
+    WorkPool pool(4);
+    std::vector<int> results(64, 0);
+    WorkPool::Group first, second;
+    for (int i = 0; i < 32; i++) {
+        pool.spawn(first, [&, i] { results[i] = i; });
+        pool.spawn(second, [&, i] { results[32 + i] = 32 + i; });
+    }
+    pool.wait(first);
+    for (int i = 0; i < 32; i++) EXPECT_EQ(results[i], i);
+    pool.wait(second);
+    for (int i = 0; i < 64; i++) EXPECT_EQ(results[i], i);
+}
+
+TEST(WorkPoolTest, TasksFromOutsideThreads) {
+    WorkPool pool(4);
+    std::atomic<int> count{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            WorkPool::Group group;
+            for (int i = 0; i < 1000; i++) {
+                pool.spawn(group, [&] { count++; });
+            }
+            pool.wait(group);
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    EXPECT_EQ(count.load(), 4000);
+}